@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include "hist.h"
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <pthread.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Load generator: starts main, runs senders from client threads and
+ * prints results as one JSON line. Every str is a sender process, so a
+ * client runs one at a time and latency is from its start to its exit.
+ * Closed loop by default, a client starts next sender once previous one
+ * is done. Given a rate it is open loop: senders are scheduled and
+ * latency counts from the scheduled time, so a stalled main isn't
+ * hidden by clients which wait for it.
+ */
+
+#define BENCH_CLIENTS  4
+#define BENCH_MSGS     100000
+#define BENCH_SIZE     64
+#define BENCH_MAIN     "build/echoloop"
+#define BENCH_STR      "BENCH"
+#define BENCH_READY_MS 5000
+
+struct bench_client {
+	pthread_t thread;
+	size_t id;
+	size_t msgs;
+	uint64_t seed;
+	int failed;
+	struct hist latency;	/* From start of sender to its exit, in ns */
+};
+
+size_t              bench_clients = BENCH_CLIENTS;
+size_t              bench_msgs = BENCH_MSGS;
+size_t              bench_size_min = BENCH_SIZE;
+size_t              bench_size_max = BENCH_SIZE;
+double              bench_rate = 0; /* Msgs/s of all clients, 0 is closed loop */
+char               *bench_main = BENCH_MAIN;
+char               *bench_payload; /* Strs are its prefixes */
+uint64_t            bench_start_ns;
+extern char       **environ;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec  = ns / 1000000000,
+		.tv_nsec = ns % 1000000000
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+}
+
+/* Clients take turns, so all of them together keep the rate */
+static uint64_t bench_schedule(struct bench_client *client, size_t seq)
+{
+	double at = (seq * bench_clients + client->id) / bench_rate;
+	return bench_start_ns + (uint64_t) (at * 1e9);
+}
+
+/* Uniform in [bench_size_min, bench_size_max], xorshift64 */
+static size_t bench_size(struct bench_client *client)
+{
+	uint64_t x = client->seed;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	client->seed = x;
+	return bench_size_min + x % (bench_size_max - bench_size_min + 1);
+}
+
+/* Runs a sender and waits for it */
+static int bench_send_one(struct bench_client *client, uint64_t start)
+{
+	size_t str_s = bench_size(client);
+	char str[str_s + 1];
+	memcpy(str, bench_payload, str_s);
+	str[str_s] = '\0';
+
+	posix_spawn_file_actions_t actions;
+	if (posix_spawn_file_actions_init(&actions) != 0 ||
+	    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+			"/dev/null", O_WRONLY, 0) != 0) {
+		fprintf(stderr, "Error: posix_spawn_file_actions\n");
+		return -1;
+	}
+	char *argv[] = { bench_main, str, NULL };
+	pid_t pid;
+	int ret = posix_spawn(&pid, bench_main, &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (ret != 0) {
+		errno = ret;
+		perror("Error: posix_spawn");
+		return -1;
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("Error: waitpid");
+			return -1;
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "Error: sender failed\n");
+		return -1;
+	}
+
+	hist_add(&client->latency, now_ns() - start);
+	return 0;
+}
+
+void *bench_client(void *arg)
+{
+	struct bench_client *client = arg;
+
+	for (size_t seq = 0; seq < client->msgs; seq++) {
+		uint64_t start;
+		if (bench_rate) {
+			start = bench_schedule(client, seq);
+			sleep_until(start);
+		} else {
+			start = now_ns();
+		}
+		if (bench_send_one(client, start) < 0) {
+			client->failed = 1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Main starts its printer thread once it takes strs */
+int bench_main_ready(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	char line[256];
+	int threads = 0;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "Threads: %d", &threads) == 1)
+			break;
+	}
+	fclose(file);
+	return threads > 1;
+}
+
+pid_t bench_main_start(char **argv)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Error: fork");
+		return -1;
+	}
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+			perror("Error: open");
+			_exit(EXIT_FAILURE);
+		}
+		execv(bench_main, argv);
+		perror("Error: execv");
+		_exit(EXIT_FAILURE);
+	}
+
+	for (int ms = 0; ms < BENCH_READY_MS; ms++) {
+		/* It was a sender if some main is running already */
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "Error: main exited\n");
+			return -1;
+		}
+		if (bench_main_ready(pid))
+			return pid;
+		usleep(1000);
+	}
+	fprintf(stderr, "Error: main didn't start\n");
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static uint64_t rusage_ns(struct rusage *ru)
+{
+	return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ull +
+		(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ull;
+}
+
+/* Returns CPU time main has used, it's idle but for the run */
+uint64_t bench_main_stop(pid_t pid)
+{
+	struct rusage ru;
+	kill(pid, SIGQUIT);
+	if (wait4(pid, NULL, 0, &ru) < 0)
+		return 0;
+	return rusage_ns(&ru);
+}
+
+/* Of the bench and senders it has waited for */
+uint64_t bench_client_cpu()
+{
+	struct rusage self, children;
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	return rusage_ns(&self) + rusage_ns(&children);
+}
+
+void json_str(char *key, char **strs)
+{
+	printf("\"%s\": \"", key);
+	for (size_t i = 0; strs[i]; i++) {
+		if (i)
+			putchar(' ');
+		for (char *c = strs[i]; *c; c++) {
+			if (*c == '"' || *c == '\\')
+				putchar('\\');
+			putchar(*c);
+		}
+	}
+	printf("\", ");
+}
+
+void bench_report(char **main_args, struct hist *lat, double elapsed,
+		  uint64_t client_cpu, uint64_t main_cpu)
+{
+	printf("{\"bench\": \"echoloop\", ");
+	json_str("main_args", main_args);
+	printf("\"clients\": %zu, \"rate\": %.0f, \"size_min\": %zu, "
+		"\"size_max\": %zu, ", bench_clients, bench_rate,
+		bench_size_min, bench_size_max);
+	printf("\"msgs\": %llu, \"seconds\": %.3f, \"msgs_per_sec\": %.0f, ",
+		(unsigned long long) lat->count, elapsed,
+		lat->count / elapsed);
+	printf("\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+		"\"max_us\": %.1f, ", hist_quantile(lat, 0.5) / 1e3,
+		hist_quantile(lat, 0.99) / 1e3,
+		hist_quantile(lat, 0.999) / 1e3, lat->max / 1e3);
+	printf("\"client_cpu_us_per_msg\": %.3f, "
+		"\"main_cpu_us_per_msg\": %.3f}\n",
+		client_cpu / 1e3 / lat->count, main_cpu / 1e3 / lat->count);
+}
+
+/* "N" or "MIN-MAX", a str is an argv of sender, so it's never empty */
+int parse_size(char *str)
+{
+	char *end;
+	bench_size_min = strtoul(str, &end, 0);
+	bench_size_max = bench_size_min;
+	if (*end == '-')
+		bench_size_max = strtoul(end + 1, &end, 0);
+	if (*end != '\0' || !bench_size_min ||
+	    bench_size_max < bench_size_min)
+		return -1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:s:R:x:")) != -1) {
+		switch (opt) {
+		case 'c':
+			bench_clients = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			bench_msgs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (parse_size(optarg) < 0) {
+				fprintf(stderr, "Wrong size: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R':
+			bench_rate = strtod(optarg, NULL);
+			break;
+		case 'x':
+			bench_main = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c clients] [-n msgs] "
+				"[-s size|min-max] [-R rate] [-x echoloop] "
+				"[-- main args]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!bench_clients || !bench_msgs || bench_rate < 0) {
+		fprintf(stderr, "Wrong argv\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Main gets args after "--" */
+	size_t nargs = argc - optind;
+	char **main_argv = calloc(nargs + 3, sizeof(char *));
+	bench_payload = malloc(bench_size_max + 1);
+	struct bench_client *clients = calloc(bench_clients,
+		sizeof(*clients));
+	if (!main_argv || !bench_payload || !clients) {
+		perror("Error: malloc");
+		exit(EXIT_FAILURE);
+	}
+	main_argv[0] = bench_main;
+	memcpy(&main_argv[1], &argv[optind], nargs * sizeof(char *));
+	main_argv[nargs + 1] = BENCH_STR;
+	for (size_t i = 0; i < bench_size_max; i++)
+		bench_payload[i] = 'a' + i % 26;
+
+	pid_t main_pid = bench_main_start(main_argv);
+	if (main_pid < 0)
+		exit(EXIT_FAILURE);
+
+	uint64_t client_cpu = bench_client_cpu();
+	bench_start_ns = now_ns();
+
+	size_t started = 0;
+	for (; started < bench_clients; started++) {
+		struct bench_client *client = &clients[started];
+		client->id = started;
+		client->msgs = bench_msgs / bench_clients +
+			(started < bench_msgs % bench_clients);
+		client->seed = 0x9e3779b97f4a7c15ull * (started + 1);
+		hist_init(&client->latency);
+		int ret = pthread_create(&client->thread, NULL, bench_client,
+			client);
+		if (ret != 0) {
+			errno = ret;
+			perror("Error: pthread_create");
+			break;
+		}
+	}
+
+	struct hist lat;
+	hist_init(&lat);
+	int failed = started < bench_clients;
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(clients[i].thread, NULL);
+		failed |= clients[i].failed;
+		hist_merge(&lat, &clients[i].latency);
+	}
+
+	double elapsed = (now_ns() - bench_start_ns) / 1e9;
+	client_cpu = bench_client_cpu() - client_cpu;
+	uint64_t main_cpu = bench_main_stop(main_pid);
+
+	if (failed || !lat.count) {
+		fprintf(stderr, "Error: benchmark failed\n");
+		exit(EXIT_FAILURE);
+	}
+	bench_report(&main_argv[1], &lat, elapsed, client_cpu, main_cpu);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include "demux.h"
+#include "strlist.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Framing edge cases of demux. Every case feeds frames to a new demux,
+ * checks what demux_add returns for each one, then what the strlist
+ * prints. Prints one line per case and fails if any case does.
+ */
+
+#define CHECK_FRAMES 8
+
+struct check_frame {
+	pid_t pid;
+	int flags;
+	size_t total;
+	char *data;
+	int ret;
+};
+
+struct check_case {
+	char *name;
+	struct check_frame frames[CHECK_FRAMES];
+	char *out;
+};
+
+#define FIRST DEMUX_FIRST
+#define LAST  DEMUX_LAST
+
+static struct check_case check_cases[] = {
+	{ "whole str", {
+		{ 1, FIRST | LAST, 3, "abc", DEMUX_DONE } }, "abc\n" },
+	{ "first|last shorter than total", {
+		{ 1, FIRST | LAST, 5, "abc", DEMUX_BROKEN },
+		{ 1, LAST, 5, "de", 0 } }, "" },
+	{ "first longer than total", {
+		{ 1, FIRST, 2, "abc", DEMUX_BROKEN } }, "" },
+	{ "total over max", {
+		{ 1, FIRST, DEMUX_MAX_STR + 1, "abc", DEMUX_BROKEN } }, "" },
+	{ "continuation without first", {
+		{ 1, 0, 6, "abc", 0 },
+		{ 1, LAST, 6, "def", 0 } }, "" },
+	{ "pieces", {
+		{ 1, FIRST, 6, "ab", 0 },
+		{ 1, 0, 6, "cd", 0 },
+		{ 1, LAST, 6, "ef", DEMUX_DONE } }, "abcdef\n" },
+	{ "last short of total", {
+		{ 1, FIRST, 6, "abc", 0 },
+		{ 1, LAST, 6, "de", DEMUX_BROKEN },
+		{ 1, LAST, 6, "f", 0 } }, "" },
+	{ "piece past total", {
+		{ 1, FIRST, 4, "abc", 0 },
+		{ 1, 0, 4, "de", DEMUX_BROKEN } }, "" },
+	{ "first starts over", {
+		{ 1, FIRST, 6, "abc", 0 },
+		{ 1, FIRST, 3, "xyz", 0 },
+		{ 1, LAST, 3, "", DEMUX_DONE } }, "xyz\n" },
+	{ "senders interleaved", {
+		{ 1, FIRST, 4, "ab", 0 },
+		{ 2, FIRST, 4, "wx", 0 },
+		{ 2, LAST, 4, "yz", DEMUX_DONE },
+		{ 1, LAST, 4, "cd", DEMUX_DONE } }, "abcd\nwxyz\n" },
+};
+
+static int check_run(struct check_case *cc)
+{
+	int ret = -1;
+	strlist_t *list = strlist_new();
+	demux_t *demux = list ? demux_new(list) : NULL;
+	int fd = memfd_create("check", 0);
+	if (!demux || fd < 0) {
+		perror("Error: check setup");
+		goto handle_err;
+	}
+
+	for (size_t i = 0; i < CHECK_FRAMES && cc->frames[i].data; i++) {
+		struct check_frame *frame = &cc->frames[i];
+		int got = demux_add(demux, frame->pid, frame->flags,
+			frame->total, frame->data, strlen(frame->data));
+		if (got != frame->ret) {
+			fprintf(stderr, "%s: frame %zu returned %d, not %d\n",
+				cc->name, i, got, frame->ret);
+			goto handle_err;
+		}
+	}
+
+	char out[64];
+	if (strlist_print(list, fd) < 0) {
+		perror("Error: strlist_print");
+		goto handle_err;
+	}
+	ssize_t out_s = pread(fd, out, sizeof(out) - 1, 0);
+	if (out_s < 0) {
+		perror("Error: pread");
+		goto handle_err;
+	}
+	out[out_s] = '\0';
+	if (strcmp(out, cc->out)) {
+		fprintf(stderr, "%s: printed \"%s\", not \"%s\"\n", cc->name,
+			out, cc->out);
+		goto handle_err;
+	}
+	ret = 0;
+
+handle_err:
+	if (fd >= 0)
+		close(fd);
+	if (demux)
+		demux_delete(demux);
+	if (list)
+		strlist_delete(list);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+
+	for (size_t i = 0; i < sizeof(check_cases) / sizeof(*check_cases);
+	     i++) {
+		int ret = check_run(&check_cases[i]);
+		printf("%s %s\n", ret < 0 ? "FAIL" : "ok", check_cases[i].name);
+		if (ret < 0)
+			failed++;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+#include "demux.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct demux_str {
+	pid_t pid;
+	char *str;
+	size_t got;
+	size_t total;
+};
+
+struct demux {
+	strlist_t *list;
+	size_t nstrs;
+	size_t strs_s;
+	struct demux_str *strs;
+};
+
+struct demux *demux_new(strlist_t *list)
+{
+	struct demux *demux = calloc(1, sizeof(*demux));
+	if (!demux)
+		return NULL;
+	demux->list = list;
+	return demux;
+}
+
+/* Partial strs are left unfinished, list is deleted anyway */
+void demux_delete(struct demux *demux)
+{
+	free(demux->strs);
+	free(demux);
+}
+
+static struct demux_str *demux_find(struct demux *demux, pid_t pid)
+{
+	for (size_t i = 0; i < demux->nstrs; i++) {
+		if (demux->strs[i].pid == pid)
+			return &demux->strs[i];
+	}
+	return NULL;
+}
+
+static void demux_remove(struct demux *demux, struct demux_str *str)
+{
+	*str = demux->strs[--demux->nstrs];
+}
+
+static int demux_start(struct demux *demux, pid_t pid, char *str,
+		       size_t total)
+{
+	if (demux->nstrs == demux->strs_s) {
+		size_t strs_s = demux->strs_s ? demux->strs_s * 2 : 8;
+		struct demux_str *strs = realloc(demux->strs,
+			strs_s * sizeof(*strs));
+		if (!strs)
+			return -1;
+		demux->strs = strs;
+		demux->strs_s = strs_s;
+	}
+	demux->strs[demux->nstrs++] = (struct demux_str) {
+		.pid   = pid,
+		.str   = str,
+		.got   = 0,
+		.total = total
+	};
+	return 0;
+}
+
+int demux_add(struct demux *demux, pid_t pid, int flags, size_t total,
+	      char *data, size_t len)
+{
+	if (flags & DEMUX_FIRST) {
+		/* Sender starts over, what it sent before is not finished */
+		demux_drop(demux, pid);
+		if (len > total || total > DEMUX_MAX_STR ||
+		    ((flags & DEMUX_LAST) && len != total)) {
+			fprintf(stderr, "Error: broken str from sender\n");
+			return DEMUX_BROKEN;
+		}
+		char *str = strlist_reserve(demux->list, total);
+		if (!str) {
+			perror("Error: strlist_reserve");
+			return -1;
+		}
+		memcpy(str, data, len);
+		if (flags & DEMUX_LAST) {
+			strlist_commit(demux->list, str);
+			return DEMUX_DONE;
+		}
+		if (demux_start(demux, pid, str, total) < 0) {
+			perror("Error: realloc");
+			strlist_cancel(demux->list, str);
+			return -1;
+		}
+		demux->strs[demux->nstrs - 1].got = len;
+		return 0;
+	}
+
+	/* Start of the str was dropped */
+	struct demux_str *str = demux_find(demux, pid);
+	if (!str)
+		return 0;
+	if (str->got + len > str->total ||
+	    ((flags & DEMUX_LAST) && str->got + len != str->total)) {
+		fprintf(stderr, "Error: broken str from sender\n");
+		strlist_cancel(demux->list, str->str);
+		demux_remove(demux, str);
+		return DEMUX_BROKEN;
+	}
+	memcpy(str->str + str->got, data, len);
+	str->got += len;
+	if (!(flags & DEMUX_LAST))
+		return 0;
+	strlist_commit(demux->list, str->str);
+	demux_remove(demux, str);
+	return DEMUX_DONE;
+}
+
+void demux_drop(struct demux *demux, pid_t pid)
+{
+	struct demux_str *str = demux_find(demux, pid);
+	if (!str)
+		return;
+	strlist_cancel(demux->list, str->str);
+	demux_remove(demux, str);
+}
+
+size_t demux_reap(struct demux *demux)
+{
+	size_t dropped = 0;
+
+	for (size_t i = 0; i < demux->nstrs;) {
+		struct demux_str *str = &demux->strs[i];
+		if (kill(str->pid, 0) == 0 || errno != ESRCH) {
+			i++;
+			continue;
+		}
+		strlist_cancel(demux->list, str->str);
+		demux_remove(demux, str);
+		dropped++;
+	}
+	return dropped;
+}
+
+size_t demux_pending(struct demux *demux)
+{
+	return demux->nstrs;
+}
@@ -0,0 +1,38 @@
+#ifndef DEMUX_H_
+#define DEMUX_H_
+
+#include "strlist.h"
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * Puts together strs which come from many senders at once, each one
+ * in pieces. Pieces of one str come in order, the first one says how
+ * long the whole str is. A str goes to the strlist as it arrives and is
+ * committed with its last piece.
+ */
+
+#define DEMUX_FIRST 1
+#define DEMUX_LAST  2
+/* Strs come from argv, this is MAX_ARG_STRLEN with 64 KiB pages */
+#define DEMUX_MAX_STR (32 << 16)
+
+#define DEMUX_DONE   1	/* Str is complete */
+#define DEMUX_BROKEN 2	/* Str is dropped, its sender may be told */
+
+typedef struct demux demux_t;
+
+demux_t *demux_new(strlist_t *list);
+void demux_delete(demux_t *demux);
+
+/* Returns DEMUX_DONE, DEMUX_BROKEN or 0 if more of the str is expected */
+int demux_add(demux_t *demux, pid_t pid, int flags, size_t total,
+	      char *data, size_t len);
+/* Partial str of a sender is dropped */
+void demux_drop(demux_t *demux, pid_t pid);
+/* Drops partial strs of dead senders, returns how many */
+size_t demux_reap(demux_t *demux);
+size_t demux_pending(demux_t *demux);
+
+#endif /* DEMUX_H_ */
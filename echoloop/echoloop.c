@@ -1,11 +1,15 @@
+#include "demux.h"
+#include "printer.h"
+#include "shmring.h"
 #include "sopbuf.h"
 #include "strlist.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/time.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
+#include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <errno.h>
@@ -13,194 +17,189 @@
 #include <limits.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 enum echoloop_semnum {
 	SEM_SINGLE,
-	SEM_MAIN,
-	SEM_SENDER,
-	SEM_TR_ACTIVE,
-	SEM_TR_DONE,
 	SEM_MAX
 };
 
 #define MAX_SOPS 8
 #define ECHO_INTERVAL 1
 #define FIFO_LOCATION "/tmp/echoloop.fifo"
+#define SHM_PROJ_ID 2 /* Ring key, semaphores use 1 */
+#define WAIT_MS 100 /* Peers are checked this often while waiting */
+#define ACK_SIGNAL SIGURG /* Ignored by default, so a stray one is harmless */
+
+/*
+ * Senders write into the FIFO at once. Every frame is written by a
+ * single write of at most PIPE_BUF bytes, so frames are never mixed.
+ * Longer strs are split into several frames.
+ */
+struct echo_frame {
+	int32_t pid;
+	uint16_t flags;		/* DEMUX_FIRST, DEMUX_LAST */
+	uint16_t len;		/* Of data */
+	uint64_t total;		/* Of the whole str */
+};
+
+#define FRAME_DATA_MAX (PIPE_BUF - sizeof(struct echo_frame))
+
+struct echo_frame_buf {
+	struct echo_frame hdr;
+	char data[FRAME_DATA_MAX];
+};
+
+/* Main reads many frames at once, a cut one waits for the next read */
+#define RECV_BUF_SIZE (16 * PIPE_BUF)
+
+struct echo_recv_buf {
+	size_t len;
+	char buf[RECV_BUF_SIZE];
+};
 
 strlist_t *echo_strlist = NULL;
+struct timespec echo_interval = { .tv_sec = ECHO_INTERVAL };
+pthread_t echo_main_thread;
+shmring_t *echo_ring = NULL;
+demux_t *echo_demux = NULL;
+struct echo_recv_buf echo_recv;
 jmp_buf sighandler_exit_buf;
 
-void sighandler_echo_strlist(int sig)
+/* Runs in printer thread, main thread is told to quit on failure */
+int echoloop_print(void *arg)
 {
 	if (strlist_print(echo_strlist, STDOUT_FILENO) >= 0)
-		return;
-	struct sigaction sa_ign = { .sa_handler = SIG_IGN };
-	sigaction(SIGALRM, &sa_ign, NULL);
+		return 0;
+	pthread_kill(echo_main_thread, SIGUSR1);
+	return -1;
+}
+
+void sighandler_fail(int sig)
+{
 	longjmp(sighandler_exit_buf, -1);
 }
 
 void sighandler_quit(int sig)
 {
 	fprintf(stderr, "%s caught, exiting...\n", strsignal(sig));
-	struct sigaction sa_ign = { .sa_handler = SIG_IGN };
-	sigaction(SIGALRM, &sa_ign, NULL);
 	longjmp(sighandler_exit_buf, 1);
 }
 
-int echoloop_main_ready(sopbuf_t *sops)
+/* Partial strs of dead senders are dropped */
+void echoloop_main_reap()
 {
-	/* Do not start while previous transfer is running */
-	sopbuf_add(sops, SEM_TR_ACTIVE, 0, 0);
-	sopbuf_add(sops, SEM_MAIN,      1, SEM_UNDO);
-	if (sopbuf_semop(sops) < 0) {
-		perror("Error: semop");
-		return -1;
-	}
-	return 0;
-}
+	static struct timespec last;
+	struct timespec now;
 
-int echoloop_main_enter_section(sopbuf_t *sops)
-{
-	/* Wait for sender */
-	/* Up active */
-	sopbuf_add(sops, SEM_SENDER,    -1, 0);
-	sopbuf_add(sops, SEM_SENDER,     1, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE,  1, SEM_UNDO);
-	if (sopbuf_semop(sops) < 0) {
-		perror("Error: semop");
-		return -1;
-	}
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if ((now.tv_sec - last.tv_sec) * 1000 +
+	    (now.tv_nsec - last.tv_nsec) / 1000000 < WAIT_MS)
+		return;
+	last = now;
 
-	/* Check that sender process is running */
-	/* Wait for sender process to be active */
-	sopbuf_add(sops, SEM_SENDER,    -1, IPC_NOWAIT);
-	sopbuf_add(sops, SEM_SENDER,     1, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE, -2, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE,  2, 0);
-	if (sopbuf_semop(sops) < 0) {
-		if (errno == EAGAIN)
-			fprintf(stderr, "Error: sender process is dead\n");
-		else
-			perror("Error: semop");
-		return -1;
-	}
-	return 0;
+	if (demux_reap(echo_demux))
+		fprintf(stderr, "Error: sender process is dead\n");
 }
 
-int echoloop_main_quit_section(sopbuf_t *sops)
+/* Anyone may write the FIFO, so only pids of running echoloops are told */
+int echoloop_is_sender(pid_t pid)
 {
-	/* Transfer done */
-	sopbuf_add(sops, SEM_TR_DONE, 1, SEM_UNDO);
-	if (sopbuf_semop(sops) < 0) {
-		perror("Error: semop");
-		return -1;
-	}
-
-	/* Check that sender process is active */
-	/* Wait for sender */
-	/* Release main lock */
-	sopbuf_add(sops, SEM_TR_ACTIVE, -2, IPC_NOWAIT);
-	sopbuf_add(sops, SEM_TR_ACTIVE,  2, 0);
-	sopbuf_add(sops, SEM_TR_DONE,   -2, 0);
-	sopbuf_add(sops, SEM_TR_DONE,    2, 0);
-	sopbuf_add(sops, SEM_MAIN,      -1, SEM_UNDO);
-	if (sopbuf_semop(sops) == -1) {
-		if (errno == EAGAIN)
-			fprintf(stderr, "Error: main process failed\n");
-		else
-			perror("Error: semop");
-		return -1;
-	}
-
-	/* Success, wait for sender */
-	/* Disable transfer */
-	/* Restore SEM_TR_DONE */
-	sopbuf_add(sops, SEM_SENDER,     0, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE, -1, SEM_UNDO);
-	sopbuf_add(sops, SEM_TR_DONE,   -1, SEM_UNDO);
-	if (sopbuf_semop(sops) == -1) {
-		perror("Error: semop");
-		return -1;
-	}
-	return 0;
+	static struct stat self;
+	struct stat st;
+	char path[32];
+
+	if (pid <= 0)
+		return 0;
+	if (!self.st_ino && stat("/proc/self/exe", &self) < 0)
+		return 0;
+	snprintf(path, sizeof(path), "/proc/%d/exe", (int) pid);
+	if (stat(path, &st) < 0)
+		return 0;
+	return st.st_dev == self.st_dev && st.st_ino == self.st_ino;
 }
 
-int echoloop_main_receive(sopbuf_t *sops, int fifo_fd)
+int echoloop_main_receive(int fifo_fd)
 {
-	if (echoloop_main_ready(sops) < 0)
-		return -1;
-
-	if (echoloop_main_enter_section(sops) < 0)
-		return -1;
-
-	ssize_t ret;
-	size_t buf_s;
-
-	ret = read(fifo_fd, &buf_s, sizeof(size_t));
-	if (ret != sizeof(size_t)) {
-		fprintf(stderr, "Error: read sizeof str");
+	/* Wake up now and then while some strs are partial */
+	struct pollfd pfd = { .fd = fifo_fd, .events = POLLIN };
+	int ret = poll(&pfd, 1, demux_pending(echo_demux) ? WAIT_MS : -1);
+	if (ret < 0) {
+		perror("Error: poll");
 		return -1;
 	}
+	if (demux_pending(echo_demux))
+		echoloop_main_reap();
+	if (ret == 0)
+		return 0;
 
-	char *buf = malloc(buf_s);
-	if (!buf) {
-		perror("Error: malloc");
+	/* Takes whatever is queued, a frame cut at the end is kept */
+	ssize_t got = read(fifo_fd, &echo_recv.buf[echo_recv.len],
+		sizeof(echo_recv.buf) - echo_recv.len);
+	if (got <= 0) {
+		fprintf(stderr, "Error: can't read frames\n");
 		return -1;
 	}
+	echo_recv.len += got;
 
-	char *ptr = buf;
-	size_t rem = buf_s;
-
-	while (rem) {
-		ret = read(fifo_fd, ptr, rem);
-		if (ret < 0) {
-			perror("Error: read");
-			free(buf);
+	size_t off = 0;
+	while (echo_recv.len - off >= sizeof(struct echo_frame)) {
+		/* Frames follow each other unaligned */
+		struct echo_frame hdr;
+		memcpy(&hdr, &echo_recv.buf[off], sizeof(hdr));
+		if (hdr.len > FRAME_DATA_MAX ||
+		    (hdr.flags & ~(DEMUX_FIRST | DEMUX_LAST))) {
+			fprintf(stderr, "Error: broken frame\n");
 			return -1;
 		}
-		ptr += ret;
-		rem -= ret;
-		if (ret == 0 && rem != 0) {
-			fprintf(stderr, "Error: can't receive full data\n");
-			free(buf);
+		if (echo_recv.len - off < sizeof(hdr) + hdr.len)
+			break;
+
+		ret = demux_add(echo_demux, hdr.pid, hdr.flags, hdr.total,
+			&echo_recv.buf[off + sizeof(hdr)], hdr.len);
+		if (ret < 0)
 			return -1;
+		/* Sender waits for it, it may be gone already */
+		if (ret && echoloop_is_sender(hdr.pid)) {
+			union sigval val = { .sival_int = ret == DEMUX_BROKEN };
+			sigqueue(hdr.pid, ACK_SIGNAL, val);
 		}
+		off += sizeof(hdr) + hdr.len;
 	}
 
-	if (strlist_append(echo_strlist, buf, buf_s) < 0) {
-		perror("Error: strlist_append");
-		free(buf);
-		return -1;
-	}
-
-	if (echoloop_main_quit_section(sops) < 0)
-		return -1;
+	echo_recv.len -= off;
+	memmove(echo_recv.buf, &echo_recv.buf[off], echo_recv.len);
 	return 0;
 }
 
 int echoloop_main(sopbuf_t *sops, char *data)
 {
 	int fifo_fd = 0;
-	char *data_copy = NULL;
+	int printing = 0;
+	pthread_t printer;
 
-	fifo_fd = open(FIFO_LOCATION, O_RDONLY | O_NONBLOCK);
-	if (fifo_fd < 0) {
-		perror("Error: open");
+#ifdef ECHOLOOP_SHM
+	key_t key = ftok(FIFO_LOCATION, SHM_PROJ_ID);
+	if (key < 0) {
+		perror("Error: ftok");
 		goto handle_err;
 	}
-	if (fcntl(fifo_fd, F_SETFL, 0) < 0) {
-		perror("Error: fnctl");
+	echo_ring = shmring_create(key);
+	if (!echo_ring) {
+		perror("Error: shmring_create");
 		goto handle_err;
 	}
-
-	data_copy = strdup(data);
-	if (!data_copy) {
-		perror("Error: strdup");
+#else
+	/* Own write end keeps reads blocking while no sender is there */
+	fifo_fd = open(FIFO_LOCATION, O_RDWR);
+	if (fifo_fd < 0) {
+		perror("Error: open");
 		goto handle_err;
 	}
+#endif
 
 	echo_strlist = strlist_new();
 	if (!echo_strlist) {
@@ -208,141 +207,121 @@ int echoloop_main(sopbuf_t *sops, char *data)
 		goto handle_err;
 	}
 
-	if (strlist_append(echo_strlist, data_copy, strlen(data_copy)) < 0) {
-		perror("Error: strlist_append");
+	echo_demux = demux_new(echo_strlist);
+	if (!echo_demux) {
+		perror("Error: demux_new");
 		goto handle_err;
 	}
-	data_copy = NULL;
-
-	struct sigaction echo_sa = {
-		.sa_handler = sighandler_echo_strlist,
-		.sa_flags   = SA_RESTART
-	};
 
-	struct itimerval echo_time = {
-		.it_interval = { .tv_sec = ECHO_INTERVAL, .tv_usec = 0 },
-		.it_value    = { .tv_sec = ECHO_INTERVAL, .tv_usec = 0 }
-	};
-
-	if (sigaction(SIGALRM, &echo_sa, NULL) < 0) {
-		perror("Error: sigaction");
+	if (strlist_append(echo_strlist, data, strlen(data)) < 0) {
+		perror("Error: strlist_append");
 		goto handle_err;
 	}
 
-	if (setitimer(ITIMER_REAL, &echo_time, NULL) < 0) {
-		perror("Error: setitimer\n");
+	if (printer_start(&printer, &echo_interval, -1, echoloop_print,
+			NULL, NULL) < 0) {
+		perror("Error: printer_start");
 		goto handle_err;
 	}
+	printing = 1;
 
 	while (1) {
-		if (echoloop_main_receive(sops, fifo_fd) < 0)
+#ifdef ECHOLOOP_SHM
+		if (shmring_receive(echo_ring, echo_demux) < 0)
+			goto handle_err;
+#else
+		if (echoloop_main_receive(fifo_fd) < 0)
 			goto handle_err;
+#endif
 	}
 
-handle_err: ; /* Can't write decalarion right after label */
-
-	struct sigaction sa_ign = { .sa_handler = SIG_IGN };
-	sigaction(SIGALRM, &sa_ign, NULL);
-
+handle_err:
+	if (printing)
+		printer_stop(printer);
+	if (echo_ring) {
+		shmring_delete(echo_ring);
+		echo_ring = NULL;
+	}
 	if (fifo_fd)
 		close(fifo_fd);
-	if (data_copy)
-		free(data_copy);
+	if (echo_demux)
+		demux_delete(echo_demux);
 	if (echo_strlist)
 		strlist_delete(echo_strlist);
 	return -1;
 }
 
-int echoloop_sender_capture(sopbuf_t *sops)
+#ifdef ECHOLOOP_SHM
+/* No semaphores here, the ring checks that main is alive */
+int echoloop_sender(sopbuf_t *sops, char *data)
 {
-	/* Capture sender "mutex" */
-	/* Do not start while previous transfer is running */
-	sopbuf_add(sops, SEM_TR_ACTIVE, 0, 0);
-	sopbuf_add(sops, SEM_SENDER,    0, 0);
-	sopbuf_add(sops, SEM_SENDER,    1, SEM_UNDO);
-	if (sopbuf_semop(sops) < 0) {
-		perror("Error: semop");
+	key_t key = ftok(FIFO_LOCATION, SHM_PROJ_ID);
+	if (key < 0) {
+		perror("Error: ftok");
 		return -1;
 	}
-	return 0;
-}
-
-int echoloop_sender_enter_section(sopbuf_t *sops)
-{
-	/* Check that main process is running */
-	/* Wait main process to be ready for transfer */
-	/* Up active */
-	sopbuf_add(sops, SEM_SINGLE,    -1, IPC_NOWAIT);
-	sopbuf_add(sops, SEM_SINGLE,     1, 0);
-	sopbuf_add(sops, SEM_MAIN,      -1, 0);
-	sopbuf_add(sops, SEM_MAIN,       1, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE,  1, SEM_UNDO);
-	if (sopbuf_semop(sops) < 0) {
-		if (errno == EAGAIN)
+	shmring_t *ring = shmring_attach(key);
+	if (!ring) {
+		if (errno == ESRCH)
 			fprintf(stderr, "Error: main process is dead\n");
 		else
-			perror("Error: semop");
+			perror("Error: shmring_attach");
 		return -1;
 	}
 
-	/* Check that main process is ready/running */
-	/* Wait for main process to be active */
-	sopbuf_add(sops, SEM_MAIN,      -1, IPC_NOWAIT);
-	sopbuf_add(sops, SEM_MAIN,       1, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE, -2, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE,  2, 0);
-	if (sopbuf_semop(sops) < 0) {
-		if (errno == EAGAIN)
-			fprintf(stderr, "Error: main process is dead\n");
-		else
-			perror("Error: semop");
+	if (shmring_send(ring, data, strlen(data)) < 0) {
+		shmring_delete(ring);
 		return -1;
 	}
+	shmring_delete(ring);
+
+	fprintf(stdout, "echoloop for \"%s\" finished\n", data);
 	return 0;
 }
-
-int echoloop_sender_quit_section(sopbuf_t *sops)
+#else
+int echoloop_sender_wait(sopbuf_t *sops, sigset_t *ack)
 {
-	/* Transfer done */
-	sopbuf_add(sops, SEM_TR_DONE, 1, SEM_UNDO);
-	if (sopbuf_semop(sops) < 0) {
-		perror("Error: semop");
-		return -1;
-	}
+	struct timespec timeout = { .tv_nsec = WAIT_MS * 1000000 };
+	siginfo_t info;
 
-	/* Check that main process is active */
-	/* Wait for main */
-	/* Release sender lock */
-	sopbuf_add(sops, SEM_TR_ACTIVE, -2, IPC_NOWAIT);
-	sopbuf_add(sops, SEM_TR_ACTIVE,  2, 0);
-	sopbuf_add(sops, SEM_TR_DONE,   -2, 0);
-	sopbuf_add(sops, SEM_TR_DONE,    2, 0);
-	sopbuf_add(sops, SEM_SENDER,    -1, SEM_UNDO);
-	if (sopbuf_semop(sops) == -1) {
-		if (errno == EAGAIN)
-			fprintf(stderr, "Error: main process failed\n");
-		else
-			perror("Error: semop");
-		return -1;
-	}
+	while (1) {
+		/* Main tells with the value if it dropped the str */
+		if (sigtimedwait(ack, &info, &timeout) == ACK_SIGNAL) {
+			if (info.si_code != SI_QUEUE || !info.si_value.sival_int)
+				return 0;
+			fprintf(stderr, "Error: main process dropped the str\n");
+			return -1;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN) {
+			perror("Error: sigtimedwait");
+			return -1;
+		}
 
-	/* Success, wait for main */
-	/* Disable transfer */
-	/* Retsore SEM_TR_DONE */
-	sopbuf_add(sops, SEM_MAIN,       0, 0);
-	sopbuf_add(sops, SEM_TR_ACTIVE, -1, SEM_UNDO);
-	sopbuf_add(sops, SEM_TR_DONE,   -1, SEM_UNDO);
-	if (sopbuf_semop(sops) == -1) {
-		perror("Error: semop");
-		return -1;
+		/* Check that main process is running */
+		sopbuf_add(sops, SEM_SINGLE, -1, IPC_NOWAIT);
+		sopbuf_add(sops, SEM_SINGLE,  1, 0);
+		if (sopbuf_semop(sops) < 0) {
+			if (errno == EAGAIN)
+				fprintf(stderr, "Error: main process is dead\n");
+			else
+				perror("Error: semop");
+			return -1;
+		}
 	}
-	return 0;
 }
 
 int echoloop_sender(sopbuf_t *sops, char *data)
 {
-	if (echoloop_sender_capture(sops) < 0)
+	/* Ack stays pending until it's waited for */
+	sigset_t ack;
+	sigemptyset(&ack);
+	sigaddset(&ack, ACK_SIGNAL);
+	if (sigprocmask(SIG_BLOCK, &ack, NULL) < 0) {
+		perror("Error: sigprocmask");
 		return -1;
+	}
 
 	int fifo_fd = open(FIFO_LOCATION, O_WRONLY | O_NONBLOCK);
 	if (fifo_fd < 0) {
@@ -358,43 +337,47 @@ int echoloop_sender(sopbuf_t *sops, char *data)
 		return -1;
 	}
 
-	if (echoloop_sender_enter_section(sops) < 0) {
-		close(fifo_fd);
-		return -1;
-	}
-
+	struct echo_frame_buf frame;
 	size_t data_s = strlen(data);
-	ssize_t ret = write(fifo_fd, &data_s, sizeof(size_t));
-	if (ret != sizeof(size_t)) {
-		fprintf(stderr, "Error: can't write data size\n");
-		close(fifo_fd);
-		return -1;
-	}
-
-	for (char *ptr = data; data_s > 0; data_s -= ret, ptr += ret) {
-		ret = write(fifo_fd, ptr, data_s);
-		if (ret < 0) {
-			perror("Error: write");
+	size_t off = 0;
+
+	do {
+		size_t len = data_s - off;
+		if (len > FRAME_DATA_MAX)
+			len = FRAME_DATA_MAX;
+		frame.hdr.pid = getpid();
+		frame.hdr.flags = (off == 0 ? DEMUX_FIRST : 0) |
+			(off + len == data_s ? DEMUX_LAST : 0);
+		frame.hdr.len = len;
+		frame.hdr.total = data_s;
+		memcpy(frame.data, data + off, len);
+
+		size_t frame_s = sizeof(frame.hdr) + len;
+		if (write(fifo_fd, &frame, frame_s) != frame_s) {
+			if (errno == EPIPE)
+				fprintf(stderr, "Error: main process failed\n");
+			else
+				perror("Error: write");
 			close(fifo_fd);
 			return -1;
 		}
-	}
+		off += len;
+	} while (off < data_s);
 	close(fifo_fd);
 
-	if (echoloop_sender_quit_section(sops) < 0)
+	if (echoloop_sender_wait(sops, &ack) < 0)
 		return -1;
 
 	fprintf(stdout, "echoloop for \"%s\" finished\n", data);
 	return 0;
 }
+#endif
 
 int echoloop_start(sopbuf_t *sops, char *str)
 {
 	/* Try to capture singleton "mutex" */
-	/* Do not start while previous transfer is active */
-	sopbuf_add(sops, SEM_TR_ACTIVE, 0, 0);
-	sopbuf_add(sops, SEM_SINGLE,    0, IPC_NOWAIT);
-	sopbuf_add(sops, SEM_SINGLE,    1, SEM_UNDO);
+	sopbuf_add(sops, SEM_SINGLE, 0, IPC_NOWAIT);
+	sopbuf_add(sops, SEM_SINGLE, 1, SEM_UNDO);
 	if (sopbuf_semop(sops) < 0) {
 		if (errno != EAGAIN) {
 			perror("Error: semop");
@@ -409,19 +392,44 @@ int echoloop_start(sopbuf_t *sops, char *str)
 	return 1; /* It was main */
 }
 
+/* Options stop at the first str, "--" goes before one which starts with '-' */
+void usage(char *prog)
+{
+	fprintf(stderr, "Wrong argv\nUsage: %s [-i interval] [--] str\n", prog);
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fprintf(stderr, "Wrong argv\n");
+	int opt;
+	while ((opt = getopt(argc, argv, "+i:")) != -1) {
+		switch (opt) {
+		case 'i':
+			if (printer_parse_interval(optarg, &echo_interval) < 0) {
+				fprintf(stderr, "Wrong interval: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
+	char *str = argv[optind];
+	echo_main_thread = pthread_self();
 
 	/* Volatile qualifer required to clean semaphore set after longjmp */
 	volatile int semid = -1;
 
 	if (setjmp(sighandler_exit_buf)) {
 		if (semid >= 0)
-			semctl(semid, 0, IPC_RMID);
+			sopbuf_semrm(semid);
+		if (echo_ring)
+			shmring_delete(echo_ring);
 		exit(EXIT_FAILURE);
 	}
 
@@ -436,6 +444,21 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	struct sigaction sa_fail = { .sa_handler = sighandler_fail };
+
+	if (sigaction(SIGUSR1, &sa_fail, NULL) < 0) {
+		perror("Error: sigaction");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Sender gets EPIPE if main is gone */
+	struct sigaction sa_ignore = { .sa_handler = SIG_IGN };
+
+	if (sigaction(SIGPIPE, &sa_ignore, NULL) < 0) {
+		perror("Error: sigaction");
+		exit(EXIT_FAILURE);
+	}
+
 	int ret = mkfifo(FIFO_LOCATION, 0666);
 	if (ret < 0 && errno != EEXIST) {
 		perror("Error: mkfifo");
@@ -448,28 +471,28 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	semid = semget(key, SEM_MAX, IPC_CREAT | 0644);
+	semid = sopbuf_semget(key, SEM_MAX);
 	if (semid < 0) {
-		perror("Error: semget");
+		perror("Error: sopbuf_semget");
 		exit(EXIT_FAILURE);
 	}
 
 	sopbuf_t *sops = sopbuf_new(semid, MAX_SOPS);
 	if (!sops) {
 		perror("Error: sopbuf_new");
-		semctl(semid, 0, IPC_RMID);
+		sopbuf_semrm(semid);
 		exit(EXIT_FAILURE);
 	}
 
-	ret = echoloop_start(sops, argv[1]);
+	ret = echoloop_start(sops, str);
 	if (ret < 0) {
 		fprintf(stderr, "Error: echoloop failed\n");
-		semctl(semid, 0, IPC_RMID);
+		sopbuf_semrm(semid);
 		sopbuf_delete(sops);
 		exit(EXIT_FAILURE);
 	}
 	if (ret == 1) /* It was main */
-		semctl(semid, 0, IPC_RMID);
+		sopbuf_semrm(semid);
 
 	sopbuf_delete(sops);
 	return 0;
@@ -0,0 +1,28 @@
+#ifndef FUTEX_H_
+#define FUTEX_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Futexes shared between processes, so they're not private */
+
+static inline int futex_wait(uint32_t *addr, uint32_t val, int ms)
+{
+	struct timespec ts = {
+		.tv_sec  = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000
+	};
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif /* FUTEX_H_ */
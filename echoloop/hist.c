@@ -0,0 +1,77 @@
+#include "hist.h"
+
+#include <string.h>
+
+static inline unsigned hist_bucket(uint64_t val)
+{
+	if (val < HIST_SUB)
+		return val;
+	unsigned exp = 63 - __builtin_clzll(val);
+	unsigned sub = (val >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/* Lowest value which falls into the bucket */
+static inline uint64_t hist_bucket_low(unsigned idx)
+{
+	if (idx < HIST_SUB)
+		return idx;
+	unsigned exp = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t sub = idx % HIST_SUB;
+	return (HIST_SUB + sub) << (exp - HIST_SUB_BITS);
+}
+
+void hist_init(struct hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+void hist_add(struct hist *hist, uint64_t val)
+{
+	hist->count++;
+	hist->sum += val;
+	if (val < hist->min)
+		hist->min = val;
+	if (val > hist->max)
+		hist->max = val;
+	hist->buckets[hist_bucket(val)]++;
+}
+
+void hist_merge(struct hist *dst, struct hist *src)
+{
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	for (unsigned i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+uint64_t hist_quantile(struct hist *hist, double q)
+{
+	if (!hist->count)
+		return 0;
+
+	/* Smallest value with at least q of all values not above it */
+	double pos = q * hist->count;
+	uint64_t rank = pos;
+	if (rank < pos || !rank)
+		rank++;
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen < rank)
+			continue;
+		uint64_t val = hist_bucket_low(i);
+		/* Exact ends are known */
+		if (val < hist->min)
+			return hist->min;
+		if (val > hist->max)
+			return hist->max;
+		return val;
+	}
+	return hist->max;
+}
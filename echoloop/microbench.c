@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include "hist.h"
+#include "sopbuf.h"
+#include "strlist.h"
+
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Microbenchmarks of strlist and sopbuf. Every case runs a few warmup
+ * repetitions, then measured ones, and prints one JSON line: time per
+ * op over repetitions (min, median, mean, stddev, max), and quantiles
+ * of single ops where they are timed one by one.
+ */
+
+#define MB_REPS      10
+#define MB_WARMUP    2
+#define MB_APPENDS   400000	/* Per repetition, split between threads */
+#define MB_STR_SIZE  16
+#define MB_SEMOPS    100000
+#define MB_PIPE_BUF  (64 << 10)
+
+enum mb_semnum {	/* Same layout as echoloop.c */
+	SEM_SINGLE,
+	SEM_MAX
+};
+
+struct mb_case {
+	char *name;
+	char *params;	/* JSON members, without braces */
+	size_t ops;	/* Per repetition */
+	void (*setup)(struct mb_case *mb);
+	void (*run)(struct mb_case *mb);
+	void (*teardown)(struct mb_case *mb);
+	struct hist *lat;	/* Of single ops, if they're timed */
+	void *arg;
+};
+
+size_t mb_reps = MB_REPS;
+size_t mb_warmup = MB_WARMUP;
+size_t mb_threads = 0; /* Up to number of CPUs if 0 */
+char mb_str[MB_STR_SIZE];
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double *) a, y = *(double *) b;
+	return (x > y) - (x < y);
+}
+
+void mb_report(struct mb_case *mb, double *ns)
+{
+	qsort(ns, mb_reps, sizeof(*ns), cmp_double);
+	double sum = 0, sq = 0;
+	for (size_t i = 0; i < mb_reps; i++)
+		sum += ns[i];
+	double mean = sum / mb_reps;
+	for (size_t i = 0; i < mb_reps; i++)
+		sq += (ns[i] - mean) * (ns[i] - mean);
+	double median = mb_reps % 2 ? ns[mb_reps / 2] :
+		(ns[mb_reps / 2 - 1] + ns[mb_reps / 2]) / 2;
+
+	printf("{\"bench\": \"%s\", %s, \"ops\": %zu, \"reps\": %zu, "
+		"\"min_ns\": %.1f, \"median_ns\": %.1f, \"mean_ns\": %.1f, "
+		"\"stddev_ns\": %.1f, \"max_ns\": %.1f", mb->name, mb->params,
+		mb->ops, mb_reps, ns[0], median, mean,
+		mb_reps > 1 ? sqrt(sq / (mb_reps - 1)) : 0, ns[mb_reps - 1]);
+	if (mb->lat)
+		printf(", \"p50_ns\": %llu, \"p99_ns\": %llu, "
+			"\"p999_ns\": %llu",
+			(unsigned long long) hist_quantile(mb->lat, 0.5),
+			(unsigned long long) hist_quantile(mb->lat, 0.99),
+			(unsigned long long) hist_quantile(mb->lat, 0.999));
+	printf("}\n");
+	fflush(stdout);
+}
+
+/* Time per op of every measured repetition */
+void mb_run(struct mb_case *mb)
+{
+	double ns[mb_reps];
+
+	for (size_t rep = 0; rep < mb_warmup + mb_reps; rep++) {
+		/* Quantiles are of measured repetitions only */
+		if (mb->lat && rep == mb_warmup)
+			hist_init(mb->lat);
+		if (mb->setup)
+			mb->setup(mb);
+		uint64_t start = now_ns();
+		mb->run(mb);
+		uint64_t end = now_ns();
+		if (mb->teardown)
+			mb->teardown(mb);
+		if (rep >= mb_warmup)
+			ns[rep - mb_warmup] = (double) (end - start) / mb->ops;
+	}
+	mb_report(mb, ns);
+}
+
+/* strlist_append from several threads at once */
+
+struct mb_append {
+	strlist_t *list;
+	size_t nthreads;
+	pthread_t threads[];
+};
+
+void *mb_append_thread(void *arg)
+{
+	struct mb_case *mb = arg;
+	struct mb_append *ap = mb->arg;
+
+	for (size_t i = 0; i < mb->ops / ap->nthreads; i++) {
+		if (strlist_append(ap->list, mb_str, sizeof(mb_str)) < 0) {
+			perror("Error: strlist_append");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return NULL;
+}
+
+void mb_append_setup(struct mb_case *mb)
+{
+	struct mb_append *ap = mb->arg;
+	ap->list = strlist_new();
+	if (!ap->list) {
+		perror("Error: strlist_new");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void mb_append_run(struct mb_case *mb)
+{
+	struct mb_append *ap = mb->arg;
+
+	for (size_t i = 0; i < ap->nthreads; i++) {
+		int ret = pthread_create(&ap->threads[i], NULL,
+			mb_append_thread, mb);
+		if (ret != 0) {
+			errno = ret;
+			perror("Error: pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (size_t i = 0; i < ap->nthreads; i++)
+		pthread_join(ap->threads[i], NULL);
+}
+
+void mb_append_teardown(struct mb_case *mb)
+{
+	struct mb_append *ap = mb->arg;
+	strlist_delete(ap->list);
+}
+
+void mb_append(size_t nthreads)
+{
+	struct mb_append *ap = malloc(sizeof(*ap) +
+		nthreads * sizeof(pthread_t));
+	if (!ap) {
+		perror("Error: malloc");
+		exit(EXIT_FAILURE);
+	}
+	ap->nthreads = nthreads;
+
+	char params[64];
+	snprintf(params, sizeof(params), "\"threads\": %zu", nthreads);
+	struct mb_case mb = {
+		.name     = "strlist_append",
+		.params   = params,
+		.ops      = MB_APPENDS / nthreads * nthreads,
+		.setup    = mb_append_setup,
+		.run      = mb_append_run,
+		.teardown = mb_append_teardown,
+		.arg      = ap
+	};
+	mb_run(&mb);
+	free(ap);
+}
+
+/* strlist_print of the whole list, ops are strs printed */
+
+struct mb_print {
+	strlist_t *list;
+	int fd;
+};
+
+void *mb_pipe_drain(void *arg)
+{
+	int fd = (intptr_t) arg;
+	static char buf[MB_PIPE_BUF];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	return NULL;
+}
+
+void mb_print_run(struct mb_case *mb)
+{
+	struct mb_print *pr = mb->arg;
+	if (strlist_print(pr->list, pr->fd) < 0) {
+		perror("Error: strlist_print");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void mb_print(size_t nstrs, char *to)
+{
+	struct mb_print pr;
+	pthread_t drain;
+	int fds[2] = { -1, -1 };
+
+	pr.list = strlist_new();
+	if (!pr.list) {
+		perror("Error: strlist_new");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < nstrs; i++) {
+		if (strlist_append(pr.list, mb_str, sizeof(mb_str)) < 0) {
+			perror("Error: strlist_append");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!strcmp(to, "pipe")) {
+		if (pipe(fds) < 0) {
+			perror("Error: pipe");
+			exit(EXIT_FAILURE);
+		}
+		int ret = pthread_create(&drain, NULL, mb_pipe_drain,
+			(void *) (intptr_t) fds[0]);
+		if (ret != 0) {
+			errno = ret;
+			perror("Error: pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		pr.fd = fds[1];
+	} else {
+		pr.fd = open("/dev/null", O_WRONLY);
+		if (pr.fd < 0) {
+			perror("Error: open");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	char params[64];
+	snprintf(params, sizeof(params), "\"strs\": %zu, \"to\": \"%s\"",
+		nstrs, to);
+	struct mb_case mb = {
+		.name   = "strlist_print",
+		.params = params,
+		.ops    = nstrs,
+		.run    = mb_print_run,
+		.arg    = &pr
+	};
+	mb_run(&mb);
+
+	close(pr.fd);
+	if (fds[0] >= 0) {
+		pthread_join(drain, NULL);
+		close(fds[0]);
+	}
+	strlist_delete(pr.list);
+}
+
+/* sopbuf_semop with op sequences of echoloop.c, each op is timed */
+
+struct mb_semop {
+	sopbuf_t *sops;
+	int release;	/* Sequence is undone after every op */
+	short seq[4][3];
+	size_t nseq;
+};
+
+static void mb_semop_add(sopbuf_t *sops, short (*seq)[3], size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		sopbuf_add(sops, seq[i][0], seq[i][1], seq[i][2]);
+}
+
+void mb_semop_run(struct mb_case *mb)
+{
+	struct mb_semop *so = mb->arg;
+	short release[1][3] = { { SEM_SINGLE, -1, SEM_UNDO } };
+
+	for (size_t i = 0; i < mb->ops; i++) {
+		mb_semop_add(so->sops, so->seq, so->nseq);
+		uint64_t start = now_ns();
+		int ret = sopbuf_semop(so->sops);
+		hist_add(mb->lat, now_ns() - start);
+		if (ret < 0) {
+			perror("Error: sopbuf_semop");
+			exit(EXIT_FAILURE);
+		}
+		if (so->release) {
+			mb_semop_add(so->sops, release, 1);
+			if (sopbuf_semop(so->sops) < 0) {
+				perror("Error: sopbuf_semop");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+void mb_semop()
+{
+	int semid = sopbuf_semget(IPC_PRIVATE, SEM_MAX);
+	if (semid < 0) {
+		perror("Error: sopbuf_semget");
+		exit(EXIT_FAILURE);
+	}
+	struct mb_semop so = { .sops = sopbuf_new(semid, 4) };
+	if (!so.sops) {
+		perror("Error: sopbuf_new");
+		sopbuf_semrm(semid);
+		exit(EXIT_FAILURE);
+	}
+	struct hist lat;
+	struct mb_case mb = {
+		.name = "sopbuf_semop",
+		.ops  = MB_SEMOPS,
+		.run  = mb_semop_run,
+		.lat  = &lat,
+		.arg  = &so
+	};
+
+	/* Main captures singleton in echoloop_start, then lets it go */
+	so.release = 1;
+	so.nseq = 2;
+	memcpy(so.seq, (short[2][3]) {
+		{ SEM_SINGLE, 0, IPC_NOWAIT },
+		{ SEM_SINGLE, 1, SEM_UNDO } }, sizeof(short[2][3]));
+	mb.params = "\"seq\": \"start\"";
+	mb_run(&mb);
+
+	/* Sender checks that main holds it */
+	short hold[1][3] = { { SEM_SINGLE, 1, SEM_UNDO } };
+	mb_semop_add(so.sops, hold, 1);
+	if (sopbuf_semop(so.sops) < 0) {
+		perror("Error: sopbuf_semop");
+		exit(EXIT_FAILURE);
+	}
+	so.release = 0;
+	memcpy(so.seq, (short[2][3]) {
+		{ SEM_SINGLE, -1, IPC_NOWAIT },
+		{ SEM_SINGLE, 1, 0 } }, sizeof(short[2][3]));
+	mb.params = "\"seq\": \"sender_probe\"";
+	mb_run(&mb);
+
+	sopbuf_delete(so.sops);
+	sopbuf_semrm(semid);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "r:w:t:")) != -1) {
+		switch (opt) {
+		case 'r':
+			mb_reps = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			mb_warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			mb_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r reps] [-w warmup] "
+				"[-t max threads]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!mb_reps) {
+		fprintf(stderr, "Wrong argv\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!mb_threads)
+		mb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	memset(mb_str, 'x', sizeof(mb_str));
+
+	for (size_t n = 1; n <= mb_threads; n *= 2) {
+		mb_append(n);
+		/* Odd count of CPUs is measured too */
+		if (n * 2 > mb_threads && n != mb_threads)
+			mb_append(mb_threads);
+	}
+
+	size_t sizes[] = { 1000, 100000, 1000000 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		mb_print(sizes[i], "devnull");
+		mb_print(sizes[i], "pipe");
+	}
+
+	mb_semop();
+	return 0;
+}
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+#include "futex.h"
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SHM_RING_SIZE   (1 << 20)
+#define SHM_FRAG_MAX    (SHM_RING_SIZE / 4)	/* Longer strs are split */
+#define SHM_WAIT_MS     100	/* Sleepers look for dead peers this often */
+#define SHM_ATTACH_MS   1000	/* Main may be just creating the segment */
+#define SHM_LOCK_SPINS  1024	/* Lock owner is checked this often */
+#define SHM_PUBLISH     64	/* Records taken before space is given back */
+
+enum shm_rec_state {
+	SHM_REC_BUSY,	/* Str is being copied */
+	SHM_REC_READY,
+	SHM_REC_PAD	/* Rest of the ring is unused, go to its start */
+};
+
+/* Record header is written before the record is published with tail */
+struct shm_rec {
+	uint32_t state;
+	int32_t pid;
+	uint32_t len;		/* Of this piece */
+	uint32_t flags;		/* DEMUX_FIRST, DEMUX_LAST */
+	uint64_t total;		/* Of the whole str */
+	char data[];
+};
+
+struct shm_hdr {
+	int32_t main_pid;	/* Set once the ring is ready */
+	uint32_t size;
+
+	/* Written by main */
+	uint64_t head __attribute__ ((aligned(64)));
+	uint32_t consumed;	/* Futex, bumped when head moves */
+	uint32_t main_waiting;
+
+	/* Written by senders */
+	int32_t lock __attribute__ ((aligned(64)));	/* Pid of owner */
+	uint64_t tail;
+	uint32_t data_seq;	/* Futex, bumped when a record is ready */
+	uint32_t waiters;	/* Senders sleeping on consumed */
+
+	char ring[] __attribute__ ((aligned(64)));
+};
+
+struct shmring {
+	int shmid;
+	int owner;
+	pid_t pid;
+	struct shm_hdr *hdr;
+
+	/* Main only */
+	uint64_t stuck_head;	/* Head record is busy since stuck_ms */
+	uint64_t stuck_ms;
+	int stuck;
+};
+
+static inline size_t shm_rec_size(size_t len)
+{
+	return (sizeof(struct shm_rec) + len + 7) & ~(size_t) 7;
+}
+
+static inline struct shm_rec *shm_rec_at(struct shm_hdr *hdr, uint64_t pos)
+{
+	return (struct shm_rec *) &hdr->ring[pos % hdr->size];
+}
+
+static int pid_alive(pid_t pid)
+{
+	return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static struct shmring *shmring_new(int shmid, int owner)
+{
+	struct shmring *ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->hdr = shmat(shmid, NULL, 0);
+	if (ring->hdr == (void *) -1) {
+		free(ring);
+		return NULL;
+	}
+	ring->shmid = shmid;
+	ring->owner = owner;
+	ring->pid = getpid();
+	return ring;
+}
+
+void shmring_delete(struct shmring *ring)
+{
+	if (ring->owner)
+		shmctl(ring->shmid, IPC_RMID, NULL);
+	shmdt(ring->hdr);
+	free(ring);
+}
+
+struct shmring *shmring_create(key_t key)
+{
+	int shmid = shmget(key, 0, 0);
+	if (shmid >= 0)
+		shmctl(shmid, IPC_RMID, NULL);
+
+	shmid = shmget(key, sizeof(struct shm_hdr) + SHM_RING_SIZE,
+		IPC_CREAT | IPC_EXCL | 0644);
+	if (shmid < 0)
+		return NULL;
+
+	struct shmring *ring = shmring_new(shmid, 1);
+	if (!ring) {
+		shmctl(shmid, IPC_RMID, NULL);
+		return NULL;
+	}
+	ring->hdr->size = SHM_RING_SIZE;
+	__atomic_store_n(&ring->hdr->main_pid, ring->pid, __ATOMIC_RELEASE);
+	return ring;
+}
+
+struct shmring *shmring_attach(key_t key)
+{
+	struct timespec delay = { .tv_nsec = 1000000 };
+
+	for (int ms = 0; ms < SHM_ATTACH_MS; ms++) {
+		int shmid = shmget(key, 0, 0);
+		if (shmid < 0 && errno != ENOENT)
+			return NULL;
+		if (shmid >= 0) {
+			struct shmring *ring = shmring_new(shmid, 0);
+			if (!ring)
+				return NULL;
+			pid_t main_pid = __atomic_load_n(&ring->hdr->main_pid,
+				__ATOMIC_ACQUIRE);
+			if (main_pid && pid_alive(main_pid))
+				return ring;
+			/* Not ready yet or left by a crashed main */
+			shmring_delete(ring);
+		}
+		nanosleep(&delay, NULL);
+	}
+
+	errno = ESRCH;
+	return NULL;
+}
+
+/* Sleeps on a futex for a while, fails if main is gone */
+static int shmring_sender_wait(struct shmring *ring, uint32_t *addr,
+			       uint32_t val)
+{
+	struct shm_hdr *hdr = ring->hdr;
+
+	__atomic_fetch_add(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+	int ret = futex_wait(addr, val, SHM_WAIT_MS);
+	__atomic_fetch_sub(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+
+	if (ret < 0 && errno == ETIMEDOUT && !pid_alive(hdr->main_pid)) {
+		fprintf(stderr, "Error: main process is dead\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void shmring_lock(struct shmring *ring)
+{
+	int32_t *lock = &ring->hdr->lock;
+
+	for (unsigned spins = 1;; spins++) {
+		int32_t owner = 0;
+		if (__atomic_compare_exchange_n(lock, &owner, ring->pid, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		/* Owner may have died inside, take the lock over */
+		if (spins % SHM_LOCK_SPINS == 0 && !pid_alive(owner) &&
+		    __atomic_compare_exchange_n(lock, &owner, ring->pid, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		sched_yield();
+	}
+}
+
+static void shmring_unlock(struct shmring *ring)
+{
+	__atomic_store_n(&ring->hdr->lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct shm_rec *shmring_reserve(struct shmring *ring, size_t len,
+				       uint32_t flags, size_t total,
+				       uint64_t *end)
+{
+	struct shm_hdr *hdr = ring->hdr;
+	size_t need = shm_rec_size(len);
+
+	while (1) {
+		/* Taken before head, so a move of head is never missed */
+		uint32_t seq = __atomic_load_n(&hdr->consumed,
+			__ATOMIC_SEQ_CST);
+
+		shmring_lock(ring);
+		uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = hdr->tail;
+		size_t pos = tail % hdr->size;
+		size_t pad = hdr->size - pos < need ? hdr->size - pos : 0;
+
+		if (tail + pad + need - head <= hdr->size) {
+			if (pad)
+				shm_rec_at(hdr, tail)->state = SHM_REC_PAD;
+			struct shm_rec *rec = shm_rec_at(hdr, tail + pad);
+			rec->state = SHM_REC_BUSY;
+			rec->pid = ring->pid;
+			rec->len = len;
+			rec->flags = flags;
+			rec->total = total;
+			*end = tail + pad + need;
+			__atomic_store_n(&hdr->tail, *end, __ATOMIC_RELEASE);
+			shmring_unlock(ring);
+			return rec;
+		}
+		shmring_unlock(ring);
+
+		if (shmring_sender_wait(ring, &hdr->consumed, seq) < 0)
+			return NULL;
+	}
+}
+
+static void shmring_commit(struct shmring *ring, struct shm_rec *rec)
+{
+	struct shm_hdr *hdr = ring->hdr;
+
+	__atomic_store_n(&rec->state, SHM_REC_READY, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&hdr->data_seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->main_waiting, __ATOMIC_SEQ_CST))
+		futex_wake(&hdr->data_seq);
+}
+
+int shmring_send(struct shmring *ring, char *str, size_t str_s)
+{
+	struct shm_hdr *hdr = ring->hdr;
+	uint64_t end;
+	size_t off = 0;
+
+	do {
+		size_t len = str_s - off;
+		if (len > SHM_FRAG_MAX)
+			len = SHM_FRAG_MAX;
+		uint32_t flags = (off == 0 ? DEMUX_FIRST : 0) |
+			(off + len == str_s ? DEMUX_LAST : 0);
+
+		struct shm_rec *rec = shmring_reserve(ring, len, flags, str_s,
+			&end);
+		if (!rec)
+			return -1;
+		memcpy(rec->data, str + off, len);
+		shmring_commit(ring, rec);
+		off += len;
+	} while (off < str_s);
+
+	/* Wait for main to take it */
+	while (1) {
+		uint32_t seq = __atomic_load_n(&hdr->consumed,
+			__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) >= end)
+			return 0;
+		if (shmring_sender_wait(ring, &hdr->consumed, seq) < 0)
+			return -1;
+	}
+}
+
+static void shmring_publish(struct shmring *ring, uint64_t head)
+{
+	struct shm_hdr *hdr = ring->hdr;
+
+	__atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&hdr->consumed, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&hdr->consumed);
+}
+
+/* Returns the record main waits for, NULL if ring is empty */
+static struct shm_rec *shmring_stuck(struct shmring *ring)
+{
+	struct shm_hdr *hdr = ring->hdr;
+	uint64_t head = hdr->head;
+	if (head == __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	struct shm_rec *rec = shm_rec_at(hdr, head);
+	if (__atomic_load_n(&rec->state, __ATOMIC_ACQUIRE) != SHM_REC_BUSY)
+		return NULL;
+	return rec;
+}
+
+/* Senders behind a dead one may keep main awake, so time is checked */
+static int shmring_stuck_long(struct shmring *ring)
+{
+	if (!shmring_stuck(ring)) {
+		ring->stuck = 0;
+		return 0;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	uint64_t ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	if (!ring->stuck || ring->stuck_head != ring->hdr->head) {
+		ring->stuck = 1;
+		ring->stuck_head = ring->hdr->head;
+		ring->stuck_ms = ms;
+		return 0;
+	}
+	return ms - ring->stuck_ms >= SHM_WAIT_MS;
+}
+
+/* Called when nothing happened for a while */
+static void shmring_check_dead(struct shmring *ring, demux_t *demux)
+{
+	struct shm_rec *rec = shmring_stuck(ring);
+	if (rec && !pid_alive(rec->pid)) {
+		fprintf(stderr, "Error: sender process is dead\n");
+		demux_drop(demux, rec->pid);
+		shmring_publish(ring, ring->hdr->head + shm_rec_size(rec->len));
+	}
+	if (demux_reap(demux))
+		fprintf(stderr, "Error: sender process is dead\n");
+}
+
+int shmring_receive(struct shmring *ring, demux_t *demux)
+{
+	struct shm_hdr *hdr = ring->hdr;
+	uint64_t head = hdr->head;
+	uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	size_t taken = 0;
+
+	while (head != tail) {
+		struct shm_rec *rec = shm_rec_at(hdr, head);
+		uint32_t state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+		if (state == SHM_REC_PAD) {
+			head += hdr->size - head % hdr->size;
+			continue;
+		}
+		if (state != SHM_REC_READY)
+			break;
+
+		if (demux_add(demux, rec->pid, rec->flags, rec->total,
+				rec->data, rec->len) < 0)
+			return -1;
+		head += shm_rec_size(rec->len);
+		if (++taken % SHM_PUBLISH == 0)
+			shmring_publish(ring, head);
+		if (head == tail)
+			tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	}
+	if (head != hdr->head)
+		shmring_publish(ring, head);
+	if (taken)
+		return 0;
+
+	/* Nothing is ready, sleep until a sender commits */
+	uint32_t seq = __atomic_load_n(&hdr->data_seq, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&hdr->main_waiting, 1, __ATOMIC_SEQ_CST);
+	int ret = 0;
+	if (head == __atomic_load_n(&hdr->tail, __ATOMIC_SEQ_CST) ||
+	    shmring_stuck(ring))
+		ret = futex_wait(&hdr->data_seq, seq, SHM_WAIT_MS);
+	__atomic_store_n(&hdr->main_waiting, 0, __ATOMIC_RELAXED);
+
+	if ((ret < 0 && errno == ETIMEDOUT) || shmring_stuck_long(ring))
+		shmring_check_dead(ring, demux);
+	return 0;
+}
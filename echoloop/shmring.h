@@ -0,0 +1,35 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include "demux.h"
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * Shared memory transport: senders copy strs straight into a ring in a
+ * SysV segment, main takes them out through a demux. Nothing is a
+ * syscall unless someone has to sleep.
+ *
+ * Space is reserved under a lock which holds the owner's pid, every
+ * record carries its sender's pid, and the ring header has main's pid.
+ * So whoever waits for a dead process notices it: a stuck lock is taken
+ * over, main drops records and partial strs of dead senders, and
+ * senders fail if main is gone.
+ */
+
+typedef struct shmring shmring_t;
+
+/* Main side, a segment left by a crashed main is replaced */
+shmring_t *shmring_create(key_t key);
+/* Waits for strs and takes all there are */
+int shmring_receive(shmring_t *ring, demux_t *demux);
+
+/* Sender side, returns once main has taken the str */
+shmring_t *shmring_attach(key_t key);
+int shmring_send(shmring_t *ring, char *str, size_t str_s);
+
+/* Segment is removed if it was created by this process */
+void shmring_delete(shmring_t *ring);
+
+#endif /* SHMRING_H_ */
@@ -11,6 +11,16 @@ struct sopbuf {
 	struct sembuf *sops;
 };
 
+int sopbuf_semget(key_t key, int nsems)
+{
+	return semget(key, nsems, IPC_CREAT | 0644);
+}
+
+void sopbuf_semrm(int semid)
+{
+	semctl(semid, 0, IPC_RMID);
+}
+
 struct sopbuf *sopbuf_new(int semid, size_t size)
 {
 	struct sopbuf *buf = malloc(sizeof(*buf));
@@ -1,9 +1,20 @@
 #ifndef SOPBUF_H_
 #define SOPBUF_H
+#include <sys/types.h>
 #include <stddef.h>
 
 /* A simple interface to handle SystemV semaphores */
 
+/*
+ * Ops and flags (IPC_NOWAIT, SEM_UNDO) are the ones of semop. Backend is
+ * chosen at build time: sopbuf.c uses SysV semaphores, sopbuf_futex.c
+ * keeps the set in shared memory and uses futexes.
+ */
+
+/* Set is created if it doesn't exist */
+int  sopbuf_semget(key_t key, int nsems);
+void sopbuf_semrm(int semid);
+
 typedef struct sopbuf sopbuf_t;
 
 sopbuf_t *sopbuf_new(int semid, size_t size);
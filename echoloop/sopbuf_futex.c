@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "sopbuf.h"
+#include "futex.h"
+
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Semaphore set lives in a SysV shared memory segment: values, a lock
+ * and undo records of processes which use SEM_UNDO. A semop takes the
+ * lock, which is a single CAS when there is no contention, and sleeps
+ * on a futex only if it has to wait.
+ *
+ * Kernel doesn't undo anything here, so records of dead processes are
+ * applied by others: by anyone whose wait times out, and before ops
+ * with IPC_NOWAIT, which are used to check that peers are alive. The
+ * lock holds its owner's pid and is taken over if the owner is dead.
+ */
+
+#define SOPBUF_SEMS_MAX  64
+#define SOPBUF_UNDO_MAX  64
+#define SOPBUF_WAIT_MS   100
+#define SOPBUF_SPINS     1024
+#define SOPBUF_SEMVMX    32767
+
+struct sopbuf_undo {
+	int32_t pid;	/* 0 if the record is free */
+	int16_t adj[SOPBUF_SEMS_MAX];
+};
+
+struct sopbuf_set {
+	int32_t lock;		/* Pid of owner */
+	uint32_t seq;		/* Futex, bumped on every change */
+	uint32_t waiters;
+	int16_t val[SOPBUF_SEMS_MAX];
+	struct sopbuf_undo undo[SOPBUF_UNDO_MAX];
+};
+
+struct sopbuf {
+	struct sopbuf_set *set;
+	pid_t pid;
+	size_t sops_n;
+	size_t sops_s;
+	struct sembuf *sops;
+};
+
+static int pid_alive(pid_t pid)
+{
+	return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+int sopbuf_semget(key_t key, int nsems)
+{
+	if (nsems > SOPBUF_SEMS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* Zeroed segment is a valid set with all values 0 */
+	return shmget(key, sizeof(struct sopbuf_set), IPC_CREAT | 0644);
+}
+
+void sopbuf_semrm(int semid)
+{
+	shmctl(semid, IPC_RMID, NULL);
+}
+
+struct sopbuf *sopbuf_new(int semid, size_t size)
+{
+	struct sopbuf *buf = malloc(sizeof(*buf));
+	if (!buf)
+		return NULL;
+
+	buf->sops_n = 0;
+	buf->sops_s = size;
+	buf->pid = getpid();
+
+	buf->sops = malloc(sizeof(*buf->sops) * buf->sops_s);
+	if (!buf->sops) {
+		free(buf);
+		return NULL;
+	}
+
+	buf->set = shmat(semid, NULL, 0);
+	if (buf->set == (void *) -1) {
+		free(buf->sops);
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+void sopbuf_delete(struct sopbuf *buf)
+{
+	shmdt(buf->set);
+	free(buf->sops);
+	free(buf);
+}
+
+int sopbuf_add(struct sopbuf *buf, unsigned short num, short op, short flg)
+{
+	if (buf->sops_n == buf->sops_s)
+		return -1;
+
+	struct sembuf *to_set = &buf->sops[buf->sops_n++];
+
+	to_set->sem_num = num;
+	to_set->sem_op  = op;
+	to_set->sem_flg = flg;
+
+	return 0;
+}
+
+void sopbuf_clean(struct sopbuf *buf)
+{
+	buf->sops_n = 0;
+}
+
+static void sopbuf_lock(struct sopbuf *buf)
+{
+	int32_t *lock = &buf->set->lock;
+
+	for (unsigned spins = 1;; spins++) {
+		int32_t owner = 0;
+		if (__atomic_compare_exchange_n(lock, &owner, buf->pid, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		if (spins % SOPBUF_SPINS == 0 && !pid_alive(owner) &&
+		    __atomic_compare_exchange_n(lock, &owner, buf->pid, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+		sched_yield();
+	}
+}
+
+/* Wakes waiters if something changed */
+static void sopbuf_unlock(struct sopbuf *buf, int changed)
+{
+	struct sopbuf_set *set = buf->set;
+
+	if (changed)
+		__atomic_fetch_add(&set->seq, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+	if (changed && __atomic_load_n(&set->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&set->seq);
+}
+
+static int16_t sopbuf_clamp(int val)
+{
+	if (val < 0)
+		return 0;
+	if (val > SOPBUF_SEMVMX)
+		return SOPBUF_SEMVMX;
+	return val;
+}
+
+/* Applies undo records of dead processes, lock is held */
+static int sopbuf_reap(struct sopbuf *buf)
+{
+	struct sopbuf_set *set = buf->set;
+	int changed = 0;
+
+	for (int i = 0; i < SOPBUF_UNDO_MAX; i++) {
+		struct sopbuf_undo *undo = &set->undo[i];
+		if (!undo->pid || undo->pid == buf->pid || pid_alive(undo->pid))
+			continue;
+		for (int num = 0; num < SOPBUF_SEMS_MAX; num++)
+			set->val[num] = sopbuf_clamp(set->val[num] +
+				undo->adj[num]);
+		undo->pid = 0;
+		changed = 1;
+	}
+	return changed;
+}
+
+/* Own undo record, a free one is taken if needed */
+static struct sopbuf_undo *sopbuf_undo(struct sopbuf *buf)
+{
+	struct sopbuf_set *set = buf->set;
+	struct sopbuf_undo *free_undo = NULL;
+
+	for (int i = 0; i < SOPBUF_UNDO_MAX; i++) {
+		if (set->undo[i].pid == buf->pid)
+			return &set->undo[i];
+		if (!set->undo[i].pid && !free_undo)
+			free_undo = &set->undo[i];
+	}
+	if (free_undo) {
+		for (int num = 0; num < SOPBUF_SEMS_MAX; num++)
+			free_undo->adj[num] = 0;
+		free_undo->pid = buf->pid;
+	}
+	return free_undo;
+}
+
+/*
+ * Returns 1 if ops are done, 0 if they would block, or -errno. Lock is
+ * held.
+ */
+static int sopbuf_try(struct sopbuf *buf)
+{
+	struct sopbuf_set *set = buf->set;
+	int16_t val[SOPBUF_SEMS_MAX];
+	int undo = 0;
+
+	/* Ops are applied one by one to a copy, then all at once */
+	for (size_t i = 0; i < buf->sops_n; i++) {
+		struct sembuf *sop = &buf->sops[i];
+		val[sop->sem_num] = set->val[sop->sem_num];
+	}
+	for (size_t i = 0; i < buf->sops_n; i++) {
+		struct sembuf *sop = &buf->sops[i];
+		int cur = val[sop->sem_num];
+		if ((sop->sem_op == 0 && cur != 0) || cur + sop->sem_op < 0)
+			return sop->sem_flg & IPC_NOWAIT ? -EAGAIN : 0;
+		if (cur + sop->sem_op > SOPBUF_SEMVMX)
+			return -ERANGE;
+		val[sop->sem_num] = cur + sop->sem_op;
+		undo |= sop->sem_flg & SEM_UNDO;
+	}
+
+	struct sopbuf_undo *rec = NULL;
+	if (undo) {
+		rec = sopbuf_undo(buf);
+		if (!rec)
+			return -ENOSPC;
+	}
+
+	int keep = 0;
+	for (size_t i = 0; i < buf->sops_n; i++) {
+		struct sembuf *sop = &buf->sops[i];
+		set->val[sop->sem_num] = val[sop->sem_num];
+		if (sop->sem_flg & SEM_UNDO)
+			rec->adj[sop->sem_num] -= sop->sem_op;
+	}
+	if (rec) {
+		for (int num = 0; num < SOPBUF_SEMS_MAX; num++)
+			keep |= rec->adj[num];
+		if (!keep)
+			rec->pid = 0;
+	}
+	return 1;
+}
+
+int sopbuf_semop(struct sopbuf *buf)
+{
+	struct sopbuf_set *set = buf->set;
+	int nowait = 0;
+	int ret;
+
+	for (size_t i = 0; i < buf->sops_n; i++) {
+		struct sembuf *sop = &buf->sops[i];
+		if (sop->sem_num >= SOPBUF_SEMS_MAX) {
+			buf->sops_n = 0;
+			errno = EFBIG;
+			return -1;
+		}
+		nowait |= sop->sem_flg & IPC_NOWAIT;
+	}
+
+	while (1) {
+		uint32_t seq = __atomic_load_n(&set->seq, __ATOMIC_SEQ_CST);
+
+		sopbuf_lock(buf);
+		/* Whoever checks with IPC_NOWAIT must see dead peers undone */
+		int changed = nowait ? sopbuf_reap(buf) : 0;
+		ret = sopbuf_try(buf);
+		sopbuf_unlock(buf, changed || ret > 0);
+		if (ret != 0)
+			break;
+
+		__atomic_fetch_add(&set->waiters, 1, __ATOMIC_SEQ_CST);
+		int err = futex_wait(&set->seq, seq, SOPBUF_WAIT_MS);
+		__atomic_fetch_sub(&set->waiters, 1, __ATOMIC_SEQ_CST);
+
+		/* Nothing happened for a while, someone may be dead */
+		if (err < 0 && errno == ETIMEDOUT) {
+			sopbuf_lock(buf);
+			sopbuf_unlock(buf, sopbuf_reap(buf));
+		}
+	}
+
+	buf->sops_n = 0;
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
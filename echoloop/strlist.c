@@ -1,72 +1,225 @@
+#define _GNU_SOURCE
 #include "strlist.h"
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-struct strelem {
-	char *str;
+#define STRLIST_CHUNK_SIZE (1 << 20)
+
+enum strrec_state {
+	STRREC_EMPTY,	/* Reserved, header is not written yet */
+	STRREC_BUSY,	/* Str is being filled */
+	STRREC_READY,
+	STRREC_DEAD	/* Cancelled */
+};
+
+/* Records are packed one after another in chunks */
+/* Each str is followed by '\n', so it's printed as one piece */
+struct strrec {
 	size_t str_s;
-	struct strelem *next;
+	int state;
+	char str[];
+};
+
+struct strchunk {
+	struct strchunk *next;
+	size_t size;
+	size_t used;	/* Bytes reserved for records */
+	char data[];
 };
 
 struct strlist {
-	struct strelem *first;
-	struct strelem *last;
+	struct strchunk *first;
+	struct strchunk *last;
 };
 
+static inline size_t strrec_size(size_t str_s)
+{
+	size_t align = sizeof(size_t) - 1;
+	return (sizeof(struct strrec) + str_s + align) & ~align;
+}
+
+static inline struct strrec *strrec_of(char *str)
+{
+	return (struct strrec *) (str - offsetof(struct strrec, str));
+}
+
+/* Unused space must read as STRREC_EMPTY, so chunks are zeroed */
+static struct strchunk *strchunk_new(size_t size)
+{
+	struct strchunk *chunk = calloc(1, sizeof(*chunk) + size);
+	if (!chunk)
+		return NULL;
+	chunk->size = size;
+	return chunk;
+}
+
 struct strlist *strlist_new()
 {
 	struct strlist *ptr = malloc(sizeof(*ptr));
 	if (!ptr)
 		return NULL;
-	ptr->first = NULL;
-	ptr->last = NULL;
+	ptr->first = strchunk_new(STRLIST_CHUNK_SIZE);
+	if (!ptr->first) {
+		free(ptr);
+		return NULL;
+	}
+	ptr->last = ptr->first;
 	return ptr;
 }
 
 void strlist_delete(struct strlist *list)
 {
-	for (struct strelem *ptr = list->first; ptr != NULL; ptr = ptr->next)
-		free(ptr->str);
+	struct strchunk *chunk = list->first;
+	while (chunk) {
+		struct strchunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
 	free(list);
 }
 
-/* All strings here must be dynamically allocated */
-/* List may be safely printed if this function is interrupted */
-int strlist_append(struct strlist *list, char *str, size_t str_s)
+/* Link a new chunk after a full one, someone else may do it first */
+static int strlist_grow(struct strlist *list, struct strchunk *chunk,
+			size_t need)
 {
-	struct strelem *elem = malloc(sizeof(*elem));
-	if (!elem)
+	struct strchunk *next = NULL;
+	struct strchunk *new = strchunk_new(need > STRLIST_CHUNK_SIZE ?
+		need : STRLIST_CHUNK_SIZE);
+	if (!new)
 		return -1;
-	elem->str = str;
-	elem->str_s = str_s;
 
-	if (!list->first)
-		list->first = elem;
-	else
-		list->last->next = elem;
+	if (!__atomic_compare_exchange_n(&chunk->next, &next, new, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(new);
+		new = next;
+	}
+	__atomic_compare_exchange_n(&list->last, &chunk, new, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	return 0;
+}
+
+char *strlist_reserve(struct strlist *list, size_t str_s)
+{
+	if (str_s > SIZE_MAX / 2) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t need = strrec_size(str_s + 1);
+
+	while (1) {
+		struct strchunk *chunk = __atomic_load_n(&list->last,
+			__ATOMIC_ACQUIRE);
+		size_t used = __atomic_load_n(&chunk->used, __ATOMIC_RELAXED);
 
-	list->last = elem;
+		if (need > chunk->size - used) {
+			if (strlist_grow(list, chunk, need) < 0)
+				return NULL;
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&chunk->used, &used,
+				used + need, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED))
+			continue;
+
+		struct strrec *rec = (struct strrec *) &chunk->data[used];
+		rec->str_s = str_s;
+		rec->str[str_s] = '\n';
+		__atomic_store_n(&rec->state, STRREC_BUSY, __ATOMIC_RELEASE);
+		return rec->str;
+	}
+}
+
+void strlist_commit(struct strlist *list, char *str)
+{
+	__atomic_store_n(&strrec_of(str)->state, STRREC_READY,
+		__ATOMIC_RELEASE);
+}
+
+void strlist_cancel(struct strlist *list, char *str)
+{
+	__atomic_store_n(&strrec_of(str)->state, STRREC_DEAD,
+		__ATOMIC_RELEASE);
+}
+
+int strlist_append(struct strlist *list, char *str, size_t str_s)
+{
+	char *ptr = strlist_reserve(list, str_s);
+	if (!ptr)
+		return -1;
+	memcpy(ptr, str, str_s);
+	strlist_commit(list, ptr);
+	return 0;
+}
+
+/* Handles partial writes, iov is modified */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: writev");
+			return -1;
+		}
+		while (iovcnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
 	return 0;
 }
 
 int strlist_print(struct strlist *list, int fd)
 {
-	for (struct strelem *ptr = list->first; ptr != NULL; ptr = ptr->next) {
-		char *str = ptr->str;
-		size_t str_s = ptr->str_s;
-		while (str_s) {
-			ssize_t ret = write(fd, str, str_s);
-			if (ret < 0) {
-				perror("Error: write");
-				return -1;
+	struct iovec iov[IOV_MAX];
+	int iovcnt = 0;
+
+	/* Strings appended while printing are left for the next time */
+	struct strchunk *last = __atomic_load_n(&list->last, __ATOMIC_ACQUIRE);
+	size_t last_used = __atomic_load_n(&last->used, __ATOMIC_ACQUIRE);
+
+	for (struct strchunk *chunk = list->first; chunk != NULL;
+	     chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+		size_t used = chunk == last ? last_used :
+			__atomic_load_n(&chunk->used, __ATOMIC_ACQUIRE);
+		size_t off = 0;
+
+		while (off < used) {
+			struct strrec *rec = (struct strrec *) &chunk->data[off];
+			int state = __atomic_load_n(&rec->state,
+				__ATOMIC_ACQUIRE);
+			if (state == STRREC_EMPTY)
+				goto done;
+			if (state == STRREC_READY) {
+				if (iovcnt == IOV_MAX) {
+					if (writev_all(fd, iov, iovcnt) < 0)
+						return -1;
+					iovcnt = 0;
+				}
+				iov[iovcnt].iov_base = rec->str;
+				iov[iovcnt].iov_len = rec->str_s + 1;
+				iovcnt++;
 			}
-			str_s -= ret;
+			off += strrec_size(rec->str_s + 1);
 		}
-		write(fd, "\n", 1);
+		if (chunk == last)
+			break;
 	}
-	return 0;
+
+done:
+	return writev_all(fd, iov, iovcnt);
 }
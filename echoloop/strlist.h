@@ -5,10 +5,30 @@
 
 /* A simple sting list to use in echoloop_main */
 
+/*
+ * Strings are stored in large chunks one after another. A string is
+ * added either by strlist_append, which copies it, or by reserving
+ * space with strlist_reserve, filling it in place and calling
+ * strlist_commit (or strlist_cancel if it has to be dropped).
+ *
+ * Any number of threads may reserve and append at once, nothing here
+ * blocks. States of strings are published with release ordering and
+ * strlist_print reads them with acquire loads, so it never sees a
+ * partly filled string. Strings which are still being filled are
+ * skipped. Printing stops at a string whose reservation is just being
+ * made, the rest shows up on the next print.
+ * strlist_print may run concurrently with appends (or interrupt one),
+ * but not with another strlist_print. strlist_delete may not run
+ * concurrently with anything.
+ */
+
 typedef struct strlist strlist_t;
 
 strlist_t *strlist_new();
 void strlist_delete(strlist_t *list);
+char *strlist_reserve(strlist_t *list, size_t str_s);
+void strlist_commit(strlist_t *list, char *str);
+void strlist_cancel(strlist_t *list, char *str);
 int strlist_append(strlist_t *list, char *str, size_t str_s);
 int strlist_print(strlist_t *list, int fd);
 
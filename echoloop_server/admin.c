@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include "admin.h"
+#include "io.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ADMIN_MAX_LISTEN 16
+#define ADMIN_TIMEOUT_MS 100	/* Stuck client can't hold admin longer */
+#define ADMIN_RETRY_MS   100
+
+struct admin {
+	int sock;
+	int (*report)(FILE *);
+};
+
+/* Reads command line, returns its length or -1 */
+static ssize_t admin_read_cmd(int sock, char *cmd)
+{
+	size_t len = 0;
+
+	while (len < ADMIN_CMD_MAX) {
+		ssize_t ret = read(sock, &cmd[len], ADMIN_CMD_MAX - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		char *end = memchr(&cmd[len], '\n', ret);
+		len += ret;
+		if (end) {
+			*end = '\0';
+			return end - cmd;
+		}
+		if (ret == 0)
+			break;
+	}
+	/* Command may also end with EOF */
+	if (!len || len == ADMIN_CMD_MAX)
+		return -1;
+	cmd[len] = '\0';
+	return len;
+}
+
+static void admin_serve(struct admin *admin, int sock)
+{
+	struct timeval tv = { .tv_usec = ADMIN_TIMEOUT_MS * 1000 };
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+	    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		return;
+
+	char cmd[ADMIN_CMD_MAX];
+	if (admin_read_cmd(sock, cmd) < 0)
+		return;
+
+	char *buf = NULL;
+	size_t buf_s = 0;
+	FILE *file = open_memstream(&buf, &buf_s);
+	if (!file)
+		return;
+	if (!strcmp(cmd, "stats")) {
+		if (admin->report(file) < 0)
+			fprintf(file, "error %s\n", strerror(errno));
+	} else {
+		fprintf(file, "error unknown command\n");
+	}
+	if (fclose(file) == 0)
+		writen(sock, buf, buf_s);
+	free(buf);
+}
+
+static void *admin_thread(void *ptr)
+{
+	struct admin *admin = ptr;
+
+	while (1) {
+		int sock = accept4(admin->sock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("Error: admin accept");
+			/* Out of resources, data path may free some */
+			usleep(ADMIN_RETRY_MS * 1000);
+			continue;
+		}
+		admin_serve(admin, sock);
+		close(sock);
+	}
+	return NULL;
+}
+
+int admin_start(pthread_t *thread, struct sockaddr_un *addr,
+		int (*report)(FILE *))
+{
+	struct admin *admin = malloc(sizeof(*admin));
+	if (!admin)
+		return -1;
+	admin->report = report;
+
+	admin->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (admin->sock < 0)
+		goto handle_err;
+	if (bind(admin->sock, (struct sockaddr*) addr, sizeof(*addr)) < 0 ||
+	    listen(admin->sock, ADMIN_MAX_LISTEN) < 0)
+		goto handle_err_sock;
+
+	/* Signals are left to the threads doing the real work */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(thread, NULL, admin_thread, admin);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto handle_err_sock;
+	}
+	return 0;
+
+handle_err_sock:
+	close(admin->sock);
+handle_err:
+	free(admin);
+	return -1;
+}
+
+int admin_query(struct sockaddr_un *addr, char *cmd, int fd)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Error: socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr*) addr, sizeof(*addr)) < 0) {
+		perror("Error: connect");
+		goto handle_err;
+	}
+
+	size_t cmd_s = strlen(cmd);
+	if (writen(sock, cmd, cmd_s) != cmd_s || writen(sock, "\n", 1) != 1) {
+		fprintf(stderr, "Error: can't send command to server\n");
+		goto handle_err;
+	}
+
+	char buf[4096];
+	ssize_t ret;
+	while ((ret = readn(sock, buf, sizeof(buf))) > 0) {
+		if (writen(fd, buf, ret) != ret) {
+			perror("Error: write");
+			goto handle_err;
+		}
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Error: can't receive answer from server\n");
+		goto handle_err;
+	}
+	close(sock);
+	return 0;
+
+handle_err:
+	close(sock);
+	return -1;
+}
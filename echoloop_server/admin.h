@@ -0,0 +1,26 @@
+#ifndef ADMIN_H_
+#define ADMIN_H_
+
+#include <sys/un.h>
+
+#include <pthread.h>
+#include <stdio.h>
+
+/*
+ * Admin endpoint of a running server. It is served by own thread with
+ * all signals blocked, so the data path never waits for it. A client
+ * sends a command line, gets the answer and the connection is closed.
+ * Answers are lines of "name value" pairs.
+ *
+ * Commands:
+ *   stats  - output of report
+ */
+
+#define ADMIN_CMD_MAX 64
+
+int admin_start(pthread_t *thread, struct sockaddr_un *addr,
+		int (*report)(FILE *));
+/* Client side, answer goes to fd */
+int admin_query(struct sockaddr_un *addr, char *cmd, int fd);
+
+#endif /* ADMIN_H_ */
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include "echoloop.h"
+#include "hist.h"
+#include "io.h"
+#include "session.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Load generator: starts a server, drives it with client threads and
+ * prints results as one JSON line. Closed loop by default, clients send
+ * as fast as they are acked. Given a rate it is open loop: sends are
+ * scheduled and latency counts from the scheduled time, so a stalled
+ * server isn't hidden by clients which wait for it.
+ */
+
+#define BENCH_CLIENTS  4
+#define BENCH_MSGS     100000
+#define BENCH_SIZE     64
+#define BENCH_SERVER   "build/echoloop"
+#define BENCH_STR      "BENCH"
+#define BENCH_READY_MS 5000
+
+struct bench_client {
+	pthread_t thread;
+	size_t id;
+	size_t msgs;
+	uint64_t seed;
+	int failed;
+	struct hist latency;	/* From send to ack, in ns */
+};
+
+size_t              bench_clients = BENCH_CLIENTS;
+size_t              bench_msgs = BENCH_MSGS;
+size_t              bench_size_min = BENCH_SIZE;
+size_t              bench_size_max = BENCH_SIZE;
+int                 bench_reuse = 0; /* Session per client */
+size_t              bench_window = SESSION_WINDOW;
+double              bench_rate = 0; /* Msgs/s of all clients, 0 is closed loop */
+char               *bench_server = BENCH_SERVER;
+char               *bench_payload; /* Strs are its prefixes */
+uint64_t            bench_start_ns;
+struct sockaddr_un  bench_addr;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec  = ns / 1000000000,
+		.tv_nsec = ns % 1000000000
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		;
+}
+
+/* Clients take turns, so all of them together keep the rate */
+static uint64_t bench_schedule(struct bench_client *client, size_t seq)
+{
+	double at = (seq * bench_clients + client->id) / bench_rate;
+	return bench_start_ns + (uint64_t) (at * 1e9);
+}
+
+/* Uniform in [bench_size_min, bench_size_max], xorshift64 */
+static size_t bench_size(struct bench_client *client)
+{
+	uint64_t x = client->seed;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	client->seed = x;
+	return bench_size_min + x % (bench_size_max - bench_size_min + 1);
+}
+
+/* Single str over own connection, as a plain client does it */
+static int bench_send_one(struct bench_client *client, uint64_t start)
+{
+	size_t str_s = bench_size(client);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Error: socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr*) &bench_addr,
+			sizeof(bench_addr)) < 0) {
+		perror("Error: connect");
+		goto handle_err;
+	}
+	if (writen(sock, &str_s, sizeof(str_s)) != sizeof(str_s) ||
+	    writen(sock, bench_payload, str_s) != str_s) {
+		fprintf(stderr, "Error: can't send str to server\n");
+		goto handle_err;
+	}
+	size_t ack;
+	if (readn(sock, &ack, sizeof(ack)) != sizeof(ack) || ack != str_s) {
+		fprintf(stderr, "Error: can't receive ack from server\n");
+		goto handle_err;
+	}
+	close(sock);
+
+	hist_add(&client->latency, now_ns() - start);
+	return 0;
+
+handle_err:
+	close(sock);
+	return -1;
+}
+
+static int bench_run_single(struct bench_client *client)
+{
+	for (size_t seq = 0; seq < client->msgs; seq++) {
+		uint64_t start;
+		if (bench_rate) {
+			start = bench_schedule(client, seq);
+			sleep_until(start);
+		} else {
+			start = now_ns();
+		}
+		if (bench_send_one(client, start) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int bench_run_session(struct bench_client *client)
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Error: socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr*) &bench_addr,
+			sizeof(bench_addr)) < 0) {
+		perror("Error: connect");
+		close(sock);
+		return -1;
+	}
+	session_t *session = session_new(sock, bench_window);
+	if (!session) {
+		perror("Error: session_new");
+		close(sock);
+		return -1;
+	}
+
+	int ret = -1;
+	for (size_t seq = 0; seq < client->msgs; seq++) {
+		size_t str_s = bench_size(client);
+		if (!bench_rate) {
+			if (session_send(session, bench_payload, str_s) < 0)
+				goto out;
+			continue;
+		}
+
+		/* Acks are taken as they come while waiting for the turn */
+		uint64_t start = bench_schedule(client, seq);
+		for (uint64_t now; (now = now_ns()) < start;) {
+			if (session_poll(session, start - now) < 0)
+				goto out;
+		}
+		if (session_send_at(session, bench_payload, str_s, start) < 0 ||
+		    session_poll(session, 0) < 0)
+			goto out;
+	}
+	if (session_finish(session) < 0)
+		goto out;
+	hist_merge(&client->latency, &session_stats(session)->latency);
+	ret = 0;
+
+out:
+	session_delete(session);
+	close(sock);
+	return ret;
+}
+
+void *bench_client(void *arg)
+{
+	struct bench_client *client = arg;
+
+	int ret = bench_reuse ? bench_run_session(client) :
+		bench_run_single(client);
+	if (ret < 0)
+		client->failed = 1;
+	return NULL;
+}
+
+/* Returns 1 if some server is bound to the address already */
+int bench_server_running()
+{
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return 0;
+	int ret = bind(sock, (struct sockaddr*) &bench_addr,
+		sizeof(bench_addr));
+	int busy = ret < 0 && errno == EADDRINUSE;
+	close(sock);
+	return busy;
+}
+
+/* Server starts its first threads once it listens */
+int bench_server_ready(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	char line[256];
+	int threads = 0;
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "Threads: %d", &threads) == 1)
+			break;
+	}
+	fclose(file);
+	return threads > 1;
+}
+
+pid_t bench_server_start(char **argv)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Error: fork");
+		return -1;
+	}
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+			perror("Error: open");
+			_exit(EXIT_FAILURE);
+		}
+		execv(bench_server, argv);
+		perror("Error: execv");
+		_exit(EXIT_FAILURE);
+	}
+
+	for (int ms = 0; ms < BENCH_READY_MS; ms++) {
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "Error: server exited\n");
+			return -1;
+		}
+		if (bench_server_ready(pid))
+			return pid;
+		usleep(1000);
+	}
+	fprintf(stderr, "Error: server didn't start\n");
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static uint64_t rusage_ns(struct rusage *ru)
+{
+	return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ull +
+		(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ull;
+}
+
+/* Returns CPU time server has used, it's idle but for the run */
+uint64_t bench_server_stop(pid_t pid)
+{
+	struct rusage ru;
+	kill(pid, SIGTERM);
+	if (wait4(pid, NULL, 0, &ru) < 0)
+		return 0;
+	return rusage_ns(&ru);
+}
+
+uint64_t bench_self_cpu()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return rusage_ns(&ru);
+}
+
+void json_str(char *key, char **strs)
+{
+	printf("\"%s\": \"", key);
+	for (size_t i = 0; strs[i]; i++) {
+		if (i)
+			putchar(' ');
+		for (char *c = strs[i]; *c; c++) {
+			if (*c == '"' || *c == '\\')
+				putchar('\\');
+			putchar(*c);
+		}
+	}
+	printf("\", ");
+}
+
+void bench_report(char **server_args, struct hist *lat, double elapsed,
+		  uint64_t client_cpu, uint64_t server_cpu)
+{
+	printf("{\"bench\": \"echoloop_server\", ");
+	json_str("server_args", server_args);
+	printf("\"clients\": %zu, \"reuse\": %d, \"window\": %zu, "
+		"\"rate\": %.0f, \"size_min\": %zu, \"size_max\": %zu, ",
+		bench_clients, bench_reuse, bench_window, bench_rate,
+		bench_size_min, bench_size_max);
+	printf("\"msgs\": %llu, \"seconds\": %.3f, \"msgs_per_sec\": %.0f, ",
+		(unsigned long long) lat->count, elapsed,
+		lat->count / elapsed);
+	printf("\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+		"\"max_us\": %.1f, ", hist_quantile(lat, 0.5) / 1e3,
+		hist_quantile(lat, 0.99) / 1e3,
+		hist_quantile(lat, 0.999) / 1e3, lat->max / 1e3);
+	printf("\"client_cpu_us_per_msg\": %.3f, "
+		"\"server_cpu_us_per_msg\": %.3f}\n",
+		client_cpu / 1e3 / lat->count, server_cpu / 1e3 / lat->count);
+}
+
+/* "N" or "MIN-MAX" */
+int parse_size(char *str)
+{
+	char *end;
+	bench_size_min = strtoul(str, &end, 0);
+	bench_size_max = bench_size_min;
+	if (*end == '-')
+		bench_size_max = strtoul(end + 1, &end, 0);
+	if (*end != '\0' || bench_size_max < bench_size_min)
+		return -1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:s:rW:R:x:")) != -1) {
+		switch (opt) {
+		case 'c':
+			bench_clients = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			bench_msgs = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (parse_size(optarg) < 0) {
+				fprintf(stderr, "Wrong size: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			bench_reuse = 1;
+			break;
+		case 'W':
+			bench_window = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			bench_rate = strtod(optarg, NULL);
+			break;
+		case 'x':
+			bench_server = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c clients] [-n msgs] "
+				"[-s size|min-max] [-r] [-W window] [-R rate] "
+				"[-x server] [-- server args]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!bench_clients || !bench_msgs || !bench_window ||
+	    bench_rate < 0) {
+		fprintf(stderr, "Wrong argv\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Server gets args after "--" */
+	size_t nargs = argc - optind;
+	char **server_argv = calloc(nargs + 3, sizeof(char *));
+	bench_payload = malloc(bench_size_max + 1);
+	struct bench_client *clients = calloc(bench_clients,
+		sizeof(*clients));
+	if (!server_argv || !bench_payload || !clients) {
+		perror("Error: malloc");
+		exit(EXIT_FAILURE);
+	}
+	server_argv[0] = bench_server;
+	memcpy(&server_argv[1], &argv[optind], nargs * sizeof(char *));
+	server_argv[nargs + 1] = BENCH_STR;
+	for (size_t i = 0; i < bench_size_max; i++)
+		bench_payload[i] = 'a' + i % 26;
+
+	struct sigaction sa_ignore = {
+		.sa_handler = SIG_IGN
+	};
+	if (sigaction(SIGPIPE, &sa_ignore, NULL) < 0) {
+		perror("Error: sigaction");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&bench_addr, 0, sizeof(bench_addr));
+	bench_addr.sun_family = AF_UNIX;
+	bench_addr.sun_path[0] = '\0';
+	strncpy(&bench_addr.sun_path[1], SOCKET_PATH,
+		sizeof(bench_addr.sun_path) - 2);
+
+	if (bench_server_running()) {
+		fprintf(stderr, "Error: echoloop server is running already\n");
+		exit(EXIT_FAILURE);
+	}
+	pid_t server = bench_server_start(server_argv);
+	if (server < 0)
+		exit(EXIT_FAILURE);
+
+	uint64_t client_cpu = bench_self_cpu();
+	bench_start_ns = now_ns();
+
+	size_t started = 0;
+	for (; started < bench_clients; started++) {
+		struct bench_client *client = &clients[started];
+		client->id = started;
+		client->msgs = bench_msgs / bench_clients +
+			(started < bench_msgs % bench_clients);
+		client->seed = 0x9e3779b97f4a7c15ull * (started + 1);
+		hist_init(&client->latency);
+		int ret = pthread_create(&client->thread, NULL, bench_client,
+			client);
+		if (ret != 0) {
+			errno = ret;
+			perror("Error: pthread_create");
+			break;
+		}
+	}
+
+	struct hist lat;
+	hist_init(&lat);
+	int failed = started < bench_clients;
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(clients[i].thread, NULL);
+		failed |= clients[i].failed;
+		hist_merge(&lat, &clients[i].latency);
+	}
+
+	double elapsed = (now_ns() - bench_start_ns) / 1e9;
+	client_cpu = bench_self_cpu() - client_cpu;
+	uint64_t server_cpu = bench_server_stop(server);
+
+	if (failed || !lat.count) {
+		fprintf(stderr, "Error: benchmark failed\n");
+		exit(EXIT_FAILURE);
+	}
+	bench_report(&server_argv[1], &lat, elapsed, client_cpu, server_cpu);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include "strlist.h"
+#include "wal.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Checks of the log and of the strlist, run by make check. Prints one
+ * line per check and fails if any check does. Logs are made in a new
+ * directory under /tmp, which is removed afterwards.
+ */
+
+#define CHECK_WAL_RECS     100
+#define CHECK_COMPACT_RECS 200000	/* Of 100 bytes, past 16 MiB */
+#define CHECK_COMPACT_KEEP 1000
+#define CHECK_THREADS      4
+#define CHECK_OPS          200000	/* Per thread */
+#define CHECK_SHORT        32	/* Distinct interned strs */
+#define CHECK_LONG         8
+#define CHECK_LONG_S       300
+#define CHECK_HELD         500
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		return -1; \
+	} \
+} while (0)
+
+char check_dir[] = "/tmp/echoloop-check-XXXXXX";
+char check_path[sizeof(check_dir) + 8];
+
+/* Replayed strs, in order */
+struct check_replay {
+	size_t nstrs;
+	char strs[CHECK_WAL_RECS][16];
+	uint32_t ttl_ms[CHECK_WAL_RECS];
+};
+
+static int check_add(void *arg, char *str, size_t str_s, uint32_t ttl_ms)
+{
+	struct check_replay *replay = arg;
+	if (replay->nstrs == CHECK_WAL_RECS || str_s >= 16)
+		return -1;
+	memcpy(replay->strs[replay->nstrs], str, str_s);
+	replay->strs[replay->nstrs][str_s] = '\0';
+	replay->ttl_ms[replay->nstrs++] = ttl_ms;
+	return 0;
+}
+
+static int check_count(void *arg, char *str, size_t str_s, uint32_t ttl_ms)
+{
+	(*(size_t *) arg)++;
+	return 0;
+}
+
+static int check_replay(struct strlist_limits *lim,
+			struct check_replay *replay)
+{
+	memset(replay, 0, sizeof(*replay));
+	wal_t *wal = wal_new(check_path, 0, lim, check_add, replay);
+	if (!wal) {
+		perror("Error: wal_new");
+		return -1;
+	}
+	wal_delete(wal);
+	return 0;
+}
+
+/* Strs with a ttl come back with what is left of it, or not at all */
+static int check_wal_tail()
+{
+	struct strlist_limits lim = { 0 };
+	struct check_replay replay = { 0 };
+	struct stat st;
+	uint64_t lsn = 0;
+
+	unlink(check_path);
+	wal_t *wal = wal_new(check_path, 0, &lim, check_add, &replay);
+	CHECK(wal);
+	for (size_t i = 0; i < CHECK_WAL_RECS; i++) {
+		char str[16];
+		int str_s = sprintf(str, "rec-%zu", i);
+		uint32_t ttl_ms = i == 0 ? 1 : i == 1 ? 60000 : 0;
+		CHECK(wal_append(wal, str, str_s, ttl_ms, &lsn) == 0);
+	}
+	CHECK(wal_wait(wal, lsn) == 0);
+	wal_delete(wal);
+	CHECK(stat(check_path, &st) == 0);
+	CHECK(st.st_size == lsn);
+
+	/* Last byte of the last str goes bad */
+	int fd = open(check_path, O_RDWR);
+	CHECK(fd >= 0);
+	CHECK(pwrite(fd, "X", 1, st.st_size - 1) == 1);
+	close(fd);
+	struct timespec ts = { 0, 10000000 };
+	nanosleep(&ts, NULL);
+
+	CHECK(check_replay(&lim, &replay) == 0);
+	CHECK(replay.nstrs == CHECK_WAL_RECS - 2);
+	CHECK(!strcmp(replay.strs[0], "rec-1"));
+	CHECK(replay.ttl_ms[0] > 0 && replay.ttl_ms[0] <= 60000);
+	CHECK(!strcmp(replay.strs[1], "rec-2") && !replay.ttl_ms[1]);
+	CHECK(!strcmp(replay.strs[replay.nstrs - 1], "rec-98"));
+
+	/* Bad record is cut off, the log goes on after what is left */
+	struct stat cut;
+	CHECK(stat(check_path, &cut) == 0);
+	CHECK(cut.st_size < st.st_size);
+	memset(&replay, 0, sizeof(replay));
+	wal = wal_new(check_path, 0, &lim, check_add, &replay);
+	CHECK(wal);
+	CHECK(wal_append(wal, "again", 5, 0, &lsn) == 0);
+	CHECK(wal_wait(wal, lsn) == 0);
+	wal_delete(wal);
+	CHECK(check_replay(&lim, &replay) == 0);
+	CHECK(replay.nstrs == CHECK_WAL_RECS - 1);
+	CHECK(!strcmp(replay.strs[replay.nstrs - 1], "again"));
+	return 0;
+}
+
+/* Log past its compaction size keeps only what the limits keep */
+static int check_wal_compact()
+{
+	struct strlist_limits lim = { .strs = CHECK_COMPACT_KEEP };
+	struct wal_stats stats;
+	struct stat st;
+	size_t replayed = 0;
+	uint64_t lsn = 0;
+	char str[100];
+
+	unlink(check_path);
+	wal_t *wal = wal_new(check_path, 0, &lim, check_count, &replayed);
+	CHECK(wal);
+	memset(str, 'x', sizeof(str));
+	for (size_t i = 0; i < CHECK_COMPACT_RECS; i++)
+		CHECK(wal_append(wal, str, sizeof(str), 0, &lsn) == 0);
+	CHECK(wal_wait(wal, lsn) == 0);
+	/* Compaction comes before the next write, which may be this one */
+	CHECK(wal_append(wal, str, sizeof(str), 0, &lsn) == 0);
+	CHECK(wal_wait(wal, lsn) == 0);
+	wal_stats(wal, &stats);
+	wal_delete(wal);
+
+	/* Batches written after it are still there */
+	CHECK(stats.compactions == 1);
+	CHECK(stat(check_path, &st) == 0);
+	CHECK(st.st_size < lsn / 2);
+	wal = wal_new(check_path, 0, &lim, check_count, &replayed);
+	CHECK(wal);
+	wal_delete(wal);
+	CHECK(replayed == CHECK_COMPACT_KEEP);
+	return 0;
+}
+
+char check_short[CHECK_SHORT][16];
+char check_long[CHECK_LONG][CHECK_LONG_S];
+strlist_t *check_list;
+int check_done;
+
+/* Some strs are cancelled, some expire right away */
+static void *check_worker(void *arg)
+{
+	unsigned int seed = (uintptr_t) arg;
+	void *ret = NULL;
+
+	for (size_t i = 0; i < CHECK_OPS; i++) {
+		unsigned int r = rand_r(&seed);
+		uint32_t ttl_ms = r % 16 ? 0 : 1;
+		strrec_t *rec;
+		if (r / 16 % 8) {
+			char *str = check_short[r / 128 % CHECK_SHORT];
+			if (strlist_intern(check_list, str, strlen(str), ttl_ms,
+					&rec) < 0)
+				goto handle_err;
+		} else {
+			char *str = check_long[r / 128 % CHECK_LONG];
+			char *buf = strlist_reserve(check_list, CHECK_LONG_S,
+				ttl_ms, &rec);
+			if (!buf)
+				goto handle_err;
+			memcpy(buf, str, CHECK_LONG_S);
+		}
+		if (r % 5)
+			strlist_commit(check_list, rec);
+		else
+			strlist_cancel(check_list, rec);
+	}
+	goto handle_done;
+
+handle_err:
+	perror("Error: check_worker");
+	ret = (void *) -1;
+handle_done:
+	__atomic_fetch_add(&check_done, 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* Every rendered line must be one of the strs, even across pieces */
+struct check_out {
+	char line[CHECK_LONG_S + 1];
+	size_t line_s;
+	size_t lines;
+	size_t bad;
+};
+
+static int check_out_add(void *arg, char *buf, size_t len)
+{
+	struct check_out *out = arg;
+
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] != '\n') {
+			if (out->line_s == CHECK_LONG_S)
+				out->bad++;
+			else
+				out->line[out->line_s++] = buf[i];
+			continue;
+		}
+		int found = 0;
+		for (size_t j = 0; j < CHECK_SHORT && !found; j++)
+			found = out->line_s == strlen(check_short[j]) &&
+				!memcmp(out->line, check_short[j], out->line_s);
+		for (size_t j = 0; j < CHECK_LONG && !found; j++)
+			found = out->line_s == CHECK_LONG_S &&
+				!memcmp(out->line, check_long[j], out->line_s);
+		if (!found)
+			out->bad++;
+		out->lines++;
+		out->line_s = 0;
+	}
+	return 0;
+}
+
+static int check_out_fill(void *arg, size_t skip, size_t len,
+			  int (*fill)(void *, char *), void *fill_arg)
+{
+	char *buf = malloc(skip + len);
+	if (!buf || fill(fill_arg, buf) < 0) {
+		free(buf);
+		return -1;
+	}
+	check_out_add(arg, buf + skip, len);
+	free(buf);
+	return 0;
+}
+
+/* One printer tick: evict, compress, render, then nothing uses pieces */
+static int check_tick(struct strlist_limits *lim, uint64_t tag,
+		      struct check_out *out)
+{
+	if (strlist_evict(check_list, lim, stats_now(), tag) < 0 ||
+	    strlist_compress(check_list, 1) < 0 ||
+	    strlist_render(check_list, check_out_add, check_out_fill,
+			   out) < 0)
+		return -1;
+	strlist_reclaim(check_list, tag);
+	return 0;
+}
+
+/* Refs of interned strs are all dropped once every str is evicted */
+static int check_intern_evict()
+{
+	struct strlist_limits lim = { .strs = CHECK_HELD };
+	struct check_out out = { .lines = 0 };
+	struct strlist_stats stats;
+	pthread_t threads[CHECK_THREADS];
+	uint64_t tag = 0;
+
+	for (size_t i = 0; i < CHECK_SHORT; i++)
+		sprintf(check_short[i], "short-%zu", i);
+	for (size_t i = 0; i < CHECK_LONG; i++)
+		memset(check_long[i], 'a' + i, CHECK_LONG_S);
+	check_list = strlist_new();
+	CHECK(check_list);
+
+	for (size_t i = 0; i < CHECK_THREADS; i++)
+		CHECK(pthread_create(&threads[i], NULL, check_worker,
+				     (void *) (i + 1)) == 0);
+	size_t ticks = 0;
+	int done;
+	do {
+		done = __atomic_load_n(&check_done, __ATOMIC_ACQUIRE);
+		CHECK(check_tick(&lim, ++tag, &out) == 0);
+		strlist_stats(check_list, &stats);
+		CHECK(stats.held_strs <= CHECK_HELD);
+		ticks++;
+	} while (done < CHECK_THREADS);
+	int failed = 0;
+	for (size_t i = 0; i < CHECK_THREADS; i++) {
+		void *ret;
+		pthread_join(threads[i], &ret);
+		failed |= ret != NULL;
+	}
+	CHECK(!failed);
+
+	lim = (struct strlist_limits) { .bytes = 1 };
+	for (size_t i = 0; i < 4; i++)
+		CHECK(check_tick(&lim, ++tag, &out) == 0);
+	strlist_stats(check_list, &stats);
+	strlist_delete(check_list);
+
+	CHECK(ticks > 1 && out.lines > 0 && !out.bad && !out.line_s);
+	CHECK(stats.held_strs == 0 && stats.held_bytes == 0);
+	CHECK(stats.intern_strs == 0 && stats.intern_bytes == 0);
+	return 0;
+}
+
+struct check {
+	char *name;
+	int (*run)();
+};
+
+static struct check checks[] = {
+	{ "wal round trip with a corrupted tail", check_wal_tail },
+	{ "wal compaction", check_wal_compact },
+	{ "concurrent intern and evict", check_intern_evict },
+};
+
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+
+	if (!mkdtemp(check_dir)) {
+		perror("Error: mkdtemp");
+		return EXIT_FAILURE;
+	}
+	sprintf(check_path, "%s/log", check_dir);
+
+	for (size_t i = 0; i < sizeof(checks) / sizeof(*checks); i++) {
+		int ret = checks[i].run();
+		printf("%s %s\n", ret < 0 ? "FAIL" : "ok", checks[i].name);
+		if (ret < 0)
+			failed++;
+	}
+
+	unlink(check_path);
+	rmdir(check_dir);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,9 +1,19 @@
+#include "echoloop.h"
+#include "admin.h"
+#include "output.h"
+#include "pool.h"
+#include "printer.h"
+#include "reactor.h"
+#include "recvbuf.h"
+#include "session.h"
+#include "stats.h"
 #include "strlist.h"
+#include "wal.h"
 
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/time.h>
 #include <sys/un.h>
 
 #include <pthread.h>
@@ -17,68 +27,206 @@
 #include <string.h>
 
 #define ECHO_INTERVAL 1
-#define SOCKET_PATH "/tmp/echoloop.sock"
 #define SERVER_MAX_LISTEN 256
+#define OUTPUT_DEPTH 2
+#define BATCH_BUF_SIZE (64 << 10)
+#define MAX_STR_SIZE (64 << 20)
+#define POOL_MAX_EVENTS 64
 
-char               *echo_server_str;
+enum server_mode {
+	SERVER_THREAD,	/* Thread per connection */
+	SERVER_EPOLL,	/* Single threaded event loop */
+	SERVER_POOL	/* Fixed pool of worker threads */
+};
+
+/* Connection of the pool, parked while its client has nothing to send */
+struct server_session {
+	int sock;
+	recvbuf_t *rb;	/* NULL until the first frame is read */
+	size_t seq;
+	int parked;	/* Sock is in echo_park_fd */
+};
+
+enum server_mode    echo_server_mode = SERVER_THREAD;
+struct timespec     echo_interval = { .tv_sec = ECHO_INTERVAL };
+size_t              echo_pool_size = 0; /* Number of CPUs if 0 */
+int                 echo_pool_pin = 0;
+int                 echo_park_fd = -1; /* Parked sessions, pool only */
+char               *echo_server_str; /* With '\n' */
 size_t              echo_server_str_s;
-strlist_t *volatile echo_strlist = NULL;
-pthread_mutex_t     echo_strlist_mutex = PTHREAD_MUTEX_INITIALIZER;
+output_t           *echo_output;
+size_t              echo_output_depth = OUTPUT_DEPTH;
+enum output_policy  echo_output_policy = OUTPUT_COALESCE;
+int                 echo_stdout_flags;
+strlist_t          *echo_strlist = NULL;
+struct strlist_limits echo_retention; /* Unlimited by default */
+uint32_t            echo_ttl_ms = 0; /* Of strs sent, or server default */
+int                 echo_intern = 0; /* Equal short strs share a copy */
+int                 echo_compress = 0; /* Older strs are compressed */
+size_t              echo_hot_ticks; /* Ticks strs stay as they are */
+char               *echo_batch_path = NULL; /* Batch client, "-" is stdin */
+char                echo_batch_delim = '\n';
+size_t              echo_window = SESSION_WINDOW;
+size_t              echo_max_str = MAX_STR_SIZE; /* Longer strs are refused */
+volatile sig_atomic_t echo_stats_wanted = 0; /* Set by SIGUSR2 */
+int                 echo_admin = 0; /* Client queries admin endpoint */
+uint64_t            echo_start_ns;
+char               *echo_trace_path = NULL; /* Trace file if tracing */
+char               *echo_wal_path = NULL; /* Strs are logged before ack */
+struct timespec     echo_commit_interval; /* Of the log, 0 is right away */
+wal_t              *echo_wal = NULL;
 
 
-ssize_t writen(int fd, void *buf, size_t size)
+/* Address in abstract namespace */
+void echoloop_addr(struct sockaddr_un *addr, char *path)
 {
-	char *ptr = buf;
-	size_t start_size = size;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	addr->sun_path[0] = '\0';
+	strncpy(&addr->sun_path[1], path, sizeof(addr->sun_path) - 2);
+}
 
-	while (size) {
-		ssize_t ret = write(fd, ptr, size);
-		if (ret == 0)
-			return -1;
-		if (ret < 0) {
-			if (errno == EINTR)
-				continue;
-			return -1;
-		}
-		size -= ret;
-		ptr += ret;
+/* Several strs are sent over one connection */
+__attribute__ ((noreturn))
+void echoloop_client_session(int sock, char **strs, size_t nstrs)
+{
+	session_t *session = session_new(sock, echo_window);
+	if (!session) {
+		perror("Error: malloc");
+		exit(EXIT_FAILURE);
 	}
+	session_ttl(session, echo_ttl_ms);
+
+	for (size_t i = 0; i < nstrs; i++) {
+		if (session_send(session, strs[i], strlen(strs[i])) < 0)
+			exit(EXIT_FAILURE);
+	}
+	if (session_finish(session) < 0)
+		exit(EXIT_FAILURE);
+
+	session_delete(session);
+	close(sock);
 
-	return start_size;
+	printf("echoloop for %zu strs finished!\n", nstrs);
+	exit(EXIT_SUCCESS);
 }
 
-ssize_t readn(int fd, void *buf, size_t size)
+void echoloop_batch_report(struct session_stats *stats, struct timespec *start)
 {
-	char *ptr = buf;
-	size_t start_size = size;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+	struct hist *lat = &stats->latency;
 
-	while (size) {
-		ssize_t ret = read(fd, ptr, size);
-		if (ret == 0)
-			return start_size - size;
+	printf("echoloop batch of %zu strs (%zu bytes) finished in %.3f s\n",
+		stats->strs, stats->bytes, elapsed);
+	printf("throughput: %.0f strs/s, %.2f MiB/s\n",
+		stats->strs / elapsed, stats->bytes / elapsed / (1 << 20));
+	if (!lat->count)
+		return;
+	printf("ack latency (us): min %.1f avg %.1f p50 %.1f p99 %.1f "
+		"p999 %.1f max %.1f\n", lat->min / 1e3,
+		(double) lat->sum / lat->count / 1e3,
+		hist_quantile(lat, 0.5) / 1e3, hist_quantile(lat, 0.99) / 1e3,
+		hist_quantile(lat, 0.999) / 1e3, lat->max / 1e3);
+}
+
+/* Delimited strs from a file are streamed over one session */
+__attribute__ ((noreturn))
+void echoloop_client_batch(int sock, struct sockaddr_un *addr)
+{
+	int fd = STDIN_FILENO;
+	if (strcmp(echo_batch_path, "-")) {
+		fd = open(echo_batch_path, O_RDONLY);
+		if (fd < 0) {
+			perror("Error: open");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (connect(sock, (struct sockaddr*) addr, sizeof(*addr)) < 0) {
+		perror("Error: connect");
+		exit(EXIT_FAILURE);
+	}
+
+	session_t *session = session_new(sock, echo_window);
+	size_t buf_s = BATCH_BUF_SIZE;
+	char *buf = malloc(buf_s);
+	if (!session || !buf) {
+		perror("Error: malloc");
+		exit(EXIT_FAILURE);
+	}
+	session_ttl(session, echo_ttl_ms);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t used = 0;
+	while (1) {
+		/* A str longer than the buffer makes it grow */
+		if (used == buf_s) {
+			buf_s *= 2;
+			buf = realloc(buf, buf_s);
+			if (!buf) {
+				perror("Error: realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		ssize_t ret = read(fd, buf + used, buf_s - used);
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
-			return -1;
+			perror("Error: read");
+			exit(EXIT_FAILURE);
 		}
-		size -= ret;
-		ptr += ret;
+		if (ret == 0)
+			break;
+
+		char *str = buf;
+		char *end = buf + used + ret;
+		char *delim;
+		while ((delim = memchr(str, echo_batch_delim, end - str))) {
+			if (session_send(session, str, delim - str) < 0)
+				exit(EXIT_FAILURE);
+			str = delim + 1;
+		}
+		used = end - str;
+		memmove(buf, str, used);
 	}
 
-	return start_size;
-}
+	/* Last str may lack its delimiter */
+	if (used && session_send(session, buf, used) < 0)
+		exit(EXIT_FAILURE);
+	if (session_finish(session) < 0)
+		exit(EXIT_FAILURE);
 
+	echoloop_batch_report(session_stats(session), &start);
+	session_delete(session);
+	free(buf);
+	close(sock);
+	exit(EXIT_SUCCESS);
+}
 
 __attribute__ ((noreturn))
-void echoloop_client(int sock, struct sockaddr_un *addr, char *str)
+void echoloop_client(int sock, struct sockaddr_un *addr, char **strs,
+		     size_t nstrs)
 {
 	if (connect(sock, (struct sockaddr*) addr, sizeof(*addr)) < 0) {
 		perror("Error: connect");
 		exit(EXIT_FAILURE);
 	}
 
+	if (nstrs > 1)
+		echoloop_client_session(sock, strs, nstrs); /* noreturn */
+
+	char *str = strs[0];
 	size_t str_s = strlen(str);
-	if (writen(sock, &str_s, sizeof(str_s)) != sizeof(str_s)) {
+	size_t hdr = echo_ttl_ms ? str_s | SESSION_TTL : str_s;
+	if (writen(sock, &hdr, sizeof(hdr)) != sizeof(hdr) || (echo_ttl_ms &&
+	    writen(sock, &echo_ttl_ms, sizeof(echo_ttl_ms)) !=
+			sizeof(echo_ttl_ms))) {
 		fprintf(stderr, "Error: can't send ack to server\n");
 		exit(EXIT_FAILURE);
 	}
@@ -104,109 +252,629 @@ void echoloop_client(int sock, struct sockaddr_un *addr, char *str)
 	exit(EXIT_SUCCESS);
 }
 
-void sighandler_echo(int sig)
+/* Numbers of all threads so far, strlist and output have own ones */
+int echoloop_server_stats(FILE *file)
 {
-	if (writen(STDOUT_FILENO, echo_server_str, echo_server_str_s) < 0) {
-		perror("Error: write");
-		goto handle_err;
+	struct stats *stats = malloc(sizeof(*stats));
+	if (!stats)
+		return -1;
+	stats_collect(stats);
+	stats->counters[STATS_RESERVE_RETRIES] = strlist_retries(echo_strlist);
+
+	struct output_stats out;
+	output_stats(echo_output, &out);
+	struct strlist_stats list;
+	strlist_stats(echo_strlist, &list);
+
+	fprintf(file, "uptime_ns %llu\n",
+		(unsigned long long) (stats_now() - echo_start_ns));
+	fprintf(file, "held_bytes %zu\n", strlist_bytes(echo_strlist));
+	fprintf(file, "live_strs %zu\nlive_bytes %zu\nevicted_strs %zu\n"
+		"evicted_bytes %zu\nexpired_strs %zu\nexpired_bytes %zu\n"
+		"freed_chunks %zu\n", list.held_strs, list.held_bytes,
+		list.evicted_strs, list.evicted_bytes, list.expired_strs,
+		list.expired_bytes, list.freed_chunks);
+	fprintf(file, "interned_strs %zu\nintern_strs %zu\nintern_bytes %zu\n",
+		list.interned_strs, list.intern_strs, list.intern_bytes);
+	fprintf(file, "compressed_chunks %zu\ncompressed_raw %zu\n"
+		"compressed_bytes %zu\ncompress_ratio %.2f\ncold_bytes %zu\n"
+		"inflated_bytes %zu\ninflate_ns %llu\n", list.compressed_chunks,
+		list.compressed_raw, list.compressed_bytes,
+		list.compressed_bytes ? (double) list.compressed_raw /
+			list.compressed_bytes : 0, list.cold_bytes,
+		list.inflated_bytes, (unsigned long long) list.inflate_ns);
+	struct wal_stats wal = { 0 };
+	if (echo_wal)
+		wal_stats(echo_wal, &wal);
+	fprintf(file, "log_records %zu\nlog_bytes %zu\nlog_commits %zu\n"
+		"log_replayed %zu\nlog_compactions %zu\n", wal.records,
+		wal.bytes, wal.commits, wal.replayed, wal.compactions);
+	fprintf(file, "out_ticks %zu\nout_skipped %zu\nout_coalesced %zu\n"
+		"out_dropped %zu\nout_bytes %zu\n", out.ticks, out.skipped,
+		out.coalesced, out.dropped, out.bytes);
+	stats_print(stats, file);
+	free(stats);
+	return 0;
+}
+
+void sighandler_stats(int sig)
+{
+	echo_stats_wanted = 1;
+}
+
+/* Runs in printer thread, concurrently with workers */
+int echoloop_server_print(void *arg)
+{
+	static int warned = 0;
+
+	/* Stats go out with the next tick */
+	if (echo_stats_wanted) {
+		echo_stats_wanted = 0;
+		if (echoloop_server_stats(stderr) < 0)
+			perror("Error: echoloop_server_stats");
 	}
-	if (write(STDOUT_FILENO, "\n", 1) != 1) {
-		perror("Error: write");
+
+	/* Evicted strs are not in this tick, older ones may still use them */
+	if (strlist_evict(echo_strlist, &echo_retention, stats_now(),
+			output_seq(echo_output)) < 0) {
+		perror("Error: strlist_evict");
 		goto handle_err;
 	}
 
-	if (echo_strlist && strlist_print(echo_strlist, STDOUT_FILENO) < 0) {
-		perror("Error: write");
+	/* It's left as it is if there is no memory for it */
+	if (echo_compress) {
+		uint64_t start = stats_now();
+		if (strlist_compress(echo_strlist, echo_hot_ticks) < 0)
+			perror("Error: strlist_compress");
+		stats_stage(STATS_COMPRESS, start);
+	}
+
+	int ret = output_begin(echo_output);
+	if (ret < 0) {
+		perror("Error: output_begin");
 		goto handle_err;
 	}
 
-	return;
+	struct output_stats stats;
+	output_stats(echo_output, &stats);
+	if (!warned && stats.skipped + stats.coalesced + stats.dropped) {
+		fprintf(stderr, "Warning: stdout is slow, ticks are lost\n");
+		warned = 1;
+	}
+
+	if (ret > 0) {
+		uint64_t start = stats_now();
+		if (output_add(echo_output, echo_server_str,
+				echo_server_str_s) < 0 ||
+		    strlist_render(echo_strlist, output_add, output_add_fill,
+				echo_output) < 0) {
+			perror("Error: output_add");
+			goto handle_err;
+		}
+		output_end(echo_output);
+		stats_stage(STATS_TICK, start);
+	}
+
+	ret = output_flush(echo_output);
+	if (ret < 0)
+		goto handle_err;
+	strlist_reclaim(echo_strlist, output_done(echo_output));
+	return ret;
 
 handle_err:
-	pthread_mutex_lock(&echo_strlist_mutex);
-	if (echo_strlist)
-		strlist_delete(echo_strlist);
+	/* Workers may still append, leave echo_strlist to exit() */
 	exit(EXIT_FAILURE);
 }
 
+int echoloop_server_flush(void *arg)
+{
+	int ret = output_flush(echo_output);
+	if (ret < 0)
+		exit(EXIT_FAILURE);
+	strlist_reclaim(echo_strlist, output_done(echo_output));
+	return ret;
+}
+
+void restore_stdout()
+{
+	fcntl(STDOUT_FILENO, F_SETFL, echo_stdout_flags);
+}
+
+/* Slow reader of stdout must never stall anything but the printer */
 int prepare_echo()
 {
-	struct sigaction echo_sa = {
-		.sa_handler = sighandler_echo,
-		.sa_flags   = SA_RESTART
-	};
+	echo_stdout_flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (echo_stdout_flags < 0 || fcntl(STDOUT_FILENO, F_SETFL,
+			echo_stdout_flags | O_NONBLOCK) < 0) {
+		perror("Error: fcntl");
+		return -1;
+	}
+	atexit(restore_stdout);
 
-	struct itimerval echo_time = {
-		.it_interval = { .tv_sec = ECHO_INTERVAL, .tv_usec = 0 },
-		.it_value    = { .tv_sec = ECHO_INTERVAL, .tv_usec = 0 }
-	};
+	echo_output = output_new(STDOUT_FILENO, echo_output_depth,
+		echo_output_policy);
+	if (!echo_output) {
+		perror("Error: output_new");
+		return -1;
+	}
+	return 0;
+}
 
-	if (sigaction(SIGALRM, &echo_sa, NULL) < 0) {
-		perror("Error: sigaction");
+/* Size comes from the client, so it is checked before anything is taken */
+char *echoloop_server_reserve(size_t buf_s, uint32_t ttl_ms, char *scratch,
+			      strrec_t **rec)
+{
+	if (buf_s > echo_max_str) {
+		stats_add(STATS_ERR_TOO_LONG, 1);
+		errno = EMSGSIZE;
+		return NULL;
+	}
+	if (echo_intern && buf_s <= SERVER_INTERN_MAX) {
+		*rec = NULL;
+		return scratch;
+	}
+
+	uint64_t start = stats_now();
+	char *buf = strlist_reserve(echo_strlist, buf_s,
+		ttl_ms ? ttl_ms : echo_ttl_ms, rec);
+	if (!buf) {
+		stats_add(STATS_ERR_RESERVE, 1);
+		return NULL;
+	}
+	stats_stage(STATS_RESERVE, start);
+	return buf;
+}
+
+/* TTL follows the size if it has SESSION_TTL */
+int echoloop_server_ttl(recvbuf_t *rb, size_t *buf_s, uint32_t *ttl_ms)
+{
+	if (!(*buf_s & SESSION_TTL))
+		return 0;
+	*buf_s &= ~SESSION_TTL;
+
+	size_t done = 0;
+	if (recvbuf_read(rb, ttl_ms, sizeof(*ttl_ms), &done) < 0) {
+		stats_add(STATS_ERR_HDR, 1);
+		fprintf(stderr, "Error: can't get ttl from client\n");
 		return -1;
 	}
+	return 0;
+}
 
-	if (setitimer(ITIMER_REAL, &echo_time, NULL) < 0) {
-		perror("Error: setitimer\n");
+int echoloop_server_received(char *buf, size_t buf_s, uint32_t ttl_ms,
+			     strrec_t **rec, uint64_t *lsn)
+{
+	stats_add(STATS_STRS, 1);
+	stats_add(STATS_BYTES, buf_s);
+	if (!ttl_ms)
+		ttl_ms = echo_ttl_ms;
+
+	if (!*rec) {
+		uint64_t start = stats_now();
+		if (strlist_intern(echo_strlist, buf, buf_s, ttl_ms, rec) < 0) {
+			stats_add(STATS_ERR_RESERVE, 1);
+			perror("Error: strlist_intern");
+			return -1;
+		}
+		stats_stage(STATS_RESERVE, start);
+	}
+
+	if (echo_wal && wal_append(echo_wal, buf, buf_s, ttl_ms, lsn) < 0) {
+		stats_add(STATS_ERR_LOG, 1);
+		perror("Error: wal_append");
 		return -1;
 	}
+	return 0;
+}
+
+int echoloop_server_sync(uint64_t lsn)
+{
+	if (!lsn)
+		return 0;
 
+	uint64_t start = stats_now();
+	if (wal_wait(echo_wal, lsn) < 0) {
+		stats_add(STATS_ERR_LOG, 1);
+		perror("Error: wal_wait");
+		return -1;
+	}
+	stats_stage(STATS_SYNC, start);
 	return 0;
 }
 
-void* echoloop_server_worker(void *arg)
+int echoloop_server_synced(uint64_t lsn)
+{
+	if (!lsn)
+		return 1;
+
+	int ret = wal_synced(echo_wal, lsn);
+	if (ret < 0) {
+		stats_add(STATS_ERR_LOG, 1);
+		perror("Error: wal_synced");
+	}
+	return ret;
+}
+
+int echoloop_server_sync_fd()
+{
+	return echo_wal ? wal_fd(echo_wal) : -1;
+}
+
+/* Logged strs are put back as they were received, without counting */
+int echoloop_server_replay(void *arg, char *str, size_t str_s,
+			   uint32_t ttl_ms)
+{
+	strrec_t *rec;
+	if (echo_intern && str_s <= SERVER_INTERN_MAX) {
+		if (strlist_intern(echo_strlist, str, str_s, ttl_ms, &rec) < 0)
+			return -1;
+	} else {
+		char *buf = strlist_reserve(echo_strlist, str_s, ttl_ms, &rec);
+		if (!buf)
+			return -1;
+		memcpy(buf, str, str_s);
+	}
+	strlist_commit(echo_strlist, rec);
+	return 0;
+}
+
+void echoloop_server_commit(strrec_t *rec)
+{
+	strlist_commit(echo_strlist, rec);
+}
+
+void echoloop_server_cancel(strrec_t *rec)
+{
+	if (rec)
+		strlist_cancel(echo_strlist, rec);
+}
+
+/* Strs of a batch are echoed only once the client knows they're taken */
+int echoloop_server_ack(int sock, size_t seq, strrec_t **recs,
+			size_t *nrecs, uint64_t lsn)
+{
+	if (echoloop_server_sync(lsn) < 0)
+		return -1;
+
+	uint64_t start = stats_now();
+	if (writen(sock, &seq, sizeof(seq)) != sizeof(seq)) {
+		stats_add(STATS_ERR_ACK, 1);
+		fprintf(stderr, "Error: can't send ack to client\n");
+		return -1;
+	}
+	stats_stage(STATS_ACK, start);
+	stats_add(STATS_ACKS, 1);
+	for (size_t i = 0; i < *nrecs; i++)
+		echoloop_server_commit(recs[i]);
+	*nrecs = 0;
+	return 0;
+}
+
+/* Returns 1 if session is parked, its client has nothing more by now */
+int echoloop_server_session(struct server_session *sess, int park)
 {
-	int sock = (intptr_t) arg;
+	char scratch[SERVER_INTERN_MAX];
+	strrec_t *recs[SESSION_ACK_BATCH];
+	int sock = sess->sock;
+	recvbuf_t *rb = sess->rb;
+	size_t nrecs = 0;
+	size_t seq = sess->seq;
+	uint64_t lsn = 0;
+
+	while (1) {
+		size_t buf_s;
+		size_t done = 0;
+		uint64_t start = stats_now();
+		if (recvbuf_read(rb, &buf_s, sizeof(buf_s), &done) < 0) {
+			/* Session ends at a frame boundary */
+			if (recvbuf_eof(rb) && !done)
+				break;
+			stats_add(STATS_ERR_HDR, 1);
+			fprintf(stderr, "Error: can't get size from client\n");
+			goto handle_err;
+		}
+		uint32_t ttl_ms = 0;
+		if (echoloop_server_ttl(rb, &buf_s, &ttl_ms) < 0)
+			goto handle_err;
+		stats_stage(STATS_HDR, start);
+
+		char *buf = echoloop_server_reserve(buf_s, ttl_ms, scratch,
+			&recs[nrecs]);
+		if (!buf) {
+			perror("Error: strlist_reserve");
+			goto handle_err;
+		}
+		nrecs++;
+
+		done = 0;
+		start = stats_now();
+		if (recvbuf_read(rb, buf, buf_s, &done) < 0) {
+			stats_add(STATS_ERR_DATA, 1);
+			fprintf(stderr, "Error: failed to read data from client\n");
+			goto handle_err;
+		}
+		stats_stage(STATS_DATA, start);
+		if (echoloop_server_received(buf, buf_s, ttl_ms,
+				&recs[nrecs - 1], &lsn) < 0)
+			goto handle_err;
+		seq++;
+
+		if (nrecs == SESSION_ACK_BATCH || !recvbuf_pending(rb)) {
+			if (echoloop_server_ack(sock, seq, recs, &nrecs,
+					lsn) < 0)
+				goto handle_err;
+			/* Worker serves others while the client is quiet */
+			if (park && !recvbuf_pending(rb)) {
+				sess->seq = seq;
+				return 1;
+			}
+		}
+	}
+
+	close(sock);
+	recvbuf_delete(rb);
+	return 0;
+
+handle_err:
+	close(sock);
+	recvbuf_delete(rb);
+	for (size_t i = 0; i < nrecs; i++)
+		echoloop_server_cancel(recs[i]);
+	return 0;
+}
+
+/* Returns 1 if connection goes on as a parked session */
+int echoloop_server_conn(struct server_session *sess, int park)
+{
+	int sock = sess->sock;
+	char scratch[SERVER_INTERN_MAX];
+	strrec_t *rec = NULL;
+	size_t done = 0;
+	uint64_t lsn = 0;
+
+	recvbuf_t *rb = recvbuf_new(sock);
+	if (!rb) {
+		perror("Error: recvbuf_new");
+		goto handle_err;
+	}
 
 	size_t buf_s;
-	if (readn(sock, &buf_s, sizeof(buf_s)) != sizeof(buf_s)) {
+	uint64_t start = stats_now();
+	if (recvbuf_read(rb, &buf_s, sizeof(buf_s), &done) < 0) {
+		stats_add(STATS_ERR_HDR, 1);
 		fprintf(stderr, "Error: can't get ack from client\n");
-		return NULL;
+		goto handle_err;
+	}
+	if (buf_s == SESSION_MAGIC) {
+		stats_stage(STATS_HDR, start);
+		stats_add(STATS_SESSIONS, 1);
+		sess->rb = rb;
+		return echoloop_server_session(sess, park);
 	}
+	uint32_t ttl_ms = 0;
+	if (echoloop_server_ttl(rb, &buf_s, &ttl_ms) < 0)
+		goto handle_err;
+	stats_stage(STATS_HDR, start);
 
-	char *buf = malloc(buf_s);
+	char *buf = echoloop_server_reserve(buf_s, ttl_ms, scratch, &rec);
 	if (!buf) {
-		perror("Error: malloc");
-		return NULL;
+		perror("Error: strlist_reserve");
+		goto handle_err;
 	}
 
-	if (readn(sock, buf, buf_s) != buf_s) {
+	done = 0;
+	start = stats_now();
+	if (recvbuf_read(rb, buf, buf_s, &done) < 0) {
+		stats_add(STATS_ERR_DATA, 1);
 		fprintf(stderr, "Error: failed to read data from client\n");
-		free(buf);
-		return NULL;
+		goto handle_err;
 	}
+	stats_stage(STATS_DATA, start);
+	if (echoloop_server_received(buf, buf_s, ttl_ms, &rec, &lsn) < 0 ||
+	    echoloop_server_sync(lsn) < 0)
+		goto handle_err;
 
+	start = stats_now();
 	if (writen(sock, &buf_s, sizeof(buf_s)) != sizeof(buf_s)) {
+		stats_add(STATS_ERR_ACK, 1);
 		fprintf(stderr, "Error: can't send ack to client\n");
-		free(buf);
-		return NULL;
+		goto handle_err;
 	}
+	stats_stage(STATS_ACK, start);
+	stats_add(STATS_ACKS, 1);
 
 	close(sock);
+	recvbuf_delete(rb);
+	echoloop_server_commit(rec);
+	return 0;
 
-	pthread_mutex_lock(&echo_strlist_mutex);
-	if (strlist_append(echo_strlist, buf, buf_s) < 0) {
-		pthread_mutex_unlock(&echo_strlist_mutex);
-		free(buf);
-		perror("Error: malloc");
+handle_err:
+	close(sock);
+	if (rb)
+		recvbuf_delete(rb);
+	if (rec)
+		echoloop_server_cancel(rec);
+	return 0;
+}
+
+void* echoloop_server_worker(void *arg)
+{
+	struct server_session sess = { .sock = (intptr_t) arg };
+
+	echoloop_server_conn(&sess, 0);
+	return NULL;
+}
+
+/* Session goes back to the pool once its client sends something */
+int echoloop_server_park(struct server_session *sess)
+{
+	/* Someone else may have it as soon as it's in */
+	int op = sess->parked ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	sess->parked = 1;
+	struct epoll_event ev = {
+		.events   = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+		.data.ptr = sess
+	};
+	if (epoll_ctl(echo_park_fd, op, sess->sock, &ev) < 0) {
+		perror("Error: epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+/* Task is a new connection or a parked session which has input */
+void* echoloop_server_pool_worker(void *arg)
+{
+	struct server_session *sess = arg;
+
+	int ret = sess->rb ? echoloop_server_session(sess, 1) :
+		echoloop_server_conn(sess, 1);
+	if (!ret) {
+		free(sess);
 		return NULL;
 	}
-	pthread_mutex_unlock(&echo_strlist_mutex);
+
+	if (echoloop_server_park(sess) < 0) {
+		close(sess->sock);
+		recvbuf_delete(sess->rb);
+		free(sess);
+	}
 	return NULL;
 }
 
+/* Accepts, and gives connections to the pool once they have input */
+int echoloop_server_pool_run(int serv_sock, pool_t *pool)
+{
+	echo_park_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (echo_park_fd < 0) {
+		perror("Error: epoll_create1");
+		return -1;
+	}
+
+	/* Listening socket is the only one with NULL data */
+	struct epoll_event ev = {
+		.events   = EPOLLIN,
+		.data.ptr = NULL
+	};
+	if (epoll_ctl(echo_park_fd, EPOLL_CTL_ADD, serv_sock, &ev) < 0) {
+		perror("Error: epoll_ctl");
+		return -1;
+	}
+
+	struct epoll_event events[POOL_MAX_EVENTS];
+	while (1) {
+		int n = epoll_wait(echo_park_fd, events, POOL_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: epoll_wait");
+			return -1;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct server_session *sess = events[i].data.ptr;
+			if (sess) {
+				pool_push(pool, sess);
+				continue;
+			}
+
+			uint64_t start = stats_now();
+			int sock = accept(serv_sock, NULL, NULL);
+			if (sock < 0) {
+				stats_add(STATS_ERR_ACCEPT, 1);
+				perror("Error: accept");
+				return -1;
+			}
+			stats_stage(STATS_ACCEPT, start);
+			stats_add(STATS_CONNS, 1);
+
+			sess = calloc(1, sizeof(*sess));
+			if (!sess) {
+				perror("Error: calloc");
+				close(sock);
+				continue;
+			}
+			/* Idle client must not take a worker */
+			sess->sock = sock;
+			if (echoloop_server_park(sess) < 0) {
+				close(sock);
+				free(sess);
+			}
+		}
+	}
+}
+
 __attribute__ ((noreturn))
 void echoloop_server(int serv_sock)
 {
 	if (prepare_echo() < 0)
 		exit(EXIT_FAILURE);
 
+	/* History is back before anyone is served */
+	if (echo_wal_path) {
+		echo_wal = wal_new(echo_wal_path,
+			echo_commit_interval.tv_sec * 1000000000ull +
+			echo_commit_interval.tv_nsec, &echo_retention,
+			echoloop_server_replay, NULL);
+		if (!echo_wal) {
+			perror("Error: wal_new");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct sockaddr_un addr;
+	echoloop_addr(&addr, ADMIN_SOCKET_PATH);
+	pthread_t admin;
+	if (admin_start(&admin, &addr, echoloop_server_stats) < 0) {
+		perror("Error: admin_start");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Blocking calls are restarted, or they handle EINTR */
+	struct sigaction sa_stats = {
+		.sa_handler = sighandler_stats,
+		.sa_flags   = SA_RESTART
+	};
+	if (sigaction(SIGUSR2, &sa_stats, NULL) < 0) {
+		perror("Error: sigaction");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t printer;
+	if (printer_start(&printer, &echo_interval, STDOUT_FILENO,
+			echoloop_server_print, echoloop_server_flush, NULL) < 0) {
+		perror("Error: printer_start");
+		exit(EXIT_FAILURE);
+	}
+
+	if (echo_server_mode == SERVER_EPOLL) {
+		reactor_run(serv_sock);
+		goto handle_err;
+	}
+
+	if (echo_server_mode == SERVER_POOL) {
+		if (!echo_pool_size)
+			echo_pool_size = sysconf(_SC_NPROCESSORS_ONLN);
+		pool_t *pool = pool_new(echo_pool_size, echo_pool_pin,
+			echoloop_server_pool_worker);
+		if (!pool) {
+			perror("Error: pool_new");
+			goto handle_err;
+		}
+		echoloop_server_pool_run(serv_sock, pool);
+		goto handle_err;
+	}
+
 	while (1) {
+		uint64_t start = stats_now();
 		int sock = accept(serv_sock, NULL, NULL);
 		if (sock < 0) {
+			stats_add(STATS_ERR_ACCEPT, 1);
 			perror("Error: accept");
 			goto handle_err;
 		}
+		stats_stage(STATS_ACCEPT, start);
+		stats_add(STATS_CONNS, 1);
 		pthread_t worker;
 		int ret = pthread_create(&worker, NULL, echoloop_server_worker,
 			(void*) (intptr_t) sock);
@@ -223,18 +891,153 @@ void echoloop_server(int serv_sock)
 
 handle_err:
 	close(serv_sock);
-	pthread_mutex_lock(&echo_strlist_mutex);
-	if (echo_strlist)
-		strlist_delete(echo_strlist);
 	exit(EXIT_FAILURE);
 }
 
 
+int parse_mode(char *str)
+{
+	if (!strcmp(str, "thread"))
+		echo_server_mode = SERVER_THREAD;
+	else if (!strcmp(str, "epoll"))
+		echo_server_mode = SERVER_EPOLL;
+	else if (!strcmp(str, "pool"))
+		echo_server_mode = SERVER_POOL;
+	else
+		return -1;
+	return 0;
+}
+
+int parse_policy(char *str)
+{
+	if (!strcmp(str, "skip"))
+		echo_output_policy = OUTPUT_SKIP;
+	else if (!strcmp(str, "coalesce"))
+		echo_output_policy = OUTPUT_COALESCE;
+	else if (!strcmp(str, "drop"))
+		echo_output_policy = OUTPUT_DROP;
+	else
+		return -1;
+	return 0;
+}
+
+/* Rounded up to whole ms */
+uint32_t ttl_ms(struct timespec *ttl)
+{
+	uint64_t ms = ttl->tv_sec * 1000ull + (ttl->tv_nsec + 999999) / 1000000;
+	return ms < UINT32_MAX ? ms : UINT32_MAX;
+}
+
+/* Options stop at the first str, "--" goes before one which starts with '-' */
+void usage(char *prog)
+{
+	fprintf(stderr, "Wrong argv\n"
+		"Usage: %s [options] [--] str...\n"
+		"       %s [options] -b file\n"
+		"       %s -A\n", prog, prog, prog);
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 2) {
-		fprintf(stderr, "Wrong argv\n");
-		exit(EXIT_FAILURE);
+	struct timespec age;
+	int opt;
+	while ((opt = getopt(argc, argv, "+m:w:pi:o:q:b:0W:M:AT:N:B:a:t:Iz:L:C:")) != -1) {
+		switch (opt) {
+		case 'm':
+			if (parse_mode(optarg) < 0) {
+				fprintf(stderr, "Wrong mode: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'w':
+			echo_pool_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			echo_pool_pin = 1;
+			break;
+		case 'i':
+			if (printer_parse_interval(optarg, &echo_interval) < 0) {
+				fprintf(stderr, "Wrong interval: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'o':
+			if (parse_policy(optarg) < 0) {
+				fprintf(stderr, "Wrong policy: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'q':
+			echo_output_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			echo_batch_path = optarg;
+			break;
+		case '0':
+			echo_batch_delim = '\0';
+			break;
+		case 'W':
+			echo_window = strtoul(optarg, NULL, 0);
+			if (!echo_window) {
+				fprintf(stderr, "Wrong window: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'M':
+			echo_max_str = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			echo_admin = 1;
+			break;
+		case 'T':
+			echo_trace_path = optarg;
+			break;
+		case 'N':
+			echo_retention.strs = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			echo_retention.bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			if (printer_parse_interval(optarg, &age) < 0) {
+				fprintf(stderr, "Wrong ttl: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			echo_ttl_ms = ttl_ms(&age);
+			break;
+		case 'I':
+			echo_intern = 1;
+			break;
+		case 'z':
+			echo_compress = 1;
+			echo_hot_ticks = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			echo_wal_path = optarg;
+			break;
+		case 'C':
+			if (!strcmp(optarg, "0"))
+				memset(&echo_commit_interval, 0,
+				       sizeof(echo_commit_interval));
+			else if (printer_parse_interval(optarg,
+					&echo_commit_interval) < 0) {
+				fprintf(stderr, "Wrong commit interval: %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'a':
+			if (printer_parse_interval(optarg, &age) < 0) {
+				fprintf(stderr, "Wrong age: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			echo_retention.age_ns = age.tv_sec * 1000000000ull +
+				age.tv_nsec;
+			break;
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	/* Ignore sigpipe */
@@ -246,12 +1049,27 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	/* Server address */
 	struct sockaddr_un addr;
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	addr.sun_path[0] = '\0';
-	strncpy(&addr.sun_path[1], SOCKET_PATH, sizeof(addr.sun_path) - 2);
+	if (echo_admin) {
+		if (optind != argc) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		echoloop_addr(&addr, ADMIN_SOCKET_PATH);
+		if (admin_query(&addr, "stats", STDOUT_FILENO) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
+	/* Batch client takes its strs from a file */
+	if (echo_batch_path ? optind != argc : optind == argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	char *str = argv[optind];
+	size_t nstrs = argc - optind;
+
+	echoloop_addr(&addr, SOCKET_PATH);
 
 	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (sock < 0) {
@@ -259,13 +1077,23 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (echo_batch_path)
+		echoloop_client_batch(sock, &addr); /* noreturn */
+
 	if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
 		if (errno == EADDRINUSE)
-			echoloop_client(sock, &addr, argv[1]); /* noreturn */
+			echoloop_client(sock, &addr, &argv[optind],
+				nstrs); /* noreturn */
 		perror("Error: bind");
 		exit(EXIT_FAILURE);
 	}
 
+	/* Server has a single str */
+	if (nstrs != 1) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	if (listen(sock, SERVER_MAX_LISTEN) < 0) {
 		perror("Error: listen\n");
 		exit(EXIT_FAILURE);
@@ -276,8 +1104,20 @@ int main(int argc, char *argv[])
 		perror("Error: malloc\n");
 		exit(EXIT_FAILURE);
 	}
-	echo_server_str = argv[1];
-	echo_server_str_s = strlen(argv[1]);
+	echo_server_str_s = strlen(str) + 1;
+	echo_server_str = malloc(echo_server_str_s);
+	if (!echo_server_str) {
+		perror("Error: malloc\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(echo_server_str, str, echo_server_str_s - 1);
+	echo_server_str[echo_server_str_s - 1] = '\n';
+
+	if (echo_trace_path && stats_trace(echo_trace_path) < 0) {
+		perror("Error: stats_trace");
+		exit(EXIT_FAILURE);
+	}
 
+	echo_start_ns = stats_now();
 	echoloop_server(sock); /* noreturn */
 }
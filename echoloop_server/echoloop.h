@@ -0,0 +1,41 @@
+#ifndef ECHOLOOP_H_
+#define ECHOLOOP_H_
+
+#include "io.h"
+#include "strlist.h"
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Things shared between echoloop server modes */
+
+#define SOCKET_PATH "/tmp/echoloop.sock" /* In abstract namespace */
+#define ADMIN_SOCKET_PATH "/tmp/echoloop.admin"
+
+#define SERVER_INTERN_MAX 1024 /* Longer strs are never interned */
+
+/*
+ * Received strings are put straight into echo_strlist. If interning is
+ * on, short ones are read into scratch instead, rec is NULL until they
+ * are received.
+ */
+char *echoloop_server_reserve(size_t buf_s, uint32_t ttl_ms, char *scratch,
+			      strrec_t **rec);
+void echoloop_server_commit(strrec_t *rec);
+void echoloop_server_cancel(strrec_t *rec);
+/*
+ * Counts a str which is fully received, interns it if it has to and
+ * appends it to the log, if there is one. Its ack waits for lsn to be
+ * synced, lsn is left as it is without a log.
+ */
+int echoloop_server_received(char *buf, size_t buf_s, uint32_t ttl_ms,
+			     strrec_t **rec, uint64_t *lsn);
+/* Blocks until lsn is synced, 0 is always synced */
+int echoloop_server_sync(uint64_t lsn);
+/* Returns 1 if lsn is synced, 0 if not yet */
+int echoloop_server_synced(uint64_t lsn);
+/* Readable once more strs may be synced, -1 if there is no log */
+int echoloop_server_sync_fd();
+
+#endif /* ECHOLOOP_H_ */
@@ -0,0 +1,35 @@
+#ifndef HIST_H_
+#define HIST_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: values below 2^HIST_SUB_BITS get own buckets,
+ * larger ones are grouped by power of two, each power split in
+ * 2^HIST_SUB_BITS buckets, so a quantile is within ~6% of the value.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *hist);
+void hist_add(struct hist *hist, uint64_t val);
+/*
+ * For a histogram which other threads read: one thread adds, any may
+ * merge it at the same time and get a slightly stale copy.
+ */
+void hist_add_shared(struct hist *hist, uint64_t val);
+void hist_merge(struct hist *dst, struct hist *src);
+/* q is in [0, 1], returns 0 for an empty histogram */
+uint64_t hist_quantile(struct hist *hist, double q);
+
+#endif /* HIST_H_ */
@@ -0,0 +1,214 @@
+#include "intern.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INTERN_STRIPES 64
+#define INTERN_BUCKETS 16	/* Per stripe at first */
+
+struct intern_stripe {
+	pthread_mutex_t lock;
+	size_t nbuckets;
+	size_t nstrs;
+	size_t bytes;
+	size_t hits;
+	struct intern_str **buckets;
+	struct intern_str *dropped;	/* Waiting for reclaim */
+} __attribute__ ((aligned(64)));
+
+struct intern {
+	struct intern_stripe stripes[INTERN_STRIPES];
+};
+
+/* FNV-1a, low bits pick a stripe and the rest a bucket */
+static uint64_t intern_hash(char *str, size_t str_s)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < str_s; i++) {
+		hash ^= (unsigned char) str[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static inline size_t intern_bucket(struct intern_stripe *stripe,
+				   uint64_t hash)
+{
+	return (hash >> 6) & (stripe->nbuckets - 1);
+}
+
+struct intern *intern_new()
+{
+	struct intern *in = calloc(1, sizeof(*in));
+	if (!in)
+		return NULL;
+
+	for (int i = 0; i < INTERN_STRIPES; i++) {
+		struct intern_stripe *stripe = &in->stripes[i];
+		pthread_mutex_init(&stripe->lock, NULL);
+		stripe->nbuckets = INTERN_BUCKETS;
+		stripe->buckets = calloc(INTERN_BUCKETS,
+			sizeof(*stripe->buckets));
+		if (!stripe->buckets) {
+			intern_delete(in);
+			return NULL;
+		}
+	}
+	return in;
+}
+
+static void intern_free_list(struct intern_str *str)
+{
+	while (str) {
+		struct intern_str *next = str->next;
+		free(str);
+		str = next;
+	}
+}
+
+void intern_delete(struct intern *in)
+{
+	for (int i = 0; i < INTERN_STRIPES; i++) {
+		struct intern_stripe *stripe = &in->stripes[i];
+		if (stripe->buckets) {
+			for (size_t j = 0; j < stripe->nbuckets; j++)
+				intern_free_list(stripe->buckets[j]);
+		}
+		intern_free_list(stripe->dropped);
+		free(stripe->buckets);
+		pthread_mutex_destroy(&stripe->lock);
+	}
+	free(in);
+}
+
+/* Chains stay short, if there is no memory they just get longer */
+static void intern_grow(struct intern_stripe *stripe)
+{
+	size_t nbuckets = stripe->nbuckets * 2;
+	struct intern_str **buckets = calloc(nbuckets, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	struct intern_str **old = stripe->buckets;
+	size_t old_n = stripe->nbuckets;
+	stripe->buckets = buckets;
+	stripe->nbuckets = nbuckets;
+	for (size_t i = 0; i < old_n; i++) {
+		struct intern_str *str = old[i];
+		while (str) {
+			struct intern_str *next = str->next;
+			size_t bucket = intern_bucket(stripe, str->hash);
+			str->next = buckets[bucket];
+			buckets[bucket] = str;
+			str = next;
+		}
+	}
+	free(old);
+}
+
+struct intern_str *intern_get(struct intern *in, char *str, size_t str_s)
+{
+	uint64_t hash = intern_hash(str, str_s);
+	struct intern_stripe *stripe = &in->stripes[hash % INTERN_STRIPES];
+
+	pthread_mutex_lock(&stripe->lock);
+	struct intern_str **head = &stripe->buckets[intern_bucket(stripe,
+		hash)];
+	struct intern_str *found = *head;
+	for (; found; found = found->next) {
+		if (found->hash == hash && found->str_s == str_s &&
+		    !memcmp(found->text, str, str_s)) {
+			found->refs++;
+			__atomic_store_n(&stripe->hits, stripe->hits + 1,
+				__ATOMIC_RELAXED);
+			pthread_mutex_unlock(&stripe->lock);
+			return found;
+		}
+	}
+
+	found = malloc(sizeof(*found) + str_s + 1);
+	if (!found) {
+		pthread_mutex_unlock(&stripe->lock);
+		return NULL;
+	}
+	found->hash = hash;
+	found->refs = 1;
+	found->tag = 0;
+	found->str_s = str_s;
+	memcpy(found->text, str, str_s);
+	found->text[str_s] = '\n';
+	found->next = *head;
+	*head = found;
+
+	__atomic_store_n(&stripe->nstrs, stripe->nstrs + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&stripe->bytes, stripe->bytes + str_s + 1,
+		__ATOMIC_RELAXED);
+	if (stripe->nstrs > stripe->nbuckets)
+		intern_grow(stripe);
+	pthread_mutex_unlock(&stripe->lock);
+	return found;
+}
+
+void intern_put(struct intern *in, struct intern_str *str, uint64_t tag)
+{
+	struct intern_stripe *stripe = &in->stripes[str->hash %
+		INTERN_STRIPES];
+
+	pthread_mutex_lock(&stripe->lock);
+	if (tag > str->tag)
+		str->tag = tag;
+	if (--str->refs) {
+		pthread_mutex_unlock(&stripe->lock);
+		return;
+	}
+
+	struct intern_str **ptr = &stripe->buckets[intern_bucket(stripe,
+		str->hash)];
+	while (*ptr != str)
+		ptr = &(*ptr)->next;
+	*ptr = str->next;
+	__atomic_store_n(&stripe->nstrs, stripe->nstrs - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&stripe->bytes, stripe->bytes - str->str_s - 1,
+		__ATOMIC_RELAXED);
+	/* Reclaim looks at it without the lock first */
+	str->next = stripe->dropped;
+	__atomic_store_n(&stripe->dropped, str, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stripe->lock);
+}
+
+void intern_reclaim(struct intern *in, uint64_t tag)
+{
+	for (int i = 0; i < INTERN_STRIPES; i++) {
+		struct intern_stripe *stripe = &in->stripes[i];
+		if (!__atomic_load_n(&stripe->dropped, __ATOMIC_RELAXED))
+			continue;
+
+		pthread_mutex_lock(&stripe->lock);
+		struct intern_str **ptr = &stripe->dropped;
+		while (*ptr) {
+			struct intern_str *str = *ptr;
+			if (tag < str->tag) {
+				ptr = &str->next;
+				continue;
+			}
+			*ptr = str->next;
+			free(str);
+		}
+		pthread_mutex_unlock(&stripe->lock);
+	}
+}
+
+void intern_stats(struct intern *in, struct intern_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < INTERN_STRIPES; i++) {
+		struct intern_stripe *stripe = &in->stripes[i];
+		stats->hits += __atomic_load_n(&stripe->hits,
+			__ATOMIC_RELAXED);
+		stats->strs += __atomic_load_n(&stripe->nstrs,
+			__ATOMIC_RELAXED);
+		stats->bytes += __atomic_load_n(&stripe->bytes,
+			__ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef INTERN_H_
+#define INTERN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Interned strs: one refcounted copy of each distinct content, text is
+ * followed by '\n' like in strlist chunks. Table is split in stripes by
+ * hash, each one has its own lock and grows on its own, so lookups of
+ * different strs rarely wait for each other.
+ *
+ * intern_get and intern_put may be called by any thread, intern_reclaim
+ * by a single one. Str whose last reference is dropped is freed by
+ * intern_reclaim with a tag past the latest one it was put with, so
+ * that it may still be written out in between. Tag 0 is for a
+ * reference which was never written out.
+ */
+
+struct intern_str {
+	struct intern_str *next;
+	uint64_t hash;
+	size_t refs;
+	uint64_t tag;	/* Latest one it was put with */
+	size_t str_s;
+	char text[];
+};
+
+struct intern_stats {
+	size_t hits;
+	size_t strs;	/* Distinct strs held */
+	size_t bytes;
+};
+
+typedef struct intern intern_t;
+
+intern_t *intern_new();
+void intern_delete(intern_t *in);
+/* Returns a reference, NULL if out of memory */
+struct intern_str *intern_get(intern_t *in, char *str, size_t str_s);
+void intern_put(intern_t *in, struct intern_str *str, uint64_t tag);
+void intern_reclaim(intern_t *in, uint64_t tag);
+void intern_stats(intern_t *in, struct intern_stats *stats);
+
+#endif /* INTERN_H_ */
@@ -0,0 +1,47 @@
+#include "io.h"
+
+#include <unistd.h>
+
+#include <errno.h>
+
+ssize_t writen(int fd, void *buf, size_t size)
+{
+	char *ptr = buf;
+	size_t start_size = size;
+
+	while (size) {
+		ssize_t ret = write(fd, ptr, size);
+		if (ret == 0)
+			return -1;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		size -= ret;
+		ptr += ret;
+	}
+
+	return start_size;
+}
+
+ssize_t readn(int fd, void *buf, size_t size)
+{
+	char *ptr = buf;
+	size_t start_size = size;
+
+	while (size) {
+		ssize_t ret = read(fd, ptr, size);
+		if (ret == 0)
+			return start_size - size;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		size -= ret;
+		ptr += ret;
+	}
+
+	return start_size;
+}
@@ -0,0 +1,11 @@
+#ifndef IO_H_
+#define IO_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* Whole buffer is transferred, unless there is EOF or an error */
+ssize_t writen(int fd, void *buf, size_t size);
+ssize_t readn(int fd, void *buf, size_t size);
+
+#endif /* IO_H_ */
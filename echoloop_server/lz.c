@@ -0,0 +1,160 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS  12
+#define LZ_LEN_MASK   15	/* Length in token, more bytes follow if all set */
+
+static inline uint32_t lz_read32(const char *ptr)
+{
+	uint32_t val;
+	memcpy(&val, ptr, sizeof(val));
+	return val;
+}
+
+static inline uint32_t lz_hash(uint32_t val)
+{
+	return (val * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Rest of a length, in bytes of 255 and the last one below it */
+static char *lz_put_len(char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = (char) 255;
+	*op++ = len;
+	return op;
+}
+
+/* Sequence without a match ends the data */
+static char *lz_put_seq(char *op, char *end, const char *lit, size_t lit_s,
+			size_t off, size_t match_s)
+{
+	size_t ml = match_s ? match_s - LZ_MIN_MATCH : 0;
+	size_t need = 1 + lit_s / 255 + 1 + lit_s + 2 + ml / 255 + 1;
+	if (need > end - op)
+		return NULL;
+
+	char *token = op++;
+	*token = (lit_s < LZ_LEN_MASK ? lit_s : LZ_LEN_MASK) << 4 |
+		(ml < LZ_LEN_MASK ? ml : LZ_LEN_MASK);
+	if (lit_s >= LZ_LEN_MASK)
+		op = lz_put_len(op, lit_s - LZ_LEN_MASK);
+	memcpy(op, lit, lit_s);
+	op += lit_s;
+	if (!match_s)
+		return op;
+
+	*op++ = off;
+	*op++ = off >> 8;
+	if (ml >= LZ_LEN_MASK)
+		op = lz_put_len(op, ml - LZ_LEN_MASK);
+	return op;
+}
+
+size_t lz_compress(const char *src, size_t src_s, char *dst, size_t dst_s)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const char *src_end = src + src_s;
+	const char *ip = src;
+	const char *anchor = src;
+	char *op = dst;
+	char *end = dst + dst_s;
+	size_t misses = 0;
+
+	memset(table, 0, sizeof(table));
+	while (src_end - ip >= LZ_MIN_MATCH) {
+		uint32_t val = lz_read32(ip);
+		uint32_t hash = lz_hash(val);
+		const char *ref = src + table[hash];
+		table[hash] = ip - src;
+
+		/* Steps grow where nothing repeats */
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+		    lz_read32(ref) != val) {
+			ip += 1 + (misses++ >> 6);
+			continue;
+		}
+		misses = 0;
+
+		const char *mp = ip + LZ_MIN_MATCH;
+		const char *rp = ref + LZ_MIN_MATCH;
+		while (mp < src_end && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		op = lz_put_seq(op, end, anchor, ip - anchor, ip - ref, mp - ip);
+		if (!op)
+			return 0;
+		ip = anchor = mp;
+		if (src_end - ip >= LZ_MIN_MATCH + 2)
+			table[lz_hash(lz_read32(ip - 2))] = ip - 2 - src;
+	}
+
+	op = lz_put_seq(op, end, anchor, src_end - anchor, 0, 0);
+	return op ? op - dst : 0;
+}
+
+static int lz_get_len(const unsigned char **ip, const unsigned char *end,
+		      size_t *len)
+{
+	while (*ip < end) {
+		unsigned char byte = *(*ip)++;
+		*len += byte;
+		if (byte != 255)
+			return 0;
+	}
+	return -1;
+}
+
+int lz_decompress(const char *src, size_t src_s, char *dst, size_t dst_s)
+{
+	const unsigned char *ip = (const unsigned char *) src;
+	const unsigned char *src_end = ip + src_s;
+	char *op = dst;
+	char *end = dst + dst_s;
+
+	while (ip < src_end) {
+		unsigned token = *ip++;
+		size_t lit_s = token >> 4;
+		if (lit_s == LZ_LEN_MASK && lz_get_len(&ip, src_end, &lit_s) < 0)
+			return -1;
+		if (lit_s > src_end - ip || lit_s > end - op)
+			return -1;
+		memcpy(op, ip, lit_s);
+		op += lit_s;
+		ip += lit_s;
+		if (ip == src_end)
+			break;
+
+		if (src_end - ip < 2)
+			return -1;
+		size_t off = ip[0] | ip[1] << 8;
+		ip += 2;
+		size_t match_s = token & LZ_LEN_MASK;
+		if (match_s == LZ_LEN_MASK &&
+		    lz_get_len(&ip, src_end, &match_s) < 0)
+			return -1;
+		match_s += LZ_MIN_MATCH;
+		if (!off || off > op - dst || match_s > end - op)
+			return -1;
+
+		/* Overlapping match repeats itself, copies double each time */
+		const char *ref = op - off;
+		while (match_s) {
+			size_t n = op - ref < match_s ? op - ref : match_s;
+			memcpy(op, ref, n);
+			op += n;
+			match_s -= n;
+		}
+	}
+	return op == end ? 0 : -1;
+}
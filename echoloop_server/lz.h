@@ -0,0 +1,18 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stddef.h>
+
+/*
+ * Small LZ77 codec in the manner of LZ4: sequences of literals followed
+ * by a match with a 16 bit offset, lengths packed in a token. It's made
+ * for blocks of up to some hundreds of KiB of text, repeated lines are
+ * cheap to find and to make again.
+ */
+
+/* Returns size of compressed data, 0 if it doesn't fit in dst_s */
+size_t lz_compress(const char *src, size_t src_s, char *dst, size_t dst_s);
+/* Returns -1 unless src makes exactly dst_s bytes */
+int lz_decompress(const char *src, size_t src_s, char *dst, size_t dst_s);
+
+#endif /* LZ_H_ */
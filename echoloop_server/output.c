@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include "output.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define OUTPUT_IOV_MIN 16
+
+/* Piece of iov[idx] which is made only when it's about to be written */
+struct output_fill {
+	size_t idx;
+	size_t skip;
+	int (*fill)(void *, char *);
+	void *arg;
+};
+
+struct output_tick {
+	struct output_tick *next;
+	uint64_t seq;
+	struct iovec *iov;
+	size_t iovcnt;
+	size_t iov_s;
+	size_t pos;		/* First iovec which is not written */
+	int partial;		/* iov[pos] is partly written */
+	int counted;		/* Counts against depth, unless it's cut */
+	struct output_fill *fills;
+	size_t nfills;
+	size_t fills_s;
+	size_t fpos;		/* First fill which is not written */
+};
+
+struct output {
+	int fd;
+	size_t depth;
+	enum output_policy policy;
+	size_t nticks;
+	uint64_t seq;		/* Of the next tick */
+	struct output_tick *head;
+	struct output_tick *tail;
+	struct output_tick *building;
+	char *buf;		/* Of the fill which is being written */
+	size_t buf_s;
+	struct output_stats stats;
+};
+
+/* Stats may be read by other threads */
+#define STAT_ADD(out, field, val) \
+	__atomic_fetch_add(&(out)->stats.field, (val), __ATOMIC_RELAXED)
+
+static void output_tick_delete(struct output_tick *tick)
+{
+	free(tick->iov);
+	free(tick->fills);
+	free(tick);
+}
+
+struct output *output_new(int fd, size_t depth, enum output_policy policy)
+{
+	/* Coalescing needs a pending tick besides the one being written */
+	if (depth < 1 || (policy == OUTPUT_COALESCE && depth < 2)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct output *out = calloc(1, sizeof(*out));
+	if (!out)
+		return NULL;
+	out->fd = fd;
+	out->depth = depth;
+	out->policy = policy;
+	return out;
+}
+
+void output_delete(struct output *out)
+{
+	while (out->head) {
+		struct output_tick *next = out->head->next;
+		output_tick_delete(out->head);
+		out->head = next;
+	}
+	if (out->building)
+		output_tick_delete(out->building);
+	free(out->buf);
+	free(out);
+}
+
+static void output_unlink(struct output *out, struct output_tick **ptr)
+{
+	struct output_tick *tick = *ptr;
+	*ptr = tick->next;
+	output_tick_delete(tick);
+
+	out->tail = out->head;
+	while (out->tail && out->tail->next)
+		out->tail = out->tail->next;
+}
+
+/* Newest tick is never being written, it is dropped entirely */
+static void output_drop_newest(struct output *out)
+{
+	struct output_tick **ptr = &out->head;
+	while ((*ptr)->next)
+		ptr = &(*ptr)->next;
+	out->nticks--;
+	output_unlink(out, ptr);
+}
+
+/* Piece which is being written is finished, it ends with a full line */
+static void output_drop_oldest(struct output *out)
+{
+	struct output_tick **ptr = &out->head;
+	while (!(*ptr)->counted)
+		ptr = &(*ptr)->next;
+	out->nticks--;
+
+	struct output_tick *tick = *ptr;
+	if (tick->partial) {
+		tick->iovcnt = tick->pos + 1;
+		tick->counted = 0;
+		return;
+	}
+	output_unlink(out, ptr);
+}
+
+int output_begin(struct output *out)
+{
+	STAT_ADD(out, ticks, 1);
+
+	if (out->nticks == out->depth) {
+		switch (out->policy) {
+		case OUTPUT_SKIP:
+			STAT_ADD(out, skipped, 1);
+			return 0;
+		case OUTPUT_COALESCE:
+			output_drop_newest(out);
+			STAT_ADD(out, coalesced, 1);
+			break;
+		case OUTPUT_DROP:
+			output_drop_oldest(out);
+			STAT_ADD(out, dropped, 1);
+			break;
+		}
+	}
+
+	out->building = calloc(1, sizeof(*out->building));
+	if (!out->building)
+		return -1;
+	out->building->seq = out->seq++;
+	return 1;
+}
+
+static int output_piece(struct output_tick *tick, char *base, size_t len)
+{
+	if (tick->iovcnt == tick->iov_s) {
+		size_t iov_s = tick->iov_s ? tick->iov_s * 2 : OUTPUT_IOV_MIN;
+		struct iovec *iov = realloc(tick->iov, iov_s * sizeof(*iov));
+		if (!iov)
+			return -1;
+		tick->iov = iov;
+		tick->iov_s = iov_s;
+	}
+	tick->iov[tick->iovcnt].iov_base = base;
+	tick->iov[tick->iovcnt].iov_len = len;
+	tick->iovcnt++;
+	return 0;
+}
+
+int output_add(void *arg, char *base, size_t len)
+{
+	struct output *out = arg;
+	struct output_tick *tick = out->building;
+
+	/* Fill is not merged with anything, its base is not known yet */
+	if (tick->iovcnt) {
+		struct iovec *last = &tick->iov[tick->iovcnt - 1];
+		if (last->iov_base &&
+		    (char *) last->iov_base + last->iov_len == base) {
+			last->iov_len += len;
+			return 0;
+		}
+	}
+	return output_piece(tick, base, len);
+}
+
+int output_add_fill(void *arg, size_t skip, size_t len,
+		    int (*fill)(void *, char *), void *fill_arg)
+{
+	struct output *out = arg;
+	struct output_tick *tick = out->building;
+
+	if (tick->nfills == tick->fills_s) {
+		size_t fills_s = tick->fills_s ? tick->fills_s * 2 :
+			OUTPUT_IOV_MIN;
+		struct output_fill *fills = realloc(tick->fills,
+			fills_s * sizeof(*fills));
+		if (!fills)
+			return -1;
+		tick->fills = fills;
+		tick->fills_s = fills_s;
+	}
+	if (output_piece(tick, NULL, len) < 0)
+		return -1;
+
+	struct output_fill *ptr = &tick->fills[tick->nfills++];
+	ptr->idx = tick->iovcnt - 1;
+	ptr->skip = skip;
+	ptr->fill = fill;
+	ptr->arg = fill_arg;
+	return 0;
+}
+
+/* Only one fill is being written at a time, pieces go out in order */
+static int output_make(struct output *out, struct output_tick *tick,
+		       struct output_fill *fill)
+{
+	struct iovec *iov = &tick->iov[fill->idx];
+	size_t need = fill->skip + iov->iov_len;
+
+	if (need > out->buf_s) {
+		char *buf = realloc(out->buf, need);
+		if (!buf) {
+			perror("Error: realloc");
+			return -1;
+		}
+		out->buf = buf;
+		out->buf_s = need;
+	}
+	if (fill->fill(fill->arg, out->buf) < 0) {
+		perror("Error: fill");
+		return -1;
+	}
+	iov->iov_base = out->buf + fill->skip;
+	return 0;
+}
+
+int output_end(struct output *out)
+{
+	struct output_tick *tick = out->building;
+	out->building = NULL;
+
+	tick->counted = 1;
+	if (out->tail)
+		out->tail->next = tick;
+	else
+		out->head = tick;
+	out->tail = tick;
+	out->nticks++;
+	return 0;
+}
+
+int output_flush(struct output *out)
+{
+	while (out->head) {
+		struct output_tick *tick = out->head;
+
+		while (tick->pos < tick->iovcnt) {
+			/* Writes stop at the next fill, it's made once reached */
+			size_t end = tick->iovcnt;
+			struct output_fill *fill = tick->fpos < tick->nfills ?
+				&tick->fills[tick->fpos] : NULL;
+			if (fill && fill->idx == tick->pos) {
+				if (!tick->iov[tick->pos].iov_base &&
+				    output_make(out, tick, fill) < 0)
+					return -1;
+				fill = tick->fpos + 1 < tick->nfills ? fill + 1 :
+					NULL;
+			}
+			if (fill && fill->idx < end)
+				end = fill->idx;
+
+			size_t cnt = end - tick->pos;
+			ssize_t ret = writev(out->fd, &tick->iov[tick->pos],
+				cnt < IOV_MAX ? cnt : IOV_MAX);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1;
+				perror("Error: writev");
+				return -1;
+			}
+			STAT_ADD(out, bytes, ret);
+
+			struct iovec *iov = &tick->iov[tick->pos];
+			while (tick->pos < tick->iovcnt && ret >= iov->iov_len) {
+				ret -= iov->iov_len;
+				iov++;
+				tick->pos++;
+			}
+			while (tick->fpos < tick->nfills &&
+			       tick->fills[tick->fpos].idx < tick->pos)
+				tick->fpos++;
+			tick->partial = ret > 0;
+			if (tick->partial) {
+				iov->iov_base = (char *) iov->iov_base + ret;
+				iov->iov_len -= ret;
+			}
+		}
+
+		if (tick->counted)
+			out->nticks--;
+		output_unlink(out, &out->head);
+	}
+	return 0;
+}
+
+void output_stats(struct output *out, struct output_stats *stats)
+{
+	stats->ticks = __atomic_load_n(&out->stats.ticks, __ATOMIC_RELAXED);
+	stats->skipped = __atomic_load_n(&out->stats.skipped, __ATOMIC_RELAXED);
+	stats->coalesced = __atomic_load_n(&out->stats.coalesced,
+		__ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&out->stats.dropped, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&out->stats.bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t output_seq(struct output *out)
+{
+	return out->seq;
+}
+
+/* Queue is in order, oldest tick may be cut but not written yet */
+uint64_t output_done(struct output *out)
+{
+	if (out->head)
+		return out->head->seq;
+	return out->building ? out->building->seq : out->seq;
+}
@@ -0,0 +1,58 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounded queue of ticks waiting to be written to a non-blocking fd */
+
+enum output_policy {
+	OUTPUT_SKIP,		/* New tick is skipped */
+	OUTPUT_COALESCE,	/* New tick replaces the newest pending one */
+	OUTPUT_DROP		/* Oldest tick is dropped */
+};
+
+struct output_stats {
+	size_t ticks;		/* Queued */
+	size_t skipped;
+	size_t coalesced;
+	size_t dropped;
+	size_t bytes;		/* Written */
+};
+
+typedef struct output output_t;
+
+output_t *output_new(int fd, size_t depth, enum output_policy policy);
+void output_delete(output_t *out);
+
+/*
+ * Tick is built by output_add calls between output_begin and output_end.
+ * output_begin returns 0 if the tick is skipped, then nothing else is
+ * called for it. Pieces are not copied, they must stay valid until
+ * written.
+ */
+int output_begin(output_t *out);
+int output_add(void *out, char *base, size_t len);
+/*
+ * Piece which is made only when it's about to be written: fill makes
+ * skip + len bytes in a buffer of output and the first skip of them are
+ * left out. So pieces of a tick which is dropped are never made and
+ * only one is held at a time. Fill must work until the tick is done.
+ */
+int output_add_fill(void *out, size_t skip, size_t len,
+		    int (*fill)(void *, char *), void *arg);
+int output_end(output_t *out);
+
+/* Writes what fd takes, returns 1 if something is left */
+int output_flush(output_t *out);
+
+void output_stats(output_t *out, struct output_stats *stats);
+
+/*
+ * Ticks are numbered as they are begun. Pieces added to ticks numbered
+ * below output_done are not used anymore.
+ */
+uint64_t output_seq(output_t *out);
+uint64_t output_done(output_t *out);
+
+#endif /* OUTPUT_H_ */
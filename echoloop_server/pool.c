@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include "pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define POOL_DEQUE_SIZE 256
+
+struct pool_deque {
+	pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+	void *tasks[POOL_DEQUE_SIZE];
+};
+
+struct pool_worker {
+	struct pool *pool;
+	size_t id;
+	struct pool_deque deque;
+};
+
+struct pool {
+	size_t nworkers;
+	size_t next;	/* Round-robin position for pool_push */
+	sem_t tasks;	/* Tasks in all deques */
+	sem_t slots;	/* Free places in all deques */
+	void *(*func)(void *);
+	struct pool_worker *workers;
+};
+
+static int deque_push(struct pool_deque *deque, void *task)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail - deque->head != POOL_DEQUE_SIZE) {
+		deque->tasks[deque->tail++ % POOL_DEQUE_SIZE] = task;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return ret;
+}
+
+/* Owner takes the oldest task, thieves take the newest one */
+static int deque_pop(struct pool_deque *deque, void **task, int steal)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail != deque->head) {
+		if (steal)
+			*task = deque->tasks[--deque->tail % POOL_DEQUE_SIZE];
+		else
+			*task = deque->tasks[deque->head++ % POOL_DEQUE_SIZE];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return ret;
+}
+
+static void sem_wait_intr(sem_t *sem)
+{
+	while (sem_wait(sem) < 0 && errno == EINTR)
+		;
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool_worker *self = arg;
+	struct pool *pool = self->pool;
+
+	while (1) {
+		/* Someone has a task for us, it's only a matter of finding it */
+		sem_wait_intr(&pool->tasks);
+
+		void *task;
+		for (size_t i = 0; ; i++) {
+			size_t victim = (self->id + i) % pool->nworkers;
+			struct pool_deque *deque = &pool->workers[victim].deque;
+			if (deque_pop(deque, &task, victim != self->id) == 0)
+				break;
+		}
+		sem_post(&pool->slots);
+
+		pool->func(task);
+	}
+
+	return NULL;
+}
+
+/* Not undone on failure, caller is expected to exit */
+struct pool *pool_new(size_t nworkers, int pin, void *(*func)(void *))
+{
+	struct pool *pool = malloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->nworkers = nworkers;
+	pool->next = 0;
+	pool->func = func;
+	if (sem_init(&pool->tasks, 0, 0) < 0 ||
+	    sem_init(&pool->slots, 0, nworkers * POOL_DEQUE_SIZE) < 0) {
+		free(pool);
+		return NULL;
+	}
+
+	pool->workers = calloc(nworkers, sizeof(*pool->workers));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+
+	for (size_t i = 0; i < nworkers; i++) {
+		struct pool_worker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->id = i;
+		pthread_mutex_init(&worker->deque.lock, NULL);
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pin) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(i % ncpu, &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+
+		pthread_t thread;
+		int ret = pthread_create(&thread, &attr, pool_worker, worker);
+		pthread_attr_destroy(&attr);
+		if (ret != 0) {
+			errno = ret;
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+/* Blocks while all deques are full */
+void pool_push(struct pool *pool, void *arg)
+{
+	sem_wait_intr(&pool->slots);
+
+	while (deque_push(&pool->workers[pool->next].deque, arg) < 0)
+		pool->next = (pool->next + 1) % pool->nworkers;
+	pool->next = (pool->next + 1) % pool->nworkers;
+
+	sem_post(&pool->tasks);
+}
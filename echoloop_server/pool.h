@@ -0,0 +1,14 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+
+/* Fixed set of worker threads, each one has own deque of tasks */
+/* Idle workers steal tasks from others */
+
+typedef struct pool pool_t;
+
+pool_t *pool_new(size_t nworkers, int pin, void *(*func)(void *));
+void pool_push(pool_t *pool, void *arg);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,122 @@
+#include "printer.h"
+
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct printer {
+	int tfd;
+	int fd;
+	int (*print)(void *);
+	int (*flush)(void *);
+	void *arg;
+};
+
+static void printer_cleanup(void *ptr)
+{
+	struct printer *printer = ptr;
+	close(printer->tfd);
+	free(printer);
+}
+
+static void *printer_thread(void *ptr)
+{
+	struct printer *printer = ptr;
+	int ret = 0;
+
+	pthread_cleanup_push(printer_cleanup, printer);
+	while (ret >= 0) {
+		struct pollfd fds[] = {
+			{ .fd = printer->tfd, .events = POLLIN  },
+			{ .fd = printer->fd,  .events = POLLOUT }
+		};
+		if (poll(fds, ret > 0 ? 2 : 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* Output of a tick is never cut by printer_stop */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (fds[0].revents & POLLIN) {
+			/* Missed ticks are merged into one */
+			uint64_t ticks;
+			if (read(printer->tfd, &ticks, sizeof(ticks)) < 0 &&
+			    errno != EINTR)
+				break;
+			ret = printer->print(printer->arg);
+		} else if (ret > 0 && fds[1].revents) {
+			ret = printer->flush(printer->arg);
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+int printer_start(pthread_t *thread, struct timespec *interval, int fd,
+		  int (*print)(void *), int (*flush)(void *), void *arg)
+{
+	struct printer *printer = malloc(sizeof(*printer));
+	if (!printer)
+		return -1;
+	printer->fd = fd;
+	printer->print = print;
+	printer->flush = flush;
+	printer->arg = arg;
+
+	printer->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (printer->tfd < 0) {
+		free(printer);
+		return -1;
+	}
+
+	struct itimerspec spec = {
+		.it_interval = *interval,
+		.it_value    = *interval
+	};
+	if (timerfd_settime(printer->tfd, 0, &spec, NULL) < 0)
+		goto handle_err;
+
+	/* Signals are left to the threads doing the real work */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(thread, NULL, printer_thread, printer);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto handle_err;
+	}
+	return 0;
+
+handle_err:
+	close(printer->tfd);
+	free(printer);
+	return -1;
+}
+
+void printer_stop(pthread_t thread)
+{
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+}
+
+int printer_parse_interval(char *str, struct timespec *interval)
+{
+	char *end;
+	double sec = strtod(str, &end);
+	if (*end != '\0' || !(sec >= 1e-9 && sec < 1e9))
+		return -1;
+
+	interval->tv_sec = (time_t) sec;
+	interval->tv_nsec = (long) ((sec - interval->tv_sec) * 1e9);
+	if (interval->tv_sec == 0 && interval->tv_nsec == 0)
+		interval->tv_nsec = 1;
+	return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef PRINTER_H_
+#define PRINTER_H_
+
+#include <pthread.h>
+#include <time.h>
+
+/* Calls print every interval from a separate thread with all signals */
+/* blocked, until print returns a negative value or printer is stopped */
+
+/*
+ * If print (or flush) returns a positive value, some output is left,
+ * flush is called once fd becomes writable. fd may be -1 if print always
+ * writes everything.
+ */
+
+int printer_start(pthread_t *thread, struct timespec *interval, int fd,
+		  int (*print)(void *), int (*flush)(void *), void *arg);
+void printer_stop(pthread_t thread);
+
+/* Interval in seconds, fractions are allowed */
+int printer_parse_interval(char *str, struct timespec *interval);
+
+#endif /* PRINTER_H_ */
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "echoloop.h"
+#include "recvbuf.h"
+#include "session.h"
+#include "stats.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_RETRY_MS   100
+
+enum conn_state {
+	CONN_HDR,	/* Receiving size of str */
+	CONN_TTL,	/* Receiving TTL, if size has SESSION_TTL */
+	CONN_DATA,	/* Receiving str */
+	CONN_SYNC,	/* Waiting for strs to be logged */
+	CONN_ACK	/* Sending ack */
+};
+
+struct conn {
+	int sock;
+	recvbuf_t *rb;
+	enum conn_state state;
+	uint64_t since;	/* When current state began */
+	int session;	/* Session protocol, see session.h */
+	int eof;
+	size_t done;	/* Bytes transferred in current state */
+	size_t buf_s;
+	uint32_t ttl_ms;
+	char *buf;
+	char scratch[SERVER_INTERN_MAX];
+	size_t ack;
+	size_t seq;	/* Strs received in session */
+	size_t nrecs;	/* Strs waiting for ack */
+	strrec_t *recs[SESSION_ACK_BATCH];
+	uint64_t lsn;	/* Of the last str, see echoloop_server_sync */
+	struct conn *sync_next;
+	struct conn **sync_pprev;	/* Set if it's in reactor_syncing */
+};
+
+/* Connections in CONN_SYNC, looked at after each commit of the log */
+static struct conn *reactor_syncing;
+/* Data of the log event, see echoloop_server_sync_fd */
+static char reactor_sync_tag;
+
+static void conn_sync_unlink(struct conn *conn)
+{
+	if (!conn->sync_pprev)
+		return;
+	if (conn->sync_next)
+		conn->sync_next->sync_pprev = conn->sync_pprev;
+	*conn->sync_pprev = conn->sync_next;
+	conn->sync_pprev = NULL;
+}
+
+static void conn_close(struct conn *conn)
+{
+	close(conn->sock); /* Also removes it from epoll set */
+	conn_sync_unlink(conn);
+	if (conn->rb)
+		recvbuf_delete(conn->rb);
+	for (size_t i = 0; i < conn->nrecs; i++)
+		echoloop_server_cancel(conn->recs[i]);
+	free(conn);
+}
+
+/* Returns 1 if transfer is complete, 0 if it would block */
+static int conn_read(struct conn *conn, void *buf, size_t size)
+{
+	int ret = recvbuf_read(conn->rb, buf, size, &conn->done);
+	if (ret < 0)
+		conn->eof = recvbuf_eof(conn->rb);
+	if (ret == 1)
+		conn->done = 0;
+	return ret;
+}
+
+static int conn_write(struct conn *conn, void *buf, size_t size)
+{
+	char *ptr = buf;
+
+	while (conn->done < size) {
+		ssize_t ret = write(conn->sock, ptr + conn->done,
+			size - conn->done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		conn->done += ret;
+	}
+
+	conn->done = 0;
+	return 1;
+}
+
+static void conn_enter(struct conn *conn, enum conn_state state)
+{
+	conn->state = state;
+	conn->since = stats_now();
+}
+
+/* Returns 0 if connection waits for more events, 1 if it should be closed */
+static int conn_handle(struct conn *conn)
+{
+	int ret;
+
+	while (1) {
+		switch (conn->state) {
+		case CONN_HDR:
+			ret = conn_read(conn, &conn->buf_s, sizeof(conn->buf_s));
+			/* Session ends at a frame boundary */
+			if (ret < 0 && conn->session && conn->eof && !conn->done) {
+				if (!conn->nrecs)
+					return 1;
+				conn->ack = conn->seq;
+				conn_enter(conn, CONN_SYNC);
+				break;
+			}
+			if (ret < 0) {
+				stats_add(STATS_ERR_HDR, 1);
+				fprintf(stderr, "Error: can't get ack from client\n");
+				return 1;
+			}
+			if (ret == 0) {
+				/* Input is drained, ack what is taken */
+				if (!conn->nrecs || conn->done)
+					return 0;
+				conn->ack = conn->seq;
+				conn_enter(conn, CONN_SYNC);
+				break;
+			}
+
+			if (!conn->session && conn->buf_s == SESSION_MAGIC) {
+				stats_stage(STATS_HDR, conn->since);
+				stats_add(STATS_SESSIONS, 1);
+				conn->session = 1;
+				conn_enter(conn, CONN_HDR);
+				break;
+			}
+
+			conn->ttl_ms = 0;
+			conn->state = CONN_TTL;
+			/* Fallthrough */
+
+		case CONN_TTL:
+			if (conn->buf_s & SESSION_TTL) {
+				ret = conn_read(conn, &conn->ttl_ms,
+					sizeof(conn->ttl_ms));
+				if (ret < 0) {
+					stats_add(STATS_ERR_HDR, 1);
+					fprintf(stderr, "Error: can't get ttl from client\n");
+					return 1;
+				}
+				if (ret == 0)
+					return 0;
+				conn->buf_s &= ~SESSION_TTL;
+			}
+			stats_stage(STATS_HDR, conn->since);
+
+			conn->buf = echoloop_server_reserve(conn->buf_s,
+				conn->ttl_ms, conn->scratch,
+				&conn->recs[conn->nrecs]);
+			if (!conn->buf) {
+				perror("Error: strlist_reserve");
+				return 1;
+			}
+			conn->nrecs++;
+			conn_enter(conn, CONN_DATA);
+			/* Fallthrough */
+
+		case CONN_DATA:
+			ret = conn_read(conn, conn->buf, conn->buf_s);
+			if (ret < 0) {
+				stats_add(STATS_ERR_DATA, 1);
+				fprintf(stderr, "Error: failed to read data from client\n");
+				return 1;
+			}
+			if (ret == 0)
+				return 0;
+			stats_stage(STATS_DATA, conn->since);
+			if (echoloop_server_received(conn->buf, conn->buf_s,
+					conn->ttl_ms,
+					&conn->recs[conn->nrecs - 1],
+					&conn->lsn) < 0)
+				return 1;
+
+			if (!conn->session) {
+				conn->ack = conn->buf_s;
+				conn_enter(conn, CONN_SYNC);
+				break;
+			}
+			conn->seq++;
+			if (conn->nrecs == SESSION_ACK_BATCH) {
+				conn->ack = conn->seq;
+				conn_enter(conn, CONN_SYNC);
+			} else {
+				conn_enter(conn, CONN_HDR);
+			}
+			break;
+
+		case CONN_SYNC:
+			ret = echoloop_server_synced(conn->lsn);
+			if (ret < 0)
+				return 1;
+			if (ret == 0) {
+				if (!conn->sync_pprev) {
+					conn->sync_next = reactor_syncing;
+					if (reactor_syncing)
+						reactor_syncing->sync_pprev =
+							&conn->sync_next;
+					reactor_syncing = conn;
+					conn->sync_pprev = &reactor_syncing;
+				}
+				return 0;
+			}
+			conn_sync_unlink(conn);
+			if (conn->lsn)
+				stats_stage(STATS_SYNC, conn->since);
+			conn_enter(conn, CONN_ACK);
+			/* Fallthrough */
+
+		case CONN_ACK:
+			ret = conn_write(conn, &conn->ack, sizeof(conn->ack));
+			if (ret < 0) {
+				stats_add(STATS_ERR_ACK, 1);
+				fprintf(stderr, "Error: can't send ack to client\n");
+				return 1;
+			}
+			if (ret == 0)
+				return 0;
+			stats_stage(STATS_ACK, conn->since);
+			stats_add(STATS_ACKS, 1);
+
+			for (size_t i = 0; i < conn->nrecs; i++)
+				echoloop_server_commit(conn->recs[i]);
+			conn->nrecs = 0;
+			if (!conn->session || conn->eof)
+				return 1;
+			conn_enter(conn, CONN_HDR);
+			break;
+		}
+	}
+}
+
+/* Acks of strs which are logged by now go out */
+static void reactor_synced(int sync_fd)
+{
+	uint64_t commits;
+	if (read(sync_fd, &commits, sizeof(commits)) < 0 && errno != EAGAIN)
+		perror("Error: eventfd read");
+
+	struct conn *conn = reactor_syncing;
+	while (conn) {
+		struct conn *next = conn->sync_next;
+		if (conn_handle(conn))
+			conn_close(conn);
+		conn = next;
+	}
+}
+
+/* Returns 1 if accept should be retried later */
+static int reactor_accept(int epfd, int serv_sock)
+{
+	while (1) {
+		uint64_t start = stats_now();
+		int sock = accept4(serv_sock, NULL, NULL, SOCK_NONBLOCK);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			stats_add(STATS_ERR_ACCEPT, 1);
+			perror("Error: accept");
+			/* Out of resources, keep serving what we have */
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS || errno == ENOMEM)
+				return 1;
+			return -1;
+		}
+
+		stats_stage(STATS_ACCEPT, start);
+		stats_add(STATS_CONNS, 1);
+
+		struct conn *conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			perror("Error: calloc");
+			close(sock);
+			return 1;
+		}
+		conn->sock = sock;
+		conn_enter(conn, CONN_HDR);
+		conn->rb = recvbuf_new(sock);
+		if (!conn->rb) {
+			perror("Error: recvbuf_new");
+			conn_close(conn);
+			return 1;
+		}
+
+		/* Short requests are usually complete by now */
+		if (conn_handle(conn)) {
+			conn_close(conn);
+			continue;
+		}
+
+		struct epoll_event ev = {
+			.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+			.data.ptr = conn
+		};
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+			perror("Error: epoll_ctl");
+			conn_close(conn);
+			return 1;
+		}
+	}
+}
+
+int reactor_run(int serv_sock)
+{
+	int flags = fcntl(serv_sock, F_GETFL);
+	if (flags < 0 || fcntl(serv_sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("Error: fcntl");
+		return -1;
+	}
+
+	int epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("Error: epoll_create1");
+		return -1;
+	}
+
+	/* Listening socket is the only one with NULL data */
+	struct epoll_event ev = {
+		.events   = EPOLLIN | EPOLLET,
+		.data.ptr = NULL
+	};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, serv_sock, &ev) < 0) {
+		perror("Error: epoll_ctl");
+		goto handle_err;
+	}
+
+	/* Log commits are level triggered, they are read off right away */
+	int sync_fd = echoloop_server_sync_fd();
+	if (sync_fd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &reactor_sync_tag;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, sync_fd, &ev) < 0) {
+			perror("Error: epoll_ctl");
+			goto handle_err;
+		}
+	}
+
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int accept_pending = 1;
+	int sync_pending = 0;
+
+	while (1) {
+		if (accept_pending) {
+			accept_pending = reactor_accept(epfd, serv_sock);
+			if (accept_pending < 0)
+				goto handle_err;
+		}
+
+		int n = epoll_wait(epfd, events, REACTOR_MAX_EVENTS,
+			accept_pending ? REACTOR_RETRY_MS : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: epoll_wait");
+			goto handle_err;
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct conn *conn = events[i].data.ptr;
+			if (!conn) {
+				accept_pending = 1;
+				continue;
+			}
+			if (events[i].data.ptr == &reactor_sync_tag) {
+				sync_pending = 1;
+				continue;
+			}
+			if (conn_handle(conn))
+				conn_close(conn);
+		}
+
+		/* Only now, conns it closes may have had events above */
+		if (sync_pending) {
+			reactor_synced(sync_fd);
+			sync_pending = 0;
+		}
+	}
+
+handle_err:
+	close(epfd);
+	return -1;
+}
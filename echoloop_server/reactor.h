@@ -0,0 +1,8 @@
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+/* Edge-triggered epoll loop, serves all clients in one thread */
+
+int reactor_run(int serv_sock);
+
+#endif /* REACTOR_H_ */
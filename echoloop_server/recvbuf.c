@@ -0,0 +1,93 @@
+#include "recvbuf.h"
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct recvbuf {
+	int sock;
+	int eof;
+	size_t head;	/* First byte not taken */
+	size_t tail;	/* End of bytes read */
+	char buf[RECVBUF_SIZE];
+};
+
+struct recvbuf *recvbuf_new(int sock)
+{
+	struct recvbuf *rb = malloc(sizeof(*rb));
+	if (!rb)
+		return NULL;
+	rb->sock = sock;
+	rb->eof = 0;
+	rb->head = 0;
+	rb->tail = 0;
+	return rb;
+}
+
+void recvbuf_delete(struct recvbuf *rb)
+{
+	free(rb);
+}
+
+int recvbuf_read(struct recvbuf *rb, void *dst, size_t size, size_t *done)
+{
+	char *ptr = dst;
+
+	while (*done < size) {
+		size_t want = size - *done;
+
+		if (rb->head < rb->tail) {
+			size_t n = rb->tail - rb->head;
+			if (n > want)
+				n = want;
+			memcpy(ptr + *done, &rb->buf[rb->head], n);
+			rb->head += n;
+			*done += n;
+			continue;
+		}
+
+		/* Large piece isn't worth a copy */
+		rb->head = rb->tail = 0;
+		int direct = want >= RECVBUF_SIZE;
+		ssize_t ret;
+		if (direct)
+			ret = read(rb->sock, ptr + *done, want);
+		else
+			ret = read(rb->sock, rb->buf, RECVBUF_SIZE);
+		if (ret == 0) {
+			rb->eof = 1;
+			return -1;
+		}
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (direct)
+			*done += ret;
+		else
+			rb->tail = ret;
+	}
+	return 1;
+}
+
+int recvbuf_pending(struct recvbuf *rb)
+{
+	if (rb->head < rb->tail)
+		return 1;
+
+	int n;
+	if (ioctl(rb->sock, FIONREAD, &n) < 0)
+		return 0;
+	return n > 0;
+}
+
+int recvbuf_eof(struct recvbuf *rb)
+{
+	return rb->eof;
+}
@@ -0,0 +1,30 @@
+#ifndef RECVBUF_H_
+#define RECVBUF_H_
+
+#include <stddef.h>
+
+/*
+ * Receive side of a connection. Socket is read in large chunks and
+ * frames are taken from the buffer, so one read usually brings in many
+ * of them. A piece which is at least as large as the buffer is read
+ * straight into its destination instead. Works with blocking and
+ * non-blocking sockets alike.
+ */
+
+#define RECVBUF_SIZE (64 << 10)
+
+typedef struct recvbuf recvbuf_t;
+
+recvbuf_t *recvbuf_new(int sock);
+void recvbuf_delete(recvbuf_t *rb);
+/*
+ * Fills size bytes at dst, *done of them are filled already, so it can
+ * be resumed. Returns 1 when complete, 0 if socket would block, -1 on
+ * error or EOF.
+ */
+int recvbuf_read(recvbuf_t *rb, void *dst, size_t size, size_t *done);
+/* Returns 1 if peer has sent something which is not taken yet */
+int recvbuf_pending(recvbuf_t *rb);
+int recvbuf_eof(recvbuf_t *rb);
+
+#endif /* RECVBUF_H_ */
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include "session.h"
+#include "io.h"
+
+#include <sys/socket.h>
+#include <poll.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SESSION_BUF_SIZE (64 << 10)
+
+struct session {
+	int sock;
+	size_t window;
+	size_t sent;	/* Strs put into buf or written */
+	size_t acked;
+	uint32_t ttl_ms;
+	uint64_t *sent_ns;	/* Send times of unacked strs, by seq % window */
+	size_t *sent_s;
+	struct session_stats stats;
+	size_t buf_s;
+	char buf[SESSION_BUF_SIZE];
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+session_t *session_new(int sock, size_t window)
+{
+	struct session *session = calloc(1, sizeof(*session));
+	if (!session)
+		return NULL;
+	session->sock = sock;
+	session->window = window ? window : SESSION_WINDOW;
+	session->sent_ns = malloc(session->window * sizeof(uint64_t));
+	session->sent_s = malloc(session->window * sizeof(size_t));
+	if (!session->sent_ns || !session->sent_s) {
+		session_delete(session);
+		return NULL;
+	}
+	hist_init(&session->stats.latency);
+
+	size_t magic = SESSION_MAGIC;
+	memcpy(session->buf, &magic, sizeof(magic));
+	session->buf_s = sizeof(magic);
+	return session;
+}
+
+void session_delete(struct session *session)
+{
+	free(session->sent_ns);
+	free(session->sent_s);
+	free(session);
+}
+
+static int session_flush(struct session *session)
+{
+	if (!session->buf_s)
+		return 0;
+	if (writen(session->sock, session->buf, session->buf_s) !=
+			session->buf_s) {
+		fprintf(stderr, "Error: can't send strs to server\n");
+		return -1;
+	}
+	session->buf_s = 0;
+	return 0;
+}
+
+static int session_recv_ack(struct session *session)
+{
+	size_t ack;
+	if (readn(session->sock, &ack, sizeof(ack)) != sizeof(ack)) {
+		fprintf(stderr, "Error: can't receive ack from server\n");
+		return -1;
+	}
+	if (ack <= session->acked || ack > session->sent) {
+		fprintf(stderr, "Error: wrong ack\n");
+		return -1;
+	}
+
+	uint64_t now = now_ns();
+	for (; session->acked < ack; session->acked++) {
+		size_t idx = session->acked % session->window;
+		hist_add(&session->stats.latency, now - session->sent_ns[idx]);
+		session->stats.bytes += session->sent_s[idx];
+		session->stats.strs++;
+	}
+	return 0;
+}
+
+void session_ttl(struct session *session, uint32_t ttl_ms)
+{
+	session->ttl_ms = ttl_ms;
+}
+
+int session_send(struct session *session, char *str, size_t str_s)
+{
+	return session_send_at(session, str, str_s, now_ns());
+}
+
+int session_send_at(struct session *session, char *str, size_t str_s,
+		    uint64_t start_ns)
+{
+	/* Server acks what it has, so the window can't be full of unsent */
+	if (session->sent - session->acked >= session->window) {
+		if (session_flush(session) < 0 ||
+		    session_recv_ack(session) < 0)
+			return -1;
+	}
+
+	size_t idx = session->sent % session->window;
+	session->sent_ns[idx] = start_ns;
+	session->sent_s[idx] = str_s;
+
+	size_t hdr = str_s;
+	size_t hdr_s = sizeof(hdr);
+	if (session->ttl_ms) {
+		hdr |= SESSION_TTL;
+		hdr_s += sizeof(session->ttl_ms);
+	}
+	if (hdr_s + str_s > SESSION_BUF_SIZE - session->buf_s &&
+	    session_flush(session) < 0)
+		return -1;
+
+	memcpy(&session->buf[session->buf_s], &hdr, sizeof(hdr));
+	if (session->ttl_ms)
+		memcpy(&session->buf[session->buf_s + sizeof(hdr)],
+			&session->ttl_ms, sizeof(session->ttl_ms));
+	session->buf_s += hdr_s;
+	if (str_s <= SESSION_BUF_SIZE - session->buf_s) {
+		memcpy(&session->buf[session->buf_s], str, str_s);
+		session->buf_s += str_s;
+	} else {
+		/* Large str goes straight from the caller */
+		if (session_flush(session) < 0)
+			return -1;
+		if (writen(session->sock, str, str_s) != str_s) {
+			fprintf(stderr, "Error: can't send str to server\n");
+			return -1;
+		}
+	}
+	session->sent++;
+	return 0;
+}
+
+int session_finish(struct session *session)
+{
+	if (session_flush(session) < 0)
+		return -1;
+	if (shutdown(session->sock, SHUT_WR) < 0) {
+		perror("Error: shutdown");
+		return -1;
+	}
+	while (session->acked < session->sent) {
+		if (session_recv_ack(session) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int session_poll(struct session *session, int64_t timeout_ns)
+{
+	if (session_flush(session) < 0)
+		return -1;
+
+	uint64_t end = now_ns() + timeout_ns;
+	while (session->acked < session->sent) {
+		int64_t left = end - now_ns();
+		if (left < 0)
+			left = 0;
+		struct timespec ts = {
+			.tv_sec  = left / 1000000000,
+			.tv_nsec = left % 1000000000
+		};
+		struct pollfd pfd = { .fd = session->sock, .events = POLLIN };
+		int ret = ppoll(&pfd, 1, &ts, NULL);
+		if (ret < 0 && errno != EINTR) {
+			perror("Error: ppoll");
+			return -1;
+		}
+		if (ret <= 0) {
+			if (!left)
+				break;
+			continue;
+		}
+		if (session_recv_ack(session) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+struct session_stats *session_stats(struct session *session)
+{
+	return &session->stats;
+}
@@ -0,0 +1,50 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include "hist.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Session protocol: the first size_t word is SESSION_MAGIC instead of
+ * a str size, then the client sends any number of frames (size_t size,
+ * str) and finally shuts down its side. Server acks with the cumulative
+ * number of strs taken in the session, once its input is drained or
+ * SESSION_ACK_BATCH strs are waiting for an ack. No str is longer than
+ * UINT32_MAX, so the magic can't be confused with a size.
+ *
+ * In either protocol a size may have SESSION_TTL set, then uint32_t
+ * TTL in ms follows it before the str. TTL 0 is the server default.
+ */
+
+#define SESSION_MAGIC     SIZE_MAX
+#define SESSION_TTL       ((size_t) 1 << (sizeof(size_t) * 8 - 1))
+#define SESSION_ACK_BATCH 64
+#define SESSION_WINDOW    256	/* Strs sent but not acked, client side */
+
+/* Client side of a session */
+
+struct session_stats {
+	size_t strs;		/* Acked */
+	size_t bytes;
+	struct hist latency;	/* From session_send to ack, in ns */
+};
+
+typedef struct session session_t;
+
+session_t *session_new(int sock, size_t window);
+void session_delete(session_t *session);
+int session_send(session_t *session, char *str, size_t str_s);
+/* TTL of strs which are sent next, 0 if they have none */
+void session_ttl(session_t *session, uint32_t ttl_ms);
+/* Latency is counted from start_ns, CLOCK_MONOTONIC, instead of now */
+int session_send_at(session_t *session, char *str, size_t str_s,
+		    uint64_t start_ns);
+/* Sends what is buffered and takes acks which come in timeout_ns */
+int session_poll(session_t *session, int64_t timeout_ns);
+/* Returns after everything is acked */
+int session_finish(session_t *session);
+struct session_stats *session_stats(session_t *session);
+
+#endif /* SESSION_H_ */
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct stats_slot {
+	struct stats_slot *next;
+	int owned;
+	unsigned id;	/* Also number of trace ring */
+	uint32_t tid;	/* Of owner */
+	struct stats stats;
+};
+
+static const char *stats_stage_names[STATS_STAGES] = {
+	[STATS_ACCEPT]   = "accept",
+	[STATS_HDR]      = "hdr",
+	[STATS_DATA]     = "data",
+	[STATS_RESERVE]  = "reserve",
+	[STATS_ACK]      = "ack",
+	[STATS_TICK]     = "tick",
+	[STATS_COMPRESS] = "compress",
+	[STATS_SYNC]     = "sync",
+	[STATS_COMMIT]   = "commit"
+};
+
+static const char *stats_counter_names[STATS_COUNTERS] = {
+	[STATS_CONNS]           = "conns",
+	[STATS_SESSIONS]        = "sessions",
+	[STATS_STRS]            = "strs",
+	[STATS_BYTES]           = "bytes",
+	[STATS_ACKS]            = "acks",
+	[STATS_RESERVE_RETRIES] = "reserve_retries",
+	[STATS_ERR_ACCEPT]      = "err_accept",
+	[STATS_ERR_HDR]         = "err_hdr",
+	[STATS_ERR_DATA]        = "err_data",
+	[STATS_ERR_RESERVE]     = "err_reserve",
+	[STATS_ERR_TOO_LONG]    = "err_too_long",
+	[STATS_ERR_ACK]         = "err_ack",
+	[STATS_ERR_LOG]         = "err_log"
+};
+
+static struct stats_slot *stats_slots;
+static unsigned stats_nslots;
+static __thread struct stats_slot *stats_own;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/* Runs at thread exit, last stores are published by the release */
+static void stats_release(void *ptr)
+{
+	struct stats_slot *slot = ptr;
+	__atomic_store_n(&slot->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_key_create()
+{
+	pthread_key_create(&stats_key, stats_release);
+}
+
+static struct stats_slot *stats_slot()
+{
+	if (stats_own)
+		return stats_own;
+	/* Callers report errors after recording them */
+	int err = errno;
+	pthread_once(&stats_once, stats_key_create);
+
+	struct stats_slot *slot = __atomic_load_n(&stats_slots,
+		__ATOMIC_ACQUIRE);
+	for (; slot; slot = slot->next) {
+		int owned = 0;
+		if (__atomic_compare_exchange_n(&slot->owned, &owned, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!slot) {
+		/* Numbers are lost if there is no memory */
+		slot = malloc(sizeof(*slot));
+		if (!slot) {
+			errno = err;
+			return NULL;
+		}
+		memset(slot->stats.counters, 0, sizeof(slot->stats.counters));
+		for (int i = 0; i < STATS_STAGES; i++)
+			hist_init(&slot->stats.stages[i]);
+		slot->owned = 1;
+		slot->id = __atomic_fetch_add(&stats_nslots, 1,
+			__ATOMIC_RELAXED);
+		slot->next = __atomic_load_n(&stats_slots, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&stats_slots, &slot->next,
+				slot, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	slot->tid = syscall(SYS_gettid);
+	pthread_setspecific(stats_key, slot);
+	stats_own = slot;
+	errno = err;
+	return slot;
+}
+
+uint64_t stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_add(enum stats_counter counter, uint64_t val)
+{
+	struct stats_slot *slot = stats_slot();
+	if (!slot)
+		return;
+	uint64_t *ptr = &slot->stats.counters[counter];
+	__atomic_store_n(ptr, *ptr + val, __ATOMIC_RELAXED);
+}
+
+void stats_stage(enum stats_stage stage, uint64_t start)
+{
+	struct stats_slot *slot = stats_slot();
+	if (!slot)
+		return;
+	uint64_t now = stats_now();
+	hist_add_shared(&slot->stats.stages[stage], now - start);
+	trace_add(slot->id, slot->tid, stage, start, now);
+}
+
+int stats_trace(char *path)
+{
+	return trace_open(path, stats_stage_names, STATS_STAGES);
+}
+
+void stats_collect(struct stats *stats)
+{
+	memset(stats->counters, 0, sizeof(stats->counters));
+	for (int i = 0; i < STATS_STAGES; i++)
+		hist_init(&stats->stages[i]);
+
+	struct stats_slot *slot = __atomic_load_n(&stats_slots,
+		__ATOMIC_ACQUIRE);
+	for (; slot; slot = slot->next) {
+		for (int i = 0; i < STATS_COUNTERS; i++)
+			stats->counters[i] += __atomic_load_n(
+				&slot->stats.counters[i], __ATOMIC_RELAXED);
+		for (int i = 0; i < STATS_STAGES; i++)
+			hist_merge(&stats->stages[i], &slot->stats.stages[i]);
+	}
+}
+
+void stats_print(struct stats *stats, FILE *file)
+{
+	for (int i = 0; i < STATS_COUNTERS; i++)
+		fprintf(file, "%s %llu\n", stats_counter_names[i],
+			(unsigned long long) stats->counters[i]);
+
+	/* Times are in ns */
+	for (int i = 0; i < STATS_STAGES; i++) {
+		struct hist *hist = &stats->stages[i];
+		fprintf(file, "stage %s count %llu", stats_stage_names[i],
+			(unsigned long long) hist->count);
+		if (hist->count)
+			fprintf(file, " min %llu avg %llu p50 %llu p99 %llu "
+				"p999 %llu max %llu",
+				(unsigned long long) hist->min,
+				(unsigned long long) (hist->sum / hist->count),
+				(unsigned long long) hist_quantile(hist, 0.5),
+				(unsigned long long) hist_quantile(hist, 0.99),
+				(unsigned long long) hist_quantile(hist, 0.999),
+				(unsigned long long) hist->max);
+		fprintf(file, "\n");
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "hist.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Server counters and latencies of request stages. Every thread records
+ * into own slot with plain stores, nothing is shared on the hot path.
+ * stats_collect sums slots of all threads, at any time. Slot of an
+ * exited thread is taken by the next new one, so its numbers are kept.
+ */
+
+enum stats_stage {
+	STATS_ACCEPT,	/* accept call */
+	STATS_HDR,	/* Receiving size of str */
+	STATS_DATA,	/* Receiving str */
+	STATS_RESERVE,	/* Taking space in strlist */
+	STATS_ACK,	/* Sending ack */
+	STATS_TICK,	/* Building output of a tick */
+	STATS_COMPRESS,	/* Compressing old history in a tick */
+	STATS_SYNC,	/* Waiting for strs to be logged before ack */
+	STATS_COMMIT,	/* Writing and syncing a batch of the log */
+	STATS_STAGES
+};
+
+enum stats_counter {
+	STATS_CONNS,
+	STATS_SESSIONS,
+	STATS_STRS,
+	STATS_BYTES,
+	STATS_ACKS,
+	STATS_RESERVE_RETRIES,	/* Filled in by whoever collects */
+	STATS_ERR_ACCEPT,
+	STATS_ERR_HDR,
+	STATS_ERR_DATA,
+	STATS_ERR_RESERVE,
+	STATS_ERR_TOO_LONG,
+	STATS_ERR_ACK,
+	STATS_ERR_LOG,
+	STATS_COUNTERS
+};
+
+struct stats {
+	uint64_t counters[STATS_COUNTERS];
+	struct hist stages[STATS_STAGES];	/* In ns */
+};
+
+uint64_t stats_now();
+void stats_add(enum stats_counter counter, uint64_t val);
+/* Stage has taken from start till now */
+void stats_stage(enum stats_stage stage, uint64_t start);
+/* Stages are traced too, see trace.h */
+int stats_trace(char *path);
+void stats_collect(struct stats *stats);
+void stats_print(struct stats *stats, FILE *file);
+
+#endif /* STATS_H_ */
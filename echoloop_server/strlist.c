@@ -1,72 +1,1150 @@
+#define _GNU_SOURCE
 #include "strlist.h"
+#include "intern.h"
+#include "lz.h"
+#include "wheel.h"
 #include <errno.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-struct strelem {
-	char *str;
-	size_t str_s;
-	struct strelem *next;
+#define STRLIST_CHUNK_SIZE (1 << 20)
+#define STRCHUNK_RANGES    8
+#define STRLIST_TTL_RES    1000000 /* Expiry is counted in ms */
+#define STRCOLD_BLOCK      (64 << 10)
+#define STRCHUNK_RECS      (STRLIST_CHUNK_SIZE / 8 + 1)
+#define STRCHUNK_LONG_RECS 16	/* Long str and others racing for its chunk */
+
+/* Stats are written by printer only and may be read by other threads */
+#define STAT_ADD(list, field, val) \
+	__atomic_store_n(&(list)->stats.field, (list)->stats.field + (val), \
+		__ATOMIC_RELAXED)
+
+enum strrec_state {
+	STRREC_EMPTY,	/* Claimed, text is not reserved yet */
+	STRREC_BUSY,	/* Str is being filled */
+	STRREC_READY,
+	STRREC_DEAD	/* Cancelled */
+};
+
+/* Index entry, str itself is in chunk text */
+struct strrec {
+	uint32_t off;
+	uint32_t str_s;
+	int state;
+	uint32_t ttl_ms;	/* 0 if str doesn't expire */
+	struct intern_str *ref;	/* Text is there instead, if interned */
+
+	/* Printer only, set once the entry is admitted */
+	uint32_t held;	/* Bytes counted against retention */
+	int expired;
+	uint64_t ts;	/* When printer first saw it */
+	struct wheel_timer *timer;
+};
+
+/* Block of a compressed chunk, its output is made when it's written */
+struct strblock {
+	struct strcold *cold;
+	size_t off;		/* In data */
+	uint32_t raw_s;
+	uint32_t data_s;	/* Equal to raw_s if it's stored as is */
+};
+
+/* Entries from idx on were admitted at ts, a chunk takes a few ticks */
+struct coldrun {
+	size_t idx;
+	uint64_t ts;
 };
 
+/*
+ * Output of held entries of a chunk, one after another in blocks, text
+ * of strs may go on in the next block. Eviction leaves out whole
+ * blocks, and then a part of the first one. Of entries themselves only
+ * what eviction needs is kept.
+ */
+struct strcold {
+	struct strlist *list;
+	size_t nrecs;
+	uint32_t *held;
+	uint8_t *cancelled;	/* Bits of held ones which are not printed */
+	size_t nruns;
+	struct coldrun *runs;
+	size_t nblocks;
+	struct strblock *blocks;
+	char *data;
+	size_t start;		/* Entries before it are evicted */
+	size_t run;		/* Of start */
+	size_t block;		/* First block which is not evicted */
+	size_t skip;		/* Bytes of it which are evicted */
+	size_t bytes;		/* Taken by all of it */
+	uint64_t tag;		/* Chunk text is used by output till then */
+};
+
+/*
+ * Chunk text is the rendered output: strs are stored one after another,
+ * each followed by '\n'. Index entries are claimed in the same order as
+ * text is reserved (almost always), so runs of ready strs are contiguous
+ * and printed as one piece. Printer remembers such runs in ranges.
+ */
+struct strchunk {
+	struct strchunk *next;
+	size_t map_s;
+	size_t size;
+	size_t used;	/* Bytes of text reserved */
+	size_t nrecs;	/* Index entries claimed, may exceed max_recs */
+	size_t max_recs;
+	struct strrec *recs;
+
+	/* Printer only */
+	size_t scanned;	/* Leading entries which are in ranges or dead */
+	size_t nranges;
+	struct iovec ranges[STRCHUNK_RANGES];
+	size_t start;	/* Entries before it are evicted */
+	size_t admitted;
+	size_t live;	/* Admitted entries which are held */
+	int sealed;	/* No entries are claimed anymore */
+	size_t sealed_nrecs;
+	uint64_t admit_tick;	/* When all entries were admitted */
+
+	/* Compressed, only header of the chunk is used then */
+	struct strcold *cold;
+	struct strchunk *cooling;	/* Text is not released yet */
+
+	/* Unlinked chunk waits in limbo */
+	struct strchunk *limbo;
+	unsigned epoch;
+	uint64_t tag;
+
+	char text[];
+};
+
+/*
+ * Printer evicts from the front and frees chunks, while appenders only
+ * touch the last one, and any of them may still hold a chunk which used
+ * to be the last. So appenders announce themselves in active[] of the
+ * current epoch. Chunk unlinked in some epoch is freed once everyone
+ * who entered by then has left, and it has no str which is being filled.
+ */
 struct strlist {
-	struct strelem *first;
-	struct strelem *last;
+	struct strchunk *first;
+	struct strchunk *last;
+	size_t retries;	/* Reservations lost to other threads */
+	size_t cancels;	/* Entries cancelled */
+	unsigned epoch;
+	size_t active[2];
+
+	/* Printer only */
+	struct strchunk *admit;	/* Entries are admitted here */
+	struct strchunk *limbo;
+	wheel_t *wheel;		/* Expiry of entries with TTL */
+	uint64_t tag;		/* Of current strlist_evict */
+	uint64_t ticks;		/* Calls of strlist_evict */
+	size_t cancels_seen;
+	intern_t *intern;
+	struct strchunk *cool;	/* First chunk not looked at by compress */
+	struct strchunk *cooling;
+	char *raw;		/* Block being compressed */
+	char *lz;
+	struct strlist_stats stats;
 };
 
+/*
+ * Unused index must read as STRREC_EMPTY, so chunks are zeroed. They
+ * are mapped directly, so that freed ones go back to the system and
+ * pages are only touched as they are filled.
+ */
+static struct strchunk *strchunk_new(size_t size, size_t max_recs)
+{
+	size_t map_s = sizeof(struct strchunk) + size +
+		max_recs * sizeof(struct strrec) + sizeof(uint64_t);
+	struct strchunk *chunk = mmap(NULL, map_s, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chunk == MAP_FAILED)
+		return NULL;
+	chunk->map_s = map_s;
+	chunk->size = size;
+	chunk->max_recs = max_recs;
+	/* Align index after text */
+	chunk->recs = (struct strrec *) (((uintptr_t) &chunk->text[size] +
+		sizeof(uint64_t) - 1) & ~(uintptr_t) (sizeof(uint64_t) - 1));
+	return chunk;
+}
+
+static void strcold_delete(struct strcold *cold)
+{
+	free(cold->held);
+	free(cold->cancelled);
+	free(cold->runs);
+	free(cold->blocks);
+	free(cold->data);
+	free(cold);
+}
+
+static void strchunk_delete(struct strchunk *chunk)
+{
+	if (chunk->cold)
+		strcold_delete(chunk->cold);
+	munmap(chunk, chunk->map_s);
+}
+
+static inline char *strrec_text(struct strchunk *chunk, struct strrec *rec)
+{
+	return rec->ref ? rec->ref->text : &chunk->text[rec->off];
+}
+
+/* Evict and expire race with strlist_cancel, only one drops the ref */
+static void strrec_unref(struct strlist *list, struct strrec *rec,
+			 uint64_t tag)
+{
+	if (!__atomic_load_n(&rec->ref, __ATOMIC_RELAXED))
+		return;
+	struct intern_str *ref = __atomic_exchange_n(&rec->ref, NULL,
+		__ATOMIC_ACQ_REL);
+	if (ref)
+		intern_put(list->intern, ref, tag);
+}
+
+static inline size_t strchunk_nrecs(struct strchunk *chunk)
+{
+	if (chunk->sealed)
+		return chunk->sealed_nrecs;
+	size_t nrecs = __atomic_load_n(&chunk->nrecs, __ATOMIC_ACQUIRE);
+	return nrecs < chunk->max_recs ? nrecs : chunk->max_recs;
+}
+
 struct strlist *strlist_new()
 {
-	struct strlist *ptr = malloc(sizeof(*ptr));
+	struct strlist *ptr = calloc(1, sizeof(*ptr));
 	if (!ptr)
 		return NULL;
-	ptr->first = NULL;
-	ptr->last = NULL;
+	ptr->wheel = wheel_new(STRLIST_TTL_RES, 0);
+	ptr->intern = intern_new();
+	ptr->first = strchunk_new(STRLIST_CHUNK_SIZE, STRCHUNK_RECS);
+	ptr->raw = malloc(STRCOLD_BLOCK);
+	ptr->lz = malloc(STRCOLD_BLOCK);
+	if (!ptr->wheel || !ptr->intern || !ptr->first || !ptr->raw ||
+	    !ptr->lz) {
+		strlist_delete(ptr);
+		return NULL;
+	}
+	ptr->last = ptr->first;
+	ptr->admit = ptr->first;
+	ptr->cool = ptr->first;
 	return ptr;
 }
 
 void strlist_delete(struct strlist *list)
 {
-	for (struct strelem *ptr = list->first; ptr != NULL; ptr = ptr->next)
-		free(ptr->str);
+	struct strchunk *chunk = list->first;
+	while (chunk) {
+		struct strchunk *next = chunk->next;
+		strchunk_delete(chunk);
+		chunk = next;
+	}
+	chunk = list->limbo;
+	while (chunk) {
+		struct strchunk *next = chunk->limbo;
+		strchunk_delete(chunk);
+		chunk = next;
+	}
+	if (list->wheel)
+		wheel_delete(list->wheel);
+	if (list->intern)
+		intern_delete(list->intern);
+	free(list->raw);
+	free(list->lz);
 	free(list);
 }
 
-/* All strings here must be dynamically allocated */
-/* List may be safely printed if this function is interrupted */
+/* Chunks seen after entering stay allocated until strlist_leave */
+static unsigned strlist_enter(struct strlist *list)
+{
+	while (1) {
+		unsigned epoch = __atomic_load_n(&list->epoch,
+			__ATOMIC_SEQ_CST) & 1;
+		__atomic_fetch_add(&list->active[epoch], 1, __ATOMIC_SEQ_CST);
+		/* Printer may have checked active[] before it was counted */
+		if ((__atomic_load_n(&list->epoch, __ATOMIC_SEQ_CST) & 1) ==
+				epoch)
+			return epoch;
+		__atomic_fetch_sub(&list->active[epoch], 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void strlist_leave(struct strlist *list, unsigned epoch)
+{
+	__atomic_fetch_sub(&list->active[epoch], 1, __ATOMIC_RELEASE);
+}
+
+/* Link a new chunk after a full one, someone else may do it first */
+static int strlist_grow(struct strlist *list, struct strchunk *chunk,
+			size_t need)
+{
+	struct strchunk *next = NULL;
+	/* Chunk of a long str has no room for others, nor index for them */
+	struct strchunk *new = need > STRLIST_CHUNK_SIZE ?
+		strchunk_new(need, STRCHUNK_LONG_RECS) :
+		strchunk_new(STRLIST_CHUNK_SIZE, STRCHUNK_RECS);
+	if (!new)
+		return -1;
+
+	if (!__atomic_compare_exchange_n(&chunk->next, &next, new, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		strchunk_delete(new);
+		new = next;
+	}
+	__atomic_compare_exchange_n(&list->last, &chunk, new, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Interned str only takes an entry */
+static char *strlist_reserve_in(struct strlist *list, size_t str_s,
+				uint32_t ttl_ms, struct intern_str *ref,
+				strrec_t **recp)
+{
+	size_t need = ref ? 0 : str_s + 1;
+
+	while (1) {
+		struct strchunk *chunk = __atomic_load_n(&list->last,
+			__ATOMIC_ACQUIRE);
+
+		size_t idx = __atomic_fetch_add(&chunk->nrecs, 1,
+			__ATOMIC_ACQ_REL);
+		if (idx >= chunk->max_recs) {
+			if (strlist_grow(list, chunk, need) < 0)
+				return NULL;
+			continue;
+		}
+		struct strrec *rec = &chunk->recs[idx];
+		rec->str_s = str_s;
+		rec->ttl_ms = ttl_ms;
+		if (ref) {
+			/* Printer may take it as soon as it's busy */
+			rec->ref = ref;
+			__atomic_store_n(&rec->state, STRREC_BUSY,
+				__ATOMIC_RELEASE);
+			*recp = rec;
+			return ref->text;
+		}
+
+		size_t used = __atomic_load_n(&chunk->used, __ATOMIC_RELAXED);
+		while (need <= chunk->size - used &&
+		       !__atomic_compare_exchange_n(&chunk->used, &used,
+				used + need, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED))
+			__atomic_fetch_add(&list->retries, 1, __ATOMIC_RELAXED);
+
+		if (need > chunk->size - used) {
+			/* Entry is already claimed, leave it dead */
+			__atomic_store_n(&rec->state, STRREC_DEAD,
+				__ATOMIC_RELEASE);
+			if (strlist_grow(list, chunk, need) < 0)
+				return NULL;
+			continue;
+		}
+
+		rec->off = used;
+		chunk->text[used + str_s] = '\n';
+		__atomic_store_n(&rec->state, STRREC_BUSY, __ATOMIC_RELEASE);
+		*recp = rec;
+		return &chunk->text[used];
+	}
+}
+
+char *strlist_reserve(struct strlist *list, size_t str_s, uint32_t ttl_ms,
+		      strrec_t **recp)
+{
+	if (str_s >= UINT32_MAX) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Reserved entry keeps its chunk by itself, until it's finished */
+	unsigned epoch = strlist_enter(list);
+	char *ptr = strlist_reserve_in(list, str_s, ttl_ms, NULL, recp);
+	strlist_leave(list, epoch);
+	return ptr;
+}
+
+int strlist_intern(struct strlist *list, char *str, size_t str_s,
+		   uint32_t ttl_ms, strrec_t **recp)
+{
+	if (str_s >= UINT32_MAX) {
+		errno = ENOMEM;
+		return -1;
+	}
+	struct intern_str *ref = intern_get(list->intern, str, str_s);
+	if (!ref)
+		return -1;
+
+	unsigned epoch = strlist_enter(list);
+	char *ptr = strlist_reserve_in(list, str_s, ttl_ms, ref, recp);
+	strlist_leave(list, epoch);
+	if (!ptr) {
+		intern_put(list->intern, ref, 0);
+		return -1;
+	}
+	return 0;
+}
+
+size_t strlist_bytes(struct strlist *list)
+{
+	size_t bytes = 0;
+	unsigned epoch = strlist_enter(list);
+	struct strchunk *chunk = __atomic_load_n(&list->first,
+		__ATOMIC_ACQUIRE);
+	for (; chunk; chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE))
+		bytes += __atomic_load_n(&chunk->used, __ATOMIC_RELAXED);
+	strlist_leave(list, epoch);
+	return bytes;
+}
+
+size_t strlist_retries(struct strlist *list)
+{
+	return __atomic_load_n(&list->retries, __ATOMIC_RELAXED);
+}
+
+void strlist_commit(struct strlist *list, strrec_t *rec)
+{
+	__atomic_store_n(&rec->state, STRREC_READY, __ATOMIC_RELEASE);
+}
+
+/* Printer stops holding it on its next tick, if it's admitted already */
+void strlist_cancel(struct strlist *list, strrec_t *rec)
+{
+	strrec_unref(list, rec, 0);
+	__atomic_store_n(&rec->state, STRREC_DEAD, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&list->cancels, 1, __ATOMIC_RELEASE);
+}
+
 int strlist_append(struct strlist *list, char *str, size_t str_s)
 {
-	struct strelem *elem = malloc(sizeof(*elem));
-	if (!elem)
+	strrec_t *rec;
+	char *ptr = strlist_reserve(list, str_s, 0, &rec);
+	if (!ptr)
 		return -1;
-	elem->str = str;
-	elem->str_s = str_s;
+	memcpy(ptr, str, str_s);
+	strlist_commit(list, rec);
+	return 0;
+}
+
+/* Handles partial writes, iov is modified */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error: writev");
+			return -1;
+		}
+		while (iovcnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
 
-	if (!list->first)
-		list->first = elem;
-	else
-		list->last->next = elem;
+/* Adds a piece to iov, returns 0 if it was merged with the last one */
+static int iov_add(struct iovec *iov, size_t iovcnt, char *base, size_t len)
+{
+	if (iovcnt) {
+		struct iovec *last = &iov[iovcnt - 1];
+		if ((char *) last->iov_base + last->iov_len == base) {
+			last->iov_len += len;
+			return 0;
+		}
+	}
+	iov[iovcnt].iov_base = base;
+	iov[iovcnt].iov_len = len;
+	return 1;
+}
 
-	list->last = elem;
+struct strlist_out {
+	int fd;
+	int iovcnt;
+	struct iovec iov[IOV_MAX];
+};
+
+static int strlist_out_add(void *arg, char *base, size_t len)
+{
+	struct strlist_out *out = arg;
+
+	if (out->iovcnt == IOV_MAX) {
+		if (writev_all(out->fd, out->iov, out->iovcnt) < 0)
+			return -1;
+		out->iovcnt = 0;
+	}
+	out->iovcnt += iov_add(out->iov, out->iovcnt, base, len);
 	return 0;
 }
 
-int strlist_print(struct strlist *list, int fd)
+/* Move leading finished entries to ranges, each one is looked at once */
+static void strchunk_scan(struct strchunk *chunk, size_t nrecs)
 {
-	for (struct strelem *ptr = list->first; ptr != NULL; ptr = ptr->next) {
-		char *str = ptr->str;
-		size_t str_s = ptr->str_s;
-		while (str_s) {
-			ssize_t ret = write(fd, str, str_s);
-			if (ret < 0) {
-				perror("Error: write");
-				return -1;
+	for (; chunk->scanned < nrecs; chunk->scanned++) {
+		struct strrec *rec = &chunk->recs[chunk->scanned];
+		int state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+		if (state == STRREC_DEAD || rec->expired)
+			continue;
+		if (state != STRREC_READY)
+			return;
+
+		char *str = strrec_text(chunk, rec);
+		if (chunk->nranges == STRCHUNK_RANGES) {
+			struct iovec *last = &chunk->ranges[chunk->nranges - 1];
+			if ((char *) last->iov_base + last->iov_len != str)
+				return;
+		}
+		chunk->nranges += iov_add(chunk->ranges, chunk->nranges, str,
+			rec->str_s + 1);
+	}
+}
+
+/* Entries are counted in order, once their size is known */
+static int strlist_admit(struct strlist *list, uint64_t now)
+{
+	struct strchunk *chunk = list->admit;
+
+	while (1) {
+		size_t nrecs = strchunk_nrecs(chunk);
+		for (; chunk->admitted < nrecs; chunk->admitted++) {
+			struct strrec *rec = &chunk->recs[chunk->admitted];
+			int state = __atomic_load_n(&rec->state,
+				__ATOMIC_ACQUIRE);
+			if (state == STRREC_EMPTY)
+				return 0;
+			if (state == STRREC_DEAD)
+				continue;
+
+			if (rec->ttl_ms) {
+				rec->timer = wheel_add(list->wheel, now +
+					rec->ttl_ms * (uint64_t) STRLIST_TTL_RES,
+					rec, chunk);
+				if (!rec->timer)
+					return -1;
 			}
-			str_s -= ret;
+			rec->ts = now;
+			rec->held = rec->str_s + 1;
+			chunk->live++;
+			STAT_ADD(list, held_strs, 1);
+			STAT_ADD(list, held_bytes, rec->held + sizeof(*rec));
+		}
+
+		struct strchunk *next = __atomic_load_n(&chunk->next,
+			__ATOMIC_ACQUIRE);
+		if (!next)
+			return 0;
+		/* Appenders which still hold it have to move on */
+		if (!chunk->sealed) {
+			nrecs = __atomic_fetch_add(&chunk->nrecs, chunk->max_recs,
+				__ATOMIC_ACQ_REL);
+			chunk->sealed_nrecs = nrecs < chunk->max_recs ? nrecs :
+				chunk->max_recs;
+			chunk->sealed = 1;
+			continue;
 		}
-		write(fd, "\n", 1);
+		chunk->admit_tick = list->ticks;
+		list->admit = next;
+		chunk = next;
+	}
+}
+
+static int strlist_over(struct strlist *list, struct strlist_limits *lim,
+			uint64_t ts, uint64_t now)
+{
+	if (lim->strs && list->stats.held_strs > lim->strs)
+		return 1;
+	if (lim->bytes && list->stats.held_bytes > lim->bytes)
+		return 1;
+	return lim->age_ns && now - ts > lim->age_ns;
+}
+
+static void strlist_evicted(struct strlist *list, struct strchunk *chunk,
+			    uint32_t held)
+{
+	/* A cold chunk gave its index back when it was compressed */
+	STAT_ADD(list, held_strs, -1);
+	STAT_ADD(list, held_bytes, -(held + (chunk->cold ? 0 :
+					     sizeof(struct strrec))));
+	STAT_ADD(list, evicted_strs, 1);
+	STAT_ADD(list, evicted_bytes, held);
+	chunk->live--;
+}
+
+/* Ranges start with the oldest ready entry which is not evicted */
+static void strchunk_evict(struct strchunk *chunk, struct strrec *rec)
+{
+	if (chunk->start++ >= chunk->scanned) {
+		chunk->scanned = chunk->start;
+		return;
+	}
+	if (__atomic_load_n(&rec->state, __ATOMIC_ACQUIRE) != STRREC_READY ||
+	    rec->expired)
+		return;
+
+	struct iovec *range = &chunk->ranges[0];
+	range->iov_base = (char *) range->iov_base + rec->str_s + 1;
+	range->iov_len -= rec->str_s + 1;
+	if (!range->iov_len) {
+		chunk->nranges--;
+		memmove(range, range + 1, chunk->nranges * sizeof(*range));
+	}
+}
+
+static inline size_t strcold_text_s(struct strcold *cold, size_t idx)
+{
+	return cold->cancelled[idx / 8] & 1 << idx % 8 ? 0 : cold->held[idx];
+}
+
+static void strcold_evict(struct strcold *cold)
+{
+	cold->skip += strcold_text_s(cold, cold->start++);
+	if (cold->run + 1 < cold->nruns &&
+	    cold->runs[cold->run + 1].idx == cold->start)
+		cold->run++;
+	while (cold->block < cold->nblocks &&
+	       cold->skip >= cold->blocks[cold->block].raw_s) {
+		cold->skip -= cold->blocks[cold->block].raw_s;
+		cold->block++;
+	}
+}
+
+/* Expired entry is skipped by render, its chunk goes once none is held */
+static void strlist_expire(void *arg, void *ptr, void *owner)
+{
+	struct strlist *list = arg;
+	struct strrec *rec = ptr;
+	struct strchunk *chunk = owner;
+
+	STAT_ADD(list, held_strs, -1);
+	STAT_ADD(list, held_bytes, -(rec->held + sizeof(*rec)));
+	STAT_ADD(list, expired_strs, 1);
+	STAT_ADD(list, expired_bytes, rec->held);
+	rec->held = 0;
+	rec->expired = 1;
+	rec->timer = NULL;
+	chunk->live--;
+	strrec_unref(list, rec, list->tag);
+
+	/* Ranges may have it, they are built again */
+	if (rec - chunk->recs < chunk->scanned) {
+		chunk->scanned = chunk->start;
+		chunk->nranges = 0;
+	}
+}
+
+/* Chunks where nothing is held anymore, appenders are past them */
+static void strlist_sweep(struct strlist *list, uint64_t tag)
+{
+	struct strchunk *last = __atomic_load_n(&list->last, __ATOMIC_ACQUIRE);
+	struct strchunk **link = &list->first;
+
+	while (*link != list->admit) {
+		struct strchunk *chunk = *link;
+		if (chunk->live || chunk == last) {
+			link = &chunk->next;
+			continue;
+		}
+		__atomic_store_n(link, chunk->next, __ATOMIC_RELEASE);
+		if (list->cool == chunk)
+			list->cool = chunk->next;
+		chunk->epoch = list->epoch;
+		chunk->tag = tag;
+		chunk->scanned = 0;
+		chunk->limbo = list->limbo;
+		list->limbo = chunk;
+	}
+}
+
+/* Entries cancelled after they were admitted are not held anymore */
+static void strlist_release(struct strlist *list)
+{
+	size_t cancels = __atomic_load_n(&list->cancels, __ATOMIC_ACQUIRE);
+	if (cancels == list->cancels_seen)
+		return;
+	list->cancels_seen = cancels;
+
+	/* Compressed chunks had no str being filled */
+	struct strchunk *chunk = list->first;
+	for (; chunk; chunk = chunk->next) {
+		for (size_t i = chunk->cold ? chunk->admitted : chunk->start;
+		     i < chunk->admitted; i++) {
+			struct strrec *rec = &chunk->recs[i];
+			if (!rec->held || __atomic_load_n(&rec->state,
+					__ATOMIC_ACQUIRE) != STRREC_DEAD)
+				continue;
+			if (rec->timer)
+				wheel_cancel(list->wheel, rec->timer);
+			rec->timer = NULL;
+			STAT_ADD(list, held_strs, -1);
+			STAT_ADD(list, held_bytes, -(rec->held + sizeof(*rec)));
+			rec->held = 0;
+			chunk->live--;
+		}
+		if (chunk == list->admit)
+			break;
+	}
+}
+
+int strlist_evict(struct strlist *list, struct strlist_limits *lim,
+		  uint64_t now, uint64_t tag)
+{
+	list->tag = tag;
+	list->ticks++;
+	wheel_advance(list->wheel, now, strlist_expire, list);
+	if (strlist_admit(list, now) < 0)
+		return -1;
+	strlist_release(list);
+
+	struct strchunk *chunk = list->first;
+	while (1) {
+		/* Compressed chunk is admitted, another one follows */
+		struct strcold *cold = chunk->cold;
+		if (cold) {
+			if (cold->start == cold->nrecs) {
+				chunk = chunk->next;
+				continue;
+			}
+			if (!strlist_over(list, lim, cold->runs[cold->run].ts,
+					now))
+				break;
+			strlist_evicted(list, chunk, cold->held[cold->start]);
+			strcold_evict(cold);
+			continue;
+		}
+
+		if (chunk->start == chunk->admitted) {
+			if (chunk == list->admit)
+				break;
+			chunk = chunk->next;
+			continue;
+		}
+
+		/* Dead and expired entries are passed anyway */
+		struct strrec *rec = &chunk->recs[chunk->start];
+		if (rec->held) {
+			if (!strlist_over(list, lim, rec->ts, now))
+				break;
+			if (rec->timer)
+				wheel_cancel(list->wheel, rec->timer);
+			strrec_unref(list, rec, tag);
+			strlist_evicted(list, chunk, rec->held);
+		}
+		strchunk_evict(chunk, rec);
+	}
+
+	strlist_sweep(list, tag);
+	return 0;
+}
+
+/*
+ * Chunk may be compressed once no str is being filled there and no held
+ * one has a TTL, those go away on their own anyway. Returns 1 if it can
+ * be, 0 if it never will and -1 if not yet. Held entries, their text
+ * and runs of them admitted at once are counted.
+ */
+static int strchunk_coldable(struct strchunk *chunk, size_t *nrecs,
+			     size_t *text_s, size_t *nruns)
+{
+	uint64_t ts = 0;
+	*nrecs = 0;
+	*text_s = 0;
+	*nruns = 0;
+	for (size_t i = 0; i < chunk->sealed_nrecs; i++) {
+		struct strrec *rec = &chunk->recs[i];
+		int state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+		if (state == STRREC_BUSY)
+			return -1;
+		if (i < chunk->start || !rec->held)
+			continue;
+		if (rec->timer)
+			return 0;
+		if (!*nrecs || rec->ts != ts)
+			(*nruns)++;
+		ts = rec->ts;
+		(*nrecs)++;
+		if (state == STRREC_READY)
+			*text_s += rec->str_s + 1;
+	}
+	return 1;
+}
+
+/* Block goes in as is if it doesn't get smaller */
+static int strcold_add(struct strcold *cold, size_t raw_s, size_t *data_s,
+		       size_t *cap)
+{
+	struct strlist *list = cold->list;
+	size_t lz_s = lz_compress(list->raw, raw_s, list->lz, raw_s - 1);
+	size_t len = lz_s ? lz_s : raw_s;
+
+	if (*data_s + len > *cap) {
+		size_t new_cap = *cap ? *cap * 2 : STRCOLD_BLOCK;
+		while (new_cap < *data_s + len)
+			new_cap *= 2;
+		char *data = realloc(cold->data, new_cap);
+		if (!data)
+			return -1;
+		cold->data = data;
+		*cap = new_cap;
+	}
+	memcpy(&cold->data[*data_s], lz_s ? list->lz : list->raw, len);
+
+	struct strblock *block = &cold->blocks[cold->nblocks++];
+	block->cold = cold;
+	block->off = *data_s;
+	block->raw_s = raw_s;
+	block->data_s = len;
+	*data_s += len;
+	return 0;
+}
+
+/* Output of held strs is packed into blocks, their index goes too */
+static int strchunk_compress(struct strlist *list, struct strchunk *chunk,
+			     size_t nrecs, size_t text_s, size_t nruns)
+{
+	size_t nblocks = (text_s + STRCOLD_BLOCK - 1) / STRCOLD_BLOCK;
+	struct strcold *cold = calloc(1, sizeof(*cold));
+	if (!cold)
+		return -1;
+	cold->list = list;
+	cold->held = malloc(nrecs * sizeof(*cold->held));
+	cold->cancelled = calloc((nrecs + 7) / 8, 1);
+	cold->runs = malloc(nruns * sizeof(*cold->runs));
+	cold->blocks = malloc((nblocks ? nblocks : 1) *
+		sizeof(*cold->blocks));
+	if (!cold->held || !cold->cancelled || !cold->runs || !cold->blocks)
+		goto handle_err;
+
+	size_t raw_s = 0;
+	size_t data_s = 0;
+	size_t cap = 0;
+	for (size_t i = chunk->start; i < chunk->sealed_nrecs; i++) {
+		struct strrec *rec = &chunk->recs[i];
+		if (!rec->held)
+			continue;
+		size_t idx = cold->nrecs++;
+		if (!cold->nruns || cold->runs[cold->nruns - 1].ts != rec->ts) {
+			cold->runs[cold->nruns].idx = idx;
+			cold->runs[cold->nruns++].ts = rec->ts;
+		}
+		cold->held[idx] = rec->held;
+		if (__atomic_load_n(&rec->state, __ATOMIC_ACQUIRE) !=
+				STRREC_READY)
+			cold->cancelled[idx / 8] |= 1 << idx % 8;
+
+		char *str = strrec_text(chunk, rec);
+		for (size_t left = strcold_text_s(cold, idx); left; ) {
+			size_t len = STRCOLD_BLOCK - raw_s < left ?
+				STRCOLD_BLOCK - raw_s : left;
+			memcpy(&list->raw[raw_s], str, len);
+			raw_s += len;
+			str += len;
+			left -= len;
+			if (raw_s == STRCOLD_BLOCK) {
+				if (strcold_add(cold, raw_s, &data_s, &cap) < 0)
+					goto handle_err;
+				raw_s = 0;
+			}
+		}
+	}
+	if (raw_s && strcold_add(cold, raw_s, &data_s, &cap) < 0)
+		goto handle_err;
+	if (data_s) {
+		char *data = realloc(cold->data, data_s);
+		if (data)
+			cold->data = data;
+	}
+	cold->bytes = sizeof(*cold) + nrecs * sizeof(*cold->held) +
+		(nrecs + 7) / 8 + nruns * sizeof(*cold->runs) +
+		nblocks * sizeof(*cold->blocks) + data_s;
+
+	/* Interned text is in blocks now, output may still use the copy */
+	for (size_t i = chunk->start; i < chunk->sealed_nrecs; i++) {
+		struct strrec *rec = &chunk->recs[i];
+		if (rec->held)
+			strrec_unref(list, rec, list->tag);
+	}
+
+	cold->tag = list->tag;
+	chunk->cold = cold;
+	chunk->nranges = 0;
+	chunk->cooling = list->cooling;
+	list->cooling = chunk;
+	STAT_ADD(list, held_bytes, -(chunk->live * sizeof(struct strrec)));
+	STAT_ADD(list, compressed_chunks, 1);
+	STAT_ADD(list, compressed_raw, text_s);
+	STAT_ADD(list, compressed_bytes, data_s);
+	STAT_ADD(list, cold_bytes, cold->bytes);
+	return 0;
+
+handle_err:
+	strcold_delete(cold);
+	return -1;
+}
+
+int strlist_compress(struct strlist *list, uint64_t ticks)
+{
+	while (list->cool != list->admit) {
+		struct strchunk *chunk = list->cool;
+		if (list->ticks - chunk->admit_tick < ticks)
+			return 0;
+
+		size_t nrecs;
+		size_t text_s;
+		size_t nruns;
+		int ret = strchunk_coldable(chunk, &nrecs, &text_s, &nruns);
+		if (ret < 0)
+			return 0;
+		if (ret && nrecs &&
+		    strchunk_compress(list, chunk, nrecs, text_s, nruns) < 0)
+			return -1;
+		list->cool = chunk->next;
+	}
+	return 0;
+}
+
+/* Only header of a compressed chunk is used, the rest goes back */
+static void strchunk_release(struct strchunk *chunk)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t) chunk->text + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t) chunk + chunk->map_s + page - 1) &
+		~(page - 1);
+	madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/* Strs which were being filled when their chunk was unlinked */
+static int strchunk_settled(struct strchunk *chunk)
+{
+	/* Compressed one had none, its index is gone */
+	if (chunk->cold)
+		return 1;
+	for (; chunk->scanned < chunk->sealed_nrecs; chunk->scanned++) {
+		struct strrec *rec = &chunk->recs[chunk->scanned];
+		if (__atomic_load_n(&rec->state, __ATOMIC_ACQUIRE) ==
+				STRREC_BUSY)
+			return 0;
+	}
+	return 1;
+}
+
+void strlist_reclaim(struct strlist *list, uint64_t tag)
+{
+	unsigned epoch = list->epoch;
+
+	/* No appender has a dropped interned str */
+	intern_reclaim(list->intern, tag);
+
+	/* Nor a compressed chunk, only output could use its text */
+	struct strchunk **cooling = &list->cooling;
+	while (*cooling) {
+		struct strchunk *chunk = *cooling;
+		if (tag < chunk->cold->tag) {
+			cooling = &chunk->cooling;
+			continue;
+		}
+		*cooling = chunk->cooling;
+		strchunk_release(chunk);
+	}
+
+	/* Someone who entered before the last flip is still there */
+	if (!list->limbo || __atomic_load_n(&list->active[(epoch + 1) & 1],
+			__ATOMIC_SEQ_CST))
+		return;
+
+	struct strchunk **ptr = &list->limbo;
+	while (*ptr) {
+		struct strchunk *chunk = *ptr;
+		if (chunk->epoch == epoch || tag < chunk->tag ||
+		    !strchunk_settled(chunk)) {
+			ptr = &chunk->limbo;
+			continue;
+		}
+		*ptr = chunk->limbo;
+		if (chunk->cold)
+			STAT_ADD(list, cold_bytes, -chunk->cold->bytes);
+		strchunk_delete(chunk);
+		STAT_ADD(list, freed_chunks, 1);
+	}
+	__atomic_store_n(&list->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+void strlist_stats(struct strlist *list, struct strlist_stats *stats)
+{
+	stats->held_strs = __atomic_load_n(&list->stats.held_strs,
+		__ATOMIC_RELAXED);
+	stats->held_bytes = __atomic_load_n(&list->stats.held_bytes,
+		__ATOMIC_RELAXED);
+	stats->evicted_strs = __atomic_load_n(&list->stats.evicted_strs,
+		__ATOMIC_RELAXED);
+	stats->evicted_bytes = __atomic_load_n(&list->stats.evicted_bytes,
+		__ATOMIC_RELAXED);
+	stats->freed_chunks = __atomic_load_n(&list->stats.freed_chunks,
+		__ATOMIC_RELAXED);
+	stats->expired_strs = __atomic_load_n(&list->stats.expired_strs,
+		__ATOMIC_RELAXED);
+	stats->expired_bytes = __atomic_load_n(&list->stats.expired_bytes,
+		__ATOMIC_RELAXED);
+	stats->compressed_chunks = __atomic_load_n(
+		&list->stats.compressed_chunks, __ATOMIC_RELAXED);
+	stats->compressed_raw = __atomic_load_n(&list->stats.compressed_raw,
+		__ATOMIC_RELAXED);
+	stats->compressed_bytes = __atomic_load_n(
+		&list->stats.compressed_bytes, __ATOMIC_RELAXED);
+	stats->cold_bytes = __atomic_load_n(&list->stats.cold_bytes,
+		__ATOMIC_RELAXED);
+	stats->inflated_bytes = __atomic_load_n(&list->stats.inflated_bytes,
+		__ATOMIC_RELAXED);
+	stats->inflate_ns = __atomic_load_n(&list->stats.inflate_ns,
+		__ATOMIC_RELAXED);
+
+	struct intern_stats in;
+	intern_stats(list->intern, &in);
+	stats->interned_strs = in.hits;
+	stats->intern_strs = in.strs;
+	stats->intern_bytes = in.bytes;
+}
+
+static int strblock_inflate(void *arg, char *buf)
+{
+	struct strblock *block = arg;
+	struct strcold *cold = block->cold;
+	struct timespec start;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (lz_decompress(&cold->data[block->off], block->data_s, buf,
+			block->raw_s) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	STAT_ADD(cold->list, inflated_bytes, block->raw_s);
+	STAT_ADD(cold->list, inflate_ns, (end.tv_sec - start.tv_sec) *
+		1000000000ull + end.tv_nsec - start.tv_nsec);
+	return 0;
+}
+
+/* Blocks which are stored as is are added as they are */
+static int strcold_render(struct strcold *cold,
+			  int (*add)(void *, char *, size_t),
+			  int (*add_fill)(void *, size_t, size_t,
+					  int (*)(void *, char *), void *),
+			  void *arg)
+{
+	size_t skip = cold->skip;
+	for (size_t i = cold->block; i < cold->nblocks; i++) {
+		struct strblock *block = &cold->blocks[i];
+		int ret = block->data_s == block->raw_s ?
+			add(arg, &cold->data[block->off + skip],
+				block->raw_s - skip) :
+			add_fill(arg, skip, block->raw_s - skip,
+				strblock_inflate, block);
+		if (ret < 0)
+			return -1;
+		skip = 0;
+	}
+	return 0;
+}
+
+int strlist_render(struct strlist *list,
+		   int (*add)(void *, char *, size_t),
+		   int (*add_fill)(void *, size_t, size_t,
+				   int (*)(void *, char *), void *),
+		   void *arg)
+{
+	/* Strings appended while rendering are left for the next time */
+	struct strchunk *last = __atomic_load_n(&list->last, __ATOMIC_ACQUIRE);
+	size_t last_nrecs = strchunk_nrecs(last);
+
+	for (struct strchunk *chunk = list->first; chunk != NULL;
+	     chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+		if (chunk->cold) {
+			if (strcold_render(chunk->cold, add, add_fill, arg) < 0)
+				return -1;
+			continue;
+		}
+
+		size_t nrecs = chunk == last ? last_nrecs :
+			strchunk_nrecs(chunk);
+		strchunk_scan(chunk, nrecs);
+
+		for (size_t i = 0; i < chunk->nranges; i++) {
+			if (add(arg, chunk->ranges[i].iov_base,
+					chunk->ranges[i].iov_len) < 0)
+				return -1;
+		}
+
+		/* Entries behind one which is still busy */
+		for (size_t i = chunk->scanned; i < nrecs; i++) {
+			struct strrec *rec = &chunk->recs[i];
+			int state = __atomic_load_n(&rec->state,
+				__ATOMIC_ACQUIRE);
+			if (state == STRREC_EMPTY)
+				return 0;
+			if (state != STRREC_READY || rec->expired)
+				continue;
+			if (add(arg, strrec_text(chunk, rec), rec->str_s + 1) < 0)
+				return -1;
+		}
+		if (chunk == last)
+			break;
 	}
 	return 0;
 }
+
+/* Pending pieces go first, then the one which is made */
+static int strlist_out_fill(void *arg, size_t skip, size_t len,
+			    int (*fill)(void *, char *), void *fill_arg)
+{
+	struct strlist_out *out = arg;
+	char *buf = malloc(skip + len);
+	if (!buf)
+		return -1;
+
+	if (writev_all(out->fd, out->iov, out->iovcnt) < 0)
+		goto handle_err;
+	out->iovcnt = 0;
+	if (fill(fill_arg, buf) < 0)
+		goto handle_err;
+	struct iovec iov = {
+		.iov_base = buf + skip,
+		.iov_len = len
+	};
+	if (writev_all(out->fd, &iov, 1) < 0)
+		goto handle_err;
+	free(buf);
+	return 0;
+
+handle_err:
+	free(buf);
+	return -1;
+}
+
+int strlist_print(struct strlist *list, int fd)
+{
+	struct strlist_out out;
+	out.fd = fd;
+	out.iovcnt = 0;
+
+	if (strlist_render(list, strlist_out_add, strlist_out_fill, &out) < 0)
+		return -1;
+	return writev_all(fd, out.iov, out.iovcnt);
+}
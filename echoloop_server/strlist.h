@@ -2,14 +2,112 @@
 #define STRLIST_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* A simple sting list to use in echoloop_main */
 
+/*
+ * Strings are stored in large chunks one after another, each one
+ * followed by '\n', so chunks hold output ready to be printed. A string
+ * is added either by strlist_append, which copies it, or by reserving
+ * space with strlist_reserve, filling it in place and calling
+ * strlist_commit (or strlist_cancel if it has to be dropped).
+ * strlist_intern adds a str which is already received, all equal ones
+ * added this way share one refcounted copy, and it takes no chunk text.
+ *
+ * Any number of threads may reserve and append at once, nothing here
+ * blocks. States of strings are published with release ordering and
+ * strlist_print reads them with acquire loads, so it never sees a
+ * partly filled string. Strings which are still being filled are
+ * skipped. Printing stops at a string whose reservation is just being
+ * made, the rest shows up on the next print.
+ * strlist_render passes the same output piece by piece to add, pieces
+ * stay valid until their chunk is freed by strlist_reclaim.
+ * strlist_print and strlist_render may run concurrently with appends
+ * (or interrupt one), but not with each other. strlist_delete may not
+ * run concurrently with anything.
+ *
+ * Retention is up to the printer: strlist_evict drops the oldest strs
+ * while the list is over any of the limits, one entry at a time, and
+ * expires strs whose TTL is over, they are not rendered anymore. Chunks
+ * where nothing is held are unlinked. Strs are counted and stamped when
+ * printer sees them first, TTL is counted from there too, so limits are
+ * kept as of the last strlist_evict.
+ * Unlinked chunk is freed by a later strlist_reclaim, once no appender
+ * may still use it and no piece of it can be waiting to be written:
+ * tag of strlist_evict is compared with that of strlist_reclaim, pieces
+ * rendered before the former must be gone by the latter. Evict and
+ * reclaim run in the printer thread, between renders.
+ *
+ * strlist_compress packs chunks whose strs were all admitted at least
+ * some ticks (calls of strlist_evict) ago: output of the strs held there
+ * goes into LZ compressed blocks, with what eviction needs to know of
+ * them, and the rest of the chunk is given back once no output may use
+ * it, by tag like above. Chunks with strs which may expire are left as
+ * they are. Compressed blocks are rendered by add_fill, so they are made
+ * again only when they are written. It runs after strlist_evict, with
+ * the same tag.
+ */
+
+/* Zero means no limit */
+struct strlist_limits {
+	size_t strs;
+	size_t bytes;
+	uint64_t age_ns;
+};
+
+struct strlist_stats {
+	size_t held_strs;	/* Seen by printer and not evicted yet */
+	size_t held_bytes;	/* Text, and the index entry until compressed */
+	size_t evicted_strs;
+	size_t evicted_bytes;
+	size_t freed_chunks;
+	size_t expired_strs;
+	size_t expired_bytes;
+	size_t interned_strs;	/* Added as a reference to an equal one */
+	size_t intern_strs;	/* Distinct interned strs held */
+	size_t intern_bytes;
+	size_t compressed_chunks;
+	size_t compressed_raw;	/* Output which went into blocks */
+	size_t compressed_bytes;	/* And what it took there */
+	size_t cold_bytes;	/* Compressed chunks held now, with index */
+	size_t inflated_bytes;	/* Made again for output */
+	uint64_t inflate_ns;
+};
+
 typedef struct strlist strlist_t;
+typedef struct strrec strrec_t;
 
 strlist_t *strlist_new();
 void strlist_delete(strlist_t *list);
+/* TTL is in ms, 0 if str doesn't expire */
+char *strlist_reserve(strlist_t *list, size_t str_s, uint32_t ttl_ms,
+		      strrec_t **rec);
+/* Commit or cancel the entry as if it were reserved */
+int strlist_intern(strlist_t *list, char *str, size_t str_s,
+		   uint32_t ttl_ms, strrec_t **rec);
+/* Text in chunks which are not evicted, may run concurrently with */
+/* anything but delete */
+size_t strlist_bytes(strlist_t *list);
+/* Times a reservation had to retry because another thread got there first */
+size_t strlist_retries(strlist_t *list);
+void strlist_commit(strlist_t *list, strrec_t *rec);
+void strlist_cancel(strlist_t *list, strrec_t *rec);
 int strlist_append(strlist_t *list, char *str, size_t str_s);
 int strlist_print(strlist_t *list, int fd);
+/* add_fill is called like output_add_fill */
+int strlist_render(strlist_t *list,
+		   int (*add)(void *, char *, size_t),
+		   int (*add_fill)(void *, size_t, size_t,
+				   int (*)(void *, char *), void *),
+		   void *arg);
+/* Returns -1 if out of memory, it may be called again later */
+int strlist_evict(strlist_t *list, struct strlist_limits *lim,
+		  uint64_t now, uint64_t tag);
+/* Returns -1 if out of memory, it may be called again later */
+int strlist_compress(strlist_t *list, uint64_t ticks);
+void strlist_reclaim(strlist_t *list, uint64_t tag);
+/* May be read by any thread */
+void strlist_stats(strlist_t *list, struct strlist_stats *stats);
 
 #endif /* STRLIST_H_ */
@@ -0,0 +1,61 @@
+#include "trace.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+struct trace_file *trace_file = NULL;
+
+int trace_open(char *path, const char **types, unsigned ntypes)
+{
+	if (ntypes > TRACE_TYPES) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t size = sizeof(struct trace_file) +
+		TRACE_RINGS * sizeof(struct trace_ring);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+	/* File is sparse, pages of unused rings are never touched */
+	struct trace_file *file = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED)
+		return -1;
+
+	file->version = TRACE_VERSION;
+	file->nrings = TRACE_RINGS;
+	file->nevents = TRACE_EVENTS;
+	file->ntypes = ntypes;
+	for (unsigned i = 0; i < ntypes; i++)
+		strncpy(file->types[i], types[i], TRACE_NAME_SIZE - 1);
+	/* Reader checks magic last */
+	__atomic_store_n(&file->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+	trace_file = file;
+	return 0;
+}
+
+void trace_record(unsigned ring, uint32_t tid, uint32_t type,
+		  uint64_t start, uint64_t end)
+{
+	if (ring >= TRACE_RINGS)
+		return;
+	struct trace_ring *r = &trace_file->rings[ring];
+	uint64_t head = r->head;
+	struct trace_event *ev = &r->events[head & (TRACE_EVENTS - 1)];
+
+	ev->ts = start;
+	ev->dur = end - start;
+	ev->tid = tid;
+	ev->type = type;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,60 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Optional binary trace: every thread writes events into own ring in a
+ * file mapped with MAP_SHARED, so readers map the same file, while the
+ * server runs or after it. Ring head is stored after the event with
+ * release ordering. Reader takes events below head which can't have
+ * been overwritten during the read, see tracedump.c.
+ *
+ * While trace isn't open, trace_add is one predictable branch.
+ */
+
+#define TRACE_MAGIC     0x45525445	/* "ETRE" */
+#define TRACE_VERSION   1
+#define TRACE_RINGS     64	/* Threads beyond are not traced */
+#define TRACE_EVENTS    8192	/* Per ring, power of two */
+#define TRACE_TYPES     16
+#define TRACE_NAME_SIZE 16
+
+struct trace_event {
+	uint64_t ts;	/* Start, CLOCK_MONOTONIC ns */
+	uint64_t dur;	/* ns */
+	uint32_t tid;
+	uint32_t type;
+};
+
+struct trace_ring {
+	uint64_t head;	/* Events written so far */
+	char pad[56];	/* Heads of threads are on own cache lines */
+	struct trace_event events[TRACE_EVENTS];
+};
+
+struct trace_file {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nrings;
+	uint32_t nevents;
+	uint32_t ntypes;
+	char types[TRACE_TYPES][TRACE_NAME_SIZE];
+	struct trace_ring rings[];
+};
+
+extern struct trace_file *trace_file;
+
+/* Must be called before threads which record are started */
+int trace_open(char *path, const char **types, unsigned ntypes);
+void trace_record(unsigned ring, uint32_t tid, uint32_t type,
+		  uint64_t start, uint64_t end);
+
+static inline void trace_add(unsigned ring, uint32_t tid, uint32_t type,
+			     uint64_t start, uint64_t end)
+{
+	if (__builtin_expect(trace_file != 0, 0))
+		trace_record(ring, tid, type, start, end);
+}
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,96 @@
+#include "trace.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Converts trace file of echoloop server to Chrome trace JSON */
+
+static int first = 1;
+
+void dump_event(struct trace_file *file, struct trace_event *ev)
+{
+	const char *name = ev->type < file->ntypes ?
+		file->types[ev->type] : "unknown";
+	printf("%s\n{\"name\": \"%.*s\", \"ph\": \"X\", \"ts\": %.3f, "
+		"\"dur\": %.3f, \"pid\": 1, \"tid\": %u}", first ? "" : ",",
+		TRACE_NAME_SIZE, name, ev->ts / 1e3, ev->dur / 1e3, ev->tid);
+	first = 0;
+}
+
+/* Ring may be written meanwhile, events it could overwrite are skipped */
+void dump_ring(struct trace_file *file, struct trace_ring *ring,
+	       struct trace_event *copy)
+{
+	uint64_t n = file->nevents;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t low = head > n ? head - n : 0;
+
+	for (uint64_t i = low; i < head; i++)
+		copy[i - low] = ring->events[i & (n - 1)];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	/* Event i is rewritten while head is i + n */
+	uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	uint64_t valid = now >= n ? now - n + 1 : 0;
+	for (uint64_t i = valid > low ? valid : low; i < head; i++)
+		dump_event(file, &copy[i - low]);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s trace_file\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror("Error: open");
+		exit(EXIT_FAILURE);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("Error: fstat");
+		exit(EXIT_FAILURE);
+	}
+	if (st.st_size < sizeof(struct trace_file)) {
+		fprintf(stderr, "Error: not a trace file\n");
+		exit(EXIT_FAILURE);
+	}
+	struct trace_file *file = mmap(NULL, st.st_size, PROT_READ,
+		MAP_SHARED, fd, 0);
+	if (file == MAP_FAILED) {
+		perror("Error: mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	if (__atomic_load_n(&file->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC ||
+	    file->version != TRACE_VERSION ||
+	    file->nevents != TRACE_EVENTS ||
+	    st.st_size < sizeof(struct trace_file) +
+			(size_t) file->nrings * sizeof(struct trace_ring)) {
+		fprintf(stderr, "Error: not a trace file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct trace_event *copy = malloc(file->nevents * sizeof(*copy));
+	if (!copy) {
+		perror("Error: malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	for (uint32_t i = 0; i < file->nrings; i++)
+		dump_ring(file, &file->rings[i], copy);
+	printf("\n]}\n");
+
+	free(copy);
+	return 0;
+}
@@ -0,0 +1,515 @@
+#define _GNU_SOURCE
+#include "wal.h"
+#include "io.h"
+#include "stats.h"
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WAL_MAGIC       "ECHOWAL2"
+#define WAL_MAGIC_S     (sizeof(WAL_MAGIC) - 1)
+#define WAL_BUF_SIZE    (64 << 10)
+#define WAL_BUF_KEEP    (4 << 20)	/* Larger batch buffer is not kept */
+#define WAL_COMPACT_MIN (16 << 20)	/* Smaller log is never compacted */
+
+/* Record header, str follows. Times are realtime ms, to survive restarts */
+struct wal_rec {
+	uint64_t time_ms;
+	uint64_t expire_ms;	/* Zero if it never expires */
+	uint32_t str_s;
+	uint32_t sum;		/* Of the header before it and str */
+};
+
+/* Lsn counts bytes ever appended, the file shrinks when it is compacted */
+struct wal {
+	int fd;
+	int efd;
+	char *path;
+	uint64_t interval_ns;
+	struct strlist_limits lim;
+	size_t size;		/* Of the file, only for the log thread */
+	size_t compact_at;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t more;	/* Batch is not empty */
+	pthread_cond_t synced;
+	char *buf;		/* Batch being gathered */
+	size_t buf_s;
+	size_t len;
+	char *spare;		/* Batch being written */
+	size_t spare_s;
+	uint64_t lsn;		/* End of the last record */
+	uint64_t durable;
+	int err;		/* Log is stopped if set */
+	int stop;
+	struct wal_stats stats;
+};
+
+/* FNV-1a */
+static uint32_t wal_sum(struct wal_rec *rec, const char *str)
+{
+	const unsigned char *ptr = (const unsigned char *) rec;
+	uint32_t sum = 2166136261u;
+
+	for (size_t i = 0; i < offsetof(struct wal_rec, sum); i++)
+		sum = (sum ^ ptr[i]) * 16777619u;
+	ptr = (const unsigned char *) str;
+	for (size_t i = 0; i < rec->str_s; i++)
+		sum = (sum ^ ptr[i]) * 16777619u;
+	return sum;
+}
+
+static uint64_t wal_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/* Returns 1 if a whole record with a right sum is at off */
+static int wal_rec_at(char *map, size_t size, size_t off, struct wal_rec *rec)
+{
+	if (size - off < sizeof(*rec))
+		return 0;
+	memcpy(rec, &map[off], sizeof(*rec));
+	return rec->str_s <= size - off - sizeof(*rec) &&
+		wal_sum(rec, &map[off + sizeof(*rec)]) == rec->sum;
+}
+
+/* Expired or too old record is not in the list any more */
+static int wal_live(struct wal *wal, struct wal_rec *rec, uint64_t now_ms)
+{
+	if (rec->expire_ms && rec->expire_ms <= now_ms)
+		return 0;
+	return !wal->lim.age_ns ||
+		rec->time_ms + wal->lim.age_ns / 1000000 > now_ms;
+}
+
+/*
+ * Returns the offset of the first record kept by the retention limits
+ * and sets end past the last valid one. The list evicts its oldest strs
+ * first, so the live records from there on are what it would hold. Str
+ * bytes are counted without the index, so a little more is kept.
+ */
+static size_t wal_window(struct wal *wal, char *map, size_t size,
+			 uint64_t now_ms, size_t *end)
+{
+	struct wal_rec rec;
+	size_t strs = 0, bytes = 0, off;
+
+	for (off = WAL_MAGIC_S; wal_rec_at(map, size, off, &rec);
+	     off += sizeof(rec) + rec.str_s) {
+		if (wal_live(wal, &rec, now_ms)) {
+			strs++;
+			bytes += rec.str_s + 1;
+		}
+	}
+	*end = off;
+
+	for (off = WAL_MAGIC_S; off < *end &&
+	     ((wal->lim.strs && strs > wal->lim.strs) ||
+	      (wal->lim.bytes && bytes > wal->lim.bytes));
+	     off += sizeof(rec) + rec.str_s) {
+		wal_rec_at(map, size, off, &rec);
+		if (wal_live(wal, &rec, now_ms)) {
+			strs--;
+			bytes -= rec.str_s + 1;
+		}
+	}
+	return off;
+}
+
+/* New file is there after a crash once its directory entry is synced */
+static int wal_sync_dir(char *path)
+{
+	char *copy = strdup(path);
+	if (!copy)
+		return -1;
+	int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(copy);
+	if (fd < 0)
+		return -1;
+	int ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Live records in the window are replayed with what is left of their
+ * ttl. Everything after a torn or corrupt record is cut off.
+ */
+static int wal_replay(struct wal *wal,
+		      int (*add)(void *, char *, size_t, uint32_t), void *arg)
+{
+	struct stat st;
+	if (fstat(wal->fd, &st) < 0)
+		return -1;
+	if (!st.st_size) {
+		if (writen(wal->fd, WAL_MAGIC, WAL_MAGIC_S) != WAL_MAGIC_S ||
+		    fdatasync(wal->fd) < 0 || wal_sync_dir(wal->path) < 0)
+			return -1;
+		wal->size = wal->lsn = wal->durable = WAL_MAGIC_S;
+		return 0;
+	}
+
+	size_t size = st.st_size;
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, wal->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	/* Never cut something which is not a log */
+	if (size < WAL_MAGIC_S || memcmp(map, WAL_MAGIC, WAL_MAGIC_S)) {
+		munmap(map, size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t now = wal_now_ms();
+	size_t end;
+	for (size_t off = wal_window(wal, map, size, now, &end); off < end; ) {
+		struct wal_rec rec;
+		memcpy(&rec, &map[off], sizeof(rec));
+		char *str = &map[off + sizeof(rec)];
+		off += sizeof(rec) + rec.str_s;
+		if (!wal_live(wal, &rec, now))
+			continue;
+		uint32_t ttl_ms = rec.expire_ms ? rec.expire_ms - now : 0;
+		if (add(arg, str, rec.str_s, ttl_ms) < 0) {
+			munmap(map, size);
+			return -1;
+		}
+		wal->stats.replayed++;
+	}
+	munmap(map, size);
+
+	if (end < size && (ftruncate(wal->fd, end) < 0 ||
+			   fdatasync(wal->fd) < 0))
+		return -1;
+	wal->size = wal->lsn = wal->durable = end;
+	return 0;
+}
+
+/*
+ * Rewrites the log with only what replay would bring back, into a new
+ * file which is renamed over it. If that fails the old log goes on. It
+ * is -1 only if the new log is in place but may not be found after a
+ * crash, then appends can't go on.
+ */
+static int wal_compact(struct wal *wal)
+{
+	char *tmp = NULL;
+	int fd = -1;
+	char *map = mmap(NULL, wal->size, PROT_READ, MAP_PRIVATE, wal->fd, 0);
+	if (map == MAP_FAILED)
+		goto handle_err;
+
+	uint64_t now = wal_now_ms();
+	size_t end, start = wal_window(wal, map, wal->size, now, &end);
+	size_t size = WAL_MAGIC_S;
+	for (size_t off = start; off < end; ) {
+		struct wal_rec rec;
+		memcpy(&rec, &map[off], sizeof(rec));
+		off += sizeof(rec) + rec.str_s;
+		if (wal_live(wal, &rec, now))
+			size += sizeof(rec) + rec.str_s;
+	}
+	/* Nothing to drop yet */
+	if (size == wal->size)
+		goto handle_done;
+
+	if (asprintf(&tmp, "%s.tmp", wal->path) < 0) {
+		tmp = NULL;
+		goto handle_err;
+	}
+	fd = open(tmp, O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  0644);
+	if (fd < 0 || writen(fd, WAL_MAGIC, WAL_MAGIC_S) != WAL_MAGIC_S)
+		goto handle_err;
+	for (size_t off = start; off < end; ) {
+		struct wal_rec rec;
+		memcpy(&rec, &map[off], sizeof(rec));
+		size_t rec_s = sizeof(rec) + rec.str_s;
+		if (wal_live(wal, &rec, now) &&
+		    writen(fd, &map[off], rec_s) != rec_s)
+			goto handle_err;
+		off += rec_s;
+	}
+	if (fdatasync(fd) < 0 || rename(tmp, wal->path) < 0)
+		goto handle_err;
+
+	munmap(map, wal->size);
+	free(tmp);
+	close(wal->fd);
+	wal->fd = fd;
+	wal->size = size;
+	pthread_mutex_lock(&wal->lock);
+	wal->stats.compactions++;
+	pthread_mutex_unlock(&wal->lock);
+	wal->compact_at = size * 2 > WAL_COMPACT_MIN ? size * 2 :
+		WAL_COMPACT_MIN;
+	return wal_sync_dir(wal->path);
+
+handle_err:
+	perror("Error: wal compact");
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+handle_done:
+	if (map != MAP_FAILED)
+		munmap(map, wal->size);
+	wal->compact_at = wal->size * 2;
+	return 0;
+}
+
+/* Log grown twice since it was compacted is compacted before the write */
+static int wal_write(struct wal *wal, char *batch, size_t len)
+{
+	if (wal->size >= wal->compact_at && wal_compact(wal) < 0)
+		return -1;
+	if (writen(wal->fd, batch, len) != len || fdatasync(wal->fd) < 0)
+		return -1;
+	wal->size += len;
+	return 0;
+}
+
+static void *wal_thread(void *ptr)
+{
+	struct wal *wal = ptr;
+
+	pthread_mutex_lock(&wal->lock);
+	while (1) {
+		while (!wal->len && !wal->stop)
+			pthread_cond_wait(&wal->more, &wal->lock);
+		if (!wal->len)
+			break;
+
+		/* Records which come meanwhile join the batch */
+		if (wal->interval_ns) {
+			pthread_mutex_unlock(&wal->lock);
+			struct timespec ts = {
+				.tv_sec  = wal->interval_ns / 1000000000,
+				.tv_nsec = wal->interval_ns % 1000000000
+			};
+			while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+				;
+			pthread_mutex_lock(&wal->lock);
+		}
+
+		char *batch = wal->buf;
+		size_t batch_s = wal->buf_s;
+		size_t len = wal->len;
+		uint64_t lsn = wal->lsn;
+		wal->buf = wal->spare;
+		wal->buf_s = wal->spare_s;
+		wal->len = 0;
+		pthread_mutex_unlock(&wal->lock);
+
+		uint64_t start = stats_now();
+		int ret = wal_write(wal, batch, len);
+		int err = errno;
+		stats_stage(STATS_COMMIT, start);
+		if (batch_s > WAL_BUF_KEEP) {
+			free(batch);
+			batch = NULL;
+			batch_s = 0;
+		}
+
+		pthread_mutex_lock(&wal->lock);
+		wal->spare = batch;
+		wal->spare_s = batch_s;
+		if (ret < 0) {
+			/* Pages which failed to sync may be dropped by now */
+			errno = err;
+			perror("Error: wal write");
+			__atomic_store_n(&wal->err, err ? err : EIO,
+				__ATOMIC_RELEASE);
+		} else {
+			__atomic_store_n(&wal->durable, lsn, __ATOMIC_RELEASE);
+			wal->stats.commits++;
+		}
+		pthread_cond_broadcast(&wal->synced);
+		uint64_t one = 1;
+		if (write(wal->efd, &one, sizeof(one)) < 0)
+			perror("Error: eventfd write");
+		if (ret < 0)
+			break;
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return NULL;
+}
+
+struct wal *wal_new(char *path, uint64_t interval_ns,
+		    const struct strlist_limits *lim,
+		    int (*add)(void *, char *, size_t, uint32_t), void *arg)
+{
+	int ret;
+	struct wal *wal = calloc(1, sizeof(*wal));
+	if (!wal)
+		return NULL;
+	wal->interval_ns = interval_ns;
+	wal->lim = *lim;
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->more, NULL);
+	pthread_cond_init(&wal->synced, NULL);
+
+	wal->path = strdup(path);
+	wal->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	wal->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (!wal->path || wal->efd < 0 || wal->fd < 0)
+		goto handle_err;
+	if (wal_replay(wal, add, arg) < 0)
+		goto handle_err;
+	wal->compact_at = wal->size * 2 > WAL_COMPACT_MIN ? wal->size * 2 :
+		WAL_COMPACT_MIN;
+
+	/* Signals are left to the threads doing the real work */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&wal->thread, NULL, wal_thread, wal);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		errno = ret;
+		goto handle_err;
+	}
+	return wal;
+
+handle_err:
+	ret = errno;
+	if (wal->efd >= 0)
+		close(wal->efd);
+	if (wal->fd >= 0)
+		close(wal->fd);
+	free(wal->path);
+	pthread_cond_destroy(&wal->synced);
+	pthread_cond_destroy(&wal->more);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal);
+	errno = ret;
+	return NULL;
+}
+
+/* Batch which is gathered is written first */
+void wal_delete(struct wal *wal)
+{
+	pthread_mutex_lock(&wal->lock);
+	wal->stop = 1;
+	pthread_cond_signal(&wal->more);
+	pthread_mutex_unlock(&wal->lock);
+	pthread_join(wal->thread, NULL);
+
+	close(wal->efd);
+	close(wal->fd);
+	free(wal->path);
+	free(wal->buf);
+	free(wal->spare);
+	pthread_cond_destroy(&wal->synced);
+	pthread_cond_destroy(&wal->more);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal);
+}
+
+int wal_append(struct wal *wal, char *str, size_t str_s, uint32_t ttl_ms,
+	       uint64_t *lsn)
+{
+	if (str_s > UINT32_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	uint64_t now = wal_now_ms();
+	struct wal_rec rec = {
+		.time_ms   = now,
+		.expire_ms = ttl_ms ? now + ttl_ms : 0,
+		.str_s     = str_s
+	};
+	rec.sum = wal_sum(&rec, str);
+	size_t need = sizeof(rec) + str_s;
+
+	pthread_mutex_lock(&wal->lock);
+	if (wal->err) {
+		errno = wal->err;
+		goto handle_err;
+	}
+	if (wal->len + need > wal->buf_s) {
+		size_t buf_s = wal->buf_s ? wal->buf_s : WAL_BUF_SIZE;
+		while (buf_s < wal->len + need)
+			buf_s *= 2;
+		char *buf = realloc(wal->buf, buf_s);
+		if (!buf)
+			goto handle_err;
+		wal->buf = buf;
+		wal->buf_s = buf_s;
+	}
+
+	memcpy(&wal->buf[wal->len], &rec, sizeof(rec));
+	memcpy(&wal->buf[wal->len + sizeof(rec)], str, str_s);
+	if (!wal->len)
+		pthread_cond_signal(&wal->more);
+	wal->len += need;
+	wal->lsn += need;
+	*lsn = wal->lsn;
+	wal->stats.records++;
+	wal->stats.bytes += need;
+	pthread_mutex_unlock(&wal->lock);
+	return 0;
+
+handle_err:
+	pthread_mutex_unlock(&wal->lock);
+	return -1;
+}
+
+int wal_wait(struct wal *wal, uint64_t lsn)
+{
+	int ret = wal_synced(wal, lsn);
+	if (ret)
+		return ret < 0 ? -1 : 0;
+
+	pthread_mutex_lock(&wal->lock);
+	while (wal->durable < lsn && !wal->err)
+		pthread_cond_wait(&wal->synced, &wal->lock);
+	ret = 0;
+	if (wal->durable < lsn) {
+		errno = wal->err;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return ret;
+}
+
+int wal_synced(struct wal *wal, uint64_t lsn)
+{
+	if (__atomic_load_n(&wal->durable, __ATOMIC_ACQUIRE) >= lsn)
+		return 1;
+	int err = __atomic_load_n(&wal->err, __ATOMIC_ACQUIRE);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int wal_fd(struct wal *wal)
+{
+	return wal->efd;
+}
+
+void wal_stats(struct wal *wal, struct wal_stats *stats)
+{
+	pthread_mutex_lock(&wal->lock);
+	*stats = wal->stats;
+	pthread_mutex_unlock(&wal->lock);
+}
@@ -0,0 +1,60 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include "strlist.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Write-ahead log of received strs. wal_append copies a record into the
+ * batch being gathered and returns its lsn, which counts the bytes
+ * appended up to the end of the record. A log thread writes out the
+ * whole batch with one write and one fdatasync, then everyone waiting
+ * for an lsn up to there goes on. With a commit interval the log thread
+ * waits that long after the first record of a batch, so more records
+ * join it. Otherwise the next batch is whatever came while the last one
+ * was being synced.
+ *
+ * Records have a checksum and keep their absolute expiry. wal_new
+ * replays the log through add, in the order records were appended, with
+ * what is left of each ttl, and cuts off a torn tail, which no one was
+ * told about. Expired records and those the retention limits would have
+ * evicted by now are skipped. A str which was logged but not acked may
+ * be replayed too. Once the log doubled since it was last compacted,
+ * the log thread rewrites it with only what replay would bring back,
+ * before its next write. If writing fails the log stops, all waits and
+ * appends fail after that.
+ *
+ * wal_append, wal_wait and wal_synced may be called by any thread.
+ */
+
+struct wal_stats {
+	size_t records;
+	size_t bytes;
+	size_t commits;		/* Batches written and synced */
+	size_t replayed;
+	size_t compactions;
+};
+
+typedef struct wal wal_t;
+
+/*
+ * Interval is in ns, 0 to commit as soon as the last commit is done.
+ * Limits are the retention of the list the log is replayed into.
+ */
+wal_t *wal_new(char *path, uint64_t interval_ns,
+	       const struct strlist_limits *lim,
+	       int (*add)(void *, char *, size_t, uint32_t), void *arg);
+void wal_delete(wal_t *wal);
+int wal_append(wal_t *wal, char *str, size_t str_s, uint32_t ttl_ms,
+	       uint64_t *lsn);
+/* Blocks until lsn is durable */
+int wal_wait(wal_t *wal, uint64_t lsn);
+/* Returns 1 if lsn is durable, 0 if not yet and -1 if log is stopped */
+int wal_synced(wal_t *wal, uint64_t lsn);
+/* Readable after each commit, reading it clears it */
+int wal_fd(wal_t *wal);
+void wal_stats(wal_t *wal, struct wal_stats *stats);
+
+#endif /* WAL_H_ */
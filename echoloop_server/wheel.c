@@ -0,0 +1,198 @@
+#include "wheel.h"
+
+#include <stdlib.h>
+
+#define WHEEL_BITS    6
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_MASK    (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS  6
+#define WHEEL_MAX_REM (((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/*
+ * Timer is on level which matches its remaining time, in the slot its
+ * expiry falls into, so slots are looked at when time passes them. A
+ * timer of an upper level is put one slot early and moved down when
+ * that slot passes.
+ */
+struct wheel {
+	uint64_t res_ns;
+	uint64_t now;		/* In units */
+	size_t pending;
+	uint64_t occupied[WHEEL_LEVELS];
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	struct wheel_timer *expired;	/* Already due when added */
+	struct wheel_timer *free;	/* Reused, linked by next */
+};
+
+static inline uint64_t rotl(uint64_t val, int n)
+{
+	return n ? val << n | val >> (64 - n) : val;
+}
+
+static inline uint64_t rotr(uint64_t val, int n)
+{
+	return n ? val >> n | val << (64 - n) : val;
+}
+
+static void wheel_link(struct wheel_timer **head, struct wheel_timer *timer)
+{
+	timer->next = *head;
+	if (*head)
+		(*head)->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void wheel_unlink(struct wheel_timer *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+}
+
+static void wheel_sched(struct wheel *wheel, struct wheel_timer *timer)
+{
+	if (timer->expires <= wheel->now) {
+		wheel_link(&wheel->expired, timer);
+		return;
+	}
+
+	uint64_t rem = timer->expires - wheel->now;
+	if (rem > WHEEL_MAX_REM)
+		rem = WHEEL_MAX_REM;
+	int level = (63 - __builtin_clzll(rem)) / WHEEL_BITS;
+	int slot = WHEEL_MASK & ((timer->expires >> (level * WHEEL_BITS)) -
+		!!level);
+	wheel_link(&wheel->slots[level][slot], timer);
+	wheel->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+struct wheel *wheel_new(uint64_t res_ns, uint64_t now_ns)
+{
+	struct wheel *wheel = calloc(1, sizeof(*wheel));
+	if (!wheel)
+		return NULL;
+	wheel->res_ns = res_ns;
+	wheel->now = now_ns / res_ns;
+	return wheel;
+}
+
+static void wheel_free_list(struct wheel_timer *timer)
+{
+	while (timer) {
+		struct wheel_timer *next = timer->next;
+		free(timer);
+		timer = next;
+	}
+}
+
+void wheel_delete(struct wheel *wheel)
+{
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+			wheel_free_list(wheel->slots[level][slot]);
+	}
+	wheel_free_list(wheel->expired);
+	wheel_free_list(wheel->free);
+	free(wheel);
+}
+
+struct wheel_timer *wheel_add(struct wheel *wheel, uint64_t expires_ns,
+			      void *ptr, void *owner)
+{
+	struct wheel_timer *timer = wheel->free;
+	if (timer) {
+		wheel->free = timer->next;
+	} else {
+		timer = malloc(sizeof(*timer));
+		if (!timer)
+			return NULL;
+	}
+
+	/* Rounded up, timer never fires early */
+	timer->expires = (expires_ns + wheel->res_ns - 1) / wheel->res_ns;
+	timer->ptr = ptr;
+	timer->owner = owner;
+	wheel_sched(wheel, timer);
+	wheel->pending++;
+	return timer;
+}
+
+static void wheel_put(struct wheel *wheel, struct wheel_timer *timer)
+{
+	timer->next = wheel->free;
+	wheel->free = timer;
+	wheel->pending--;
+}
+
+/* Slot bit stays set if the slot becomes empty, advance skips it then */
+void wheel_cancel(struct wheel *wheel, struct wheel_timer *timer)
+{
+	wheel_unlink(timer);
+	wheel_put(wheel, timer);
+}
+
+void wheel_advance(struct wheel *wheel, uint64_t now_ns,
+		   void (*fire)(void *, void *, void *), void *arg)
+{
+	uint64_t now = now_ns / wheel->res_ns;
+	struct wheel_timer *todo = wheel->expired;
+	wheel->expired = NULL;
+
+	uint64_t elapsed = now > wheel->now ? now - wheel->now : 0;
+	for (int level = 0; elapsed && level < WHEEL_LEVELS; level++) {
+		int shift = level * WHEEL_BITS;
+		uint64_t passed;
+
+		/* Slots from the old time to the new one, both included */
+		if ((elapsed >> shift) > WHEEL_MASK) {
+			passed = ~(uint64_t) 0;
+		} else {
+			int n = WHEEL_MASK & (elapsed >> shift);
+			int oslot = WHEEL_MASK & (wheel->now >> shift);
+			int nslot = WHEEL_MASK & (now >> shift);
+			uint64_t run = ((uint64_t) 1 << n) - 1;
+			passed = rotl(run, oslot) | rotr(rotl(run, nslot), n) |
+				(uint64_t) 1 << nslot;
+		}
+
+		uint64_t slots = passed & wheel->occupied[level];
+		wheel->occupied[level] &= ~slots;
+		while (slots) {
+			int slot = __builtin_ctzll(slots);
+			slots &= slots - 1;
+
+			struct wheel_timer *timer = wheel->slots[level][slot];
+			wheel->slots[level][slot] = NULL;
+			while (timer) {
+				struct wheel_timer *next = timer->next;
+				wheel_link(&todo, timer);
+				timer = next;
+			}
+		}
+
+		/* Upper level ticks only if this one wrapped around */
+		if (!(passed & 1))
+			break;
+		if (elapsed < (uint64_t) WHEEL_SLOTS << shift)
+			elapsed = (uint64_t) WHEEL_SLOTS << shift;
+	}
+	wheel->now = now;
+
+	/* Timers which are not due yet go down a level */
+	while (todo) {
+		struct wheel_timer *timer = todo;
+		todo = timer->next;
+		if (timer->expires > now) {
+			wheel_sched(wheel, timer);
+			continue;
+		}
+		fire(arg, timer->ptr, timer->owner);
+		wheel_put(wheel, timer);
+	}
+}
+
+size_t wheel_pending(struct wheel *wheel)
+{
+	return wheel->pending;
+}
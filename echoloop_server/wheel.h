@@ -0,0 +1,40 @@
+#ifndef WHEEL_H_
+#define WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel. Time is counted in units of res_ns, each
+ * level has 64 slots and a bitmap of those which are not empty, so
+ * wheel_advance costs the number of levels plus the timers it fires or
+ * moves down, however many are pending and however long it wasn't
+ * called. Timers further than the top level reaches are put there and
+ * moved back when it comes around.
+ *
+ * Timers fire once their time is passed, in no particular order, and
+ * are gone after the callback, which may not add or cancel timers.
+ * Nothing here is thread safe.
+ */
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev;
+	uint64_t expires;	/* In units */
+	void *ptr;
+	void *owner;
+};
+
+typedef struct wheel wheel_t;
+
+wheel_t *wheel_new(uint64_t res_ns, uint64_t now_ns);
+void wheel_delete(wheel_t *wheel);
+/* Returns NULL if out of memory */
+struct wheel_timer *wheel_add(wheel_t *wheel, uint64_t expires_ns,
+			      void *ptr, void *owner);
+void wheel_cancel(wheel_t *wheel, struct wheel_timer *timer);
+void wheel_advance(wheel_t *wheel, uint64_t now_ns,
+		   void (*fire)(void *, void *, void *), void *arg);
+size_t wheel_pending(wheel_t *wheel);
+
+#endif /* WHEEL_H_ */